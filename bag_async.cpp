@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_async.hpp"
+#pragma GCC diagnostic pop
+
+#ifdef BAG_RDR_HAS_COROUTINES
+
+#include <cstdio>
+
+bag_async_view::bag_async_view(bag_rdr::view v, executor exec)
+: m_view(std::move(v)), m_it(m_view.begin()), m_end(m_view.end()), m_exec(std::move(exec))
+{ }
+
+bag_async_view::next_awaiter bag_async_view::next()
+{
+    if (m_started && !(m_it == m_end))
+        ++m_it;
+    m_started = true;
+    m_pending = false;
+    if (m_failed || (m_it == m_end))
+        return next_awaiter{*this};
+
+    size_t chunk_index;
+    if (!m_view.rdr.locate(m_it.handle(), chunk_index, m_offset)) {
+        fprintf(stderr, "bag_rdr: async view: message not found in the index\n");
+        m_failed = true;
+        return next_awaiter{*this};
+    }
+    if (chunk_index != m_chunk_index) {
+        m_chunk_index = chunk_index;
+        m_memory = {};
+        m_pending = true;
+    }
+    return next_awaiter{*this};
+}
+
+void bag_async_view::load_then(std::coroutine_handle<> h)
+{
+    m_exec([this, h] {
+        m_memory = m_view.rdr.uncompressed_chunk(m_chunk_index, m_buffer);
+        if (!m_memory.size()) {
+            fprintf(stderr, "bag_rdr: async view: chunk %zu couldn't be read\n", m_chunk_index);
+            m_failed = true;
+        } else if (m_memory.data() != m_buffer.data()) {
+            // mapped, fault its pages in here rather than on the caller's thread
+            volatile char sink;
+            for (size_t i = 0; i < m_memory.size(); i += 4096)
+                sink = m_memory[i];
+            (void)sink;
+        }
+        h.resume();
+    });
+}
+
+const bag_rdr::message* bag_async_view::current()
+{
+    if (m_failed || (m_it == m_end))
+        return nullptr;
+    bool found = false;
+    const bool read = m_view.rdr.for_each_chunk_message_at(m_chunk_index, {&m_offset, 1}, m_memory,
+                                                          [this, &found] (const bag_rdr::chunk_message& cm) {
+        m_message = bag_rdr::message{.stamp = cm.stamp,
+                                     .md5 = cm.md5(),
+                                     .message_data_block = bag_rdr::message_payload{cm.data},
+                                     .connection = cm.connection};
+        found = true;
+    });
+    if (!read || !found) {
+        m_failed = true;
+        return nullptr;
+    }
+    return &m_message;
+}
+
+#endif // BAG_RDR_HAS_COROUTINES
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_ASYNC_HPP
+#define BAG_ASYNC_HPP
+
+#include "bag_rdr.hpp"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define BAG_RDR_HAS_COROUTINES 1
+#endif
+
+#ifdef BAG_RDR_HAS_COROUTINES
+
+#include <coroutine>
+#include <functional>
+#include <vector>
+
+/**
+ * A view for C++20 coroutines that doesn't block on chunk loads:
+ *
+ *   bag_async_view messages{bag.get_view().with_topics({"/odom"}), pool_post};
+ *   while (const bag_rdr::message* msg = co_await messages.next())
+ *       co_await send(*msg);
+ *
+ * Stepping through the index runs inline. When the next message is in
+ * another chunk, the awaiting coroutine is suspended while the executor
+ * runs the load, decompressing the chunk, or touching the pages of an
+ * uncompressed one so they are faulted in, and then resumes it on the
+ * executor's thread. Messages in the chunk already held don't suspend.
+ *
+ * Holds one decompressed chunk; a message is valid until the following
+ * next(). Not movable, as the view's iterator refers to it.
+ */
+struct bag_async_view
+{
+    // runs work, on another thread
+    using executor = std::function<void (std::function<void ()> work)>;
+
+    bag_async_view(bag_rdr::view v, executor exec);
+    bag_async_view(const bag_async_view&) = delete;
+    bag_async_view& operator=(const bag_async_view&) = delete;
+
+    struct next_awaiter
+    {
+        bag_async_view& v;
+        bool await_ready() const { return !v.m_pending; }
+        void await_suspend(std::coroutine_handle<> h) { v.load_then(h); }
+        // nullptr at the end of the view
+        const bag_rdr::message* await_resume() { return v.current(); }
+    };
+    next_awaiter next();
+
+    // iteration ended early as a chunk couldn't be read
+    bool failed() const { return m_failed; }
+
+    // detail
+    void load_then(std::coroutine_handle<> h);
+    const bag_rdr::message* current();
+
+    bag_rdr::view m_view;
+    bag_rdr::view::iterator m_it, m_end;
+    executor m_exec;
+    bool m_started = false;
+    bool m_failed = false;
+    // the next message's chunk isn't loaded yet
+    bool m_pending = false;
+    size_t m_chunk_index = size_t(-1);
+    uint32_t m_offset = 0;
+    std::vector<char> m_buffer;
+    common::array_view<const char> m_memory;
+    bag_rdr::message m_message;
+};
+
+#endif // BAG_RDR_HAS_COROUTINES
+
+#endif // BAG_ASYNC_HPP
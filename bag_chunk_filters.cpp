@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_chunk_filters.hpp"
+#pragma GCC diagnostic pop
+
+#include "bag_hash.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using common::result;
+using common::ok;
+using common::unix_err;
+
+static const char* const section_prefix = "filter:";
+
+static bool s_accept_field(const bag_field_accessor& accessor)
+{
+    return accessor.is_numeric() || (accessor.leaf_type() == bag_msg_schema::prim::STRING);
+}
+
+// Kirsch-Mitzenmacher double hashing off one 64 bit hash
+static uint32_t s_bloom_bit(uint64_t hash, uint32_t i, uint32_t bits)
+{
+    const uint64_t h1 = hash;
+    const uint64_t h2 = bag_hash::rotl(hash, 32) | 1;
+    return uint32_t((h1 + i * h2) % bits);
+}
+
+void bag_chunk_filters::bloom_insert(uint64_t* words, uint32_t bits, uint32_t hashes, common::string_view value)
+{
+    const uint64_t hash = bag_hash::xxh64({value.data(), value.size()});
+    for (uint32_t i = 0; i < hashes; ++i) {
+        const uint32_t bit = s_bloom_bit(hash, i, bits);
+        words[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+}
+
+bool bag_chunk_filters::bloom_test(const uint64_t* words, uint32_t bits, uint32_t hashes, common::string_view value)
+{
+    const uint64_t hash = bag_hash::xxh64({value.data(), value.size()});
+    for (uint32_t i = 0; i < hashes; ++i) {
+        const uint32_t bit = s_bloom_bit(hash, i, bits);
+        if (!(words[bit / 64] & (uint64_t(1) << (bit % 64))))
+            return false;
+    }
+    return true;
+}
+
+bool bag_chunk_filters::build(const bag_rdr& rdr, const std::vector<field_spec>& fields, options opts)
+{
+    m_filters.clear();
+    m_storage.clear();
+    m_sidecar.close();
+
+    const size_t chunk_count = rdr.chunk_count();
+    if (!chunk_count)
+        return false;
+    const uint32_t bloom_bits = std::max<uint32_t>(64, (opts.bloom_bits + 63) & ~uint32_t(63));
+    const uint32_t bloom_words = bloom_bits / 64;
+    const uint32_t bloom_hashes = std::max<uint32_t>(1, opts.bloom_hashes);
+
+    bag_connection_fields conns;
+    const std::vector<bool> field_resolved = conns.resolve(rdr, fields, s_accept_field);
+    // kind of each field, from the first connection it resolved on
+    std::vector<kind> kinds(fields.size(), kind::zone_map);
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (!field_resolved[i])
+            fprintf(stderr, "bag_chunk_filters: '%s' has no string or numeric field '%s'\n", fields[i].topic.c_str(), fields[i].field.c_str());
+    }
+    for (auto conn = conns.connections.rbegin(); conn != conns.connections.rend(); ++conn) {
+        for (const auto& field_accessor : conn->accessors)
+            kinds[field_accessor.first] = field_accessor.second.is_numeric() ? kind::zone_map : kind::bloom;
+    }
+
+    std::vector<storage> built(fields.size());
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (!field_resolved[i])
+            continue;
+        built[i].count.assign(chunk_count, 0);
+        if (kinds[i] == kind::bloom) {
+            built[i].bloom.assign(chunk_count * bloom_words, 0);
+        } else {
+            built[i].min.assign(chunk_count, std::numeric_limits<double>::infinity());
+            built[i].max.assign(chunk_count, -std::numeric_limits<double>::infinity());
+        }
+    }
+
+    // each chunk only writes its own slice of the arrays
+    rdr.parallel_for_chunks(opts.threads, [&] (size_t chunk_index) {
+        if (!conns.any_in(rdr.get_chunk_summary(chunk_index).connection_ids))
+            return;
+        std::vector<char> buffer;
+        rdr.for_each_chunk_message(chunk_index, buffer, [&] (const bag_rdr::chunk_message& msg) {
+            for (const auto& field_accessor : conns[msg.connection_id].accessors) {
+                storage& s = built[field_accessor.first];
+                if (kinds[field_accessor.first] == kind::bloom) {
+                    common::string_view value;
+                    if (!field_accessor.second.read_string(msg.data, value))
+                        continue;
+                    bloom_insert(&s.bloom[chunk_index * bloom_words], bloom_bits, bloom_hashes, value);
+                } else {
+                    double value;
+                    if (!field_accessor.second.read_double(msg.data, value) || std::isnan(value))
+                        continue;
+                    s.min[chunk_index] = std::min(s.min[chunk_index], value);
+                    s.max[chunk_index] = std::max(s.max[chunk_index], value);
+                }
+                ++s.count[chunk_index];
+            }
+        });
+    });
+
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (!field_resolved[i])
+            continue;
+        m_storage.emplace_back(std::move(built[i]));
+        const storage& owned = m_storage.back();
+        m_filters.push_back(filter{fields[i].topic, fields[i].field, kinds[i], bloom_bits, bloom_hashes,
+                                   owned.count, owned.bloom, owned.min, owned.max});
+    }
+    return m_filters.size() != 0;
+}
+
+result<ok, unix_err> bag_chunk_filters::write(const std::string& path, const bag_sidecar_identity& identity) const
+{
+    bag_sidecar_writer writer;
+    for (const filter& f : m_filters) {
+        bag_sidecar_buffer buf;
+        buf.append_string(f.topic);
+        buf.append_string(f.field);
+        buf.append(uint32_t(f.type));
+        buf.append(f.bloom_bits);
+        buf.append(f.bloom_hashes);
+        buf.append(uint32_t(0));
+        buf.append(uint64_t(f.chunk_count()));
+        buf.append_array(f.count.data(), f.count.size());
+        if (f.type == kind::bloom) {
+            buf.append_array(f.bloom.data(), f.bloom.size());
+        } else {
+            buf.append_array(f.min.data(), f.min.size());
+            buf.append_array(f.max.data(), f.max.size());
+        }
+        writer.add_section(section_prefix + f.topic + ":" + f.field, std::move(buf.bytes));
+    }
+    return writer.write(path, identity);
+}
+
+result<ok, unix_err> bag_chunk_filters::write(const bag_rdr& rdr) const
+{
+    return write(bag_sidecar_path(rdr, sidecar_suffix()), bag_sidecar_identity::of(rdr));
+}
+
+result<ok, unix_err> bag_chunk_filters::open(const bag_rdr& rdr)
+{
+    result_try(open(bag_sidecar_path(rdr, sidecar_suffix())));
+    if (!m_sidecar.matches(rdr)) {
+        fprintf(stderr, "bag_chunk_filters: sidecar for '%s' is stale\n", rdr.filename().c_str());
+        m_filters.clear();
+        m_sidecar.close();
+        return unix_err{ESTALE};
+    }
+    return ok{};
+}
+
+result<ok, unix_err> bag_chunk_filters::open(const std::string& path)
+{
+    m_filters.clear();
+    m_storage.clear();
+    result_try(m_sidecar.open(path));
+
+    for (const common::string_view name : m_sidecar.section_names()) {
+        if (!name.begins_with(section_prefix))
+            continue;
+        bag_sidecar_reader rdr{m_sidecar.section(name)};
+        filter f;
+        f.topic = rdr.read_string().to_string();
+        f.field = rdr.read_string().to_string();
+        f.type = kind(rdr.read<uint32_t>());
+        f.bloom_bits = rdr.read<uint32_t>();
+        f.bloom_hashes = rdr.read<uint32_t>();
+        rdr.read<uint32_t>();
+        const size_t chunk_count = rdr.read<uint64_t>();
+        f.count = rdr.read_array<uint32_t>(chunk_count);
+        if (f.type == kind::bloom) {
+            f.bloom = rdr.read_array<uint64_t>(chunk_count * (f.bloom_bits / 64));
+        } else {
+            f.min = rdr.read_array<double>(chunk_count);
+            f.max = rdr.read_array<double>(chunk_count);
+        }
+        const bool valid_kind = (f.type == kind::zone_map) || ((f.type == kind::bloom) && f.bloom_bits && !(f.bloom_bits % 64));
+        if (!rdr.ok() || !valid_kind) {
+            fprintf(stderr, "bag_chunk_filters: malformed section '%.*s' in '%s'\n", name.sizei(), name.data(), path.c_str());
+            continue;
+        }
+        m_filters.emplace_back(std::move(f));
+    }
+    return ok{};
+}
+
+const bag_chunk_filters::filter* bag_chunk_filters::find(common::string_view topic, common::string_view field) const
+{
+    for (const filter& f : m_filters) {
+        if ((topic == common::string_view{f.topic}) && (field == common::string_view{f.field}))
+            return &f;
+    }
+    return nullptr;
+}
+
+std::vector<bool> bag_chunk_filters::may_equal(const filter& f, common::string_view value) const
+{
+    if (f.type != kind::bloom)
+        return {};
+    const uint32_t words = f.bloom_bits / 64;
+    std::vector<bool> mask(f.chunk_count(), false);
+    for (size_t i = 0; i < mask.size(); ++i)
+        mask[i] = f.count[i] && bloom_test(&f.bloom[i * words], f.bloom_bits, f.bloom_hashes, value);
+    return mask;
+}
+
+std::vector<bool> bag_chunk_filters::may_overlap(const filter& f, double min, double max) const
+{
+    if (f.type != kind::zone_map)
+        return {};
+    std::vector<bool> mask(f.chunk_count(), false);
+    for (size_t i = 0; i < mask.size(); ++i)
+        mask[i] = f.count[i] && (f.min[i] <= max) && (f.max[i] >= min);
+    return mask;
+}
+
+std::vector<bool> bag_chunk_filters::may_equal(common::string_view topic, common::string_view field, common::string_view value) const
+{
+    const filter* f = find(topic, field);
+    return f ? may_equal(*f, value) : std::vector<bool>{};
+}
+
+std::vector<bool> bag_chunk_filters::may_overlap(common::string_view topic, common::string_view field, double min, double max) const
+{
+    const filter* f = find(topic, field);
+    return f ? may_overlap(*f, min, max) : std::vector<bool>{};
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_CHUNK_FILTERS_HPP
+#define BAG_CHUNK_FILTERS_HPP
+
+#include "bag_fields.hpp"
+#include "bag_rdr.hpp"
+#include "bag_sidecar.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ * Per-chunk filters on message fields, so a view can skip chunks
+ * that cannot hold a matching message without decompressing them.
+ * String fields get a Bloom filter per chunk, numeric fields a
+ * min/max zone map. Built in a chunk-parallel pass and persisted
+ * in a ".filters" sidecar next to the bag.
+ *
+ *     auto v = rdr.get_view().with_topics({"/rosout"})
+ *                 .with_chunk_mask(filters.may_equal("/rosout", "name", "/planner"));
+ *
+ * Filters only rule chunks out, messages still need checking.
+ */
+struct bag_chunk_filters
+{
+    struct options
+    {
+        // per chunk and field, rounded up to a multiple of 64
+        uint32_t bloom_bits = 4096;
+        uint32_t bloom_hashes = 4;
+        unsigned threads = 0;
+    };
+    using field_spec = bag_field_spec;
+    enum class kind : uint32_t { bloom, zone_map };
+    struct filter
+    {
+        std::string topic, field;
+        kind type;
+        uint32_t bloom_bits;
+        uint32_t bloom_hashes;
+        // values seen per chunk
+        common::array_view<const uint32_t> count;
+        // bloom_bits / 64 words per chunk
+        common::array_view<const uint64_t> bloom;
+        common::array_view<const double> min, max;
+        size_t chunk_count() const { return count.size(); }
+    };
+
+    static const char* sidecar_suffix() { return ".filters"; }
+
+    bool build(const bag_rdr& rdr, const std::vector<field_spec>& fields, options opts);
+    bool build(const bag_rdr& rdr, const std::vector<field_spec>& fields) { return build(rdr, fields, options{}); }
+    common::result<common::ok, common::unix_err> write(const std::string& path, const bag_sidecar_identity& identity) const;
+    common::result<common::ok, common::unix_err> write(const bag_rdr& rdr) const;
+    /**
+     * Open the sidecar of rdr, failing with ESTALE if it was
+     * derived from a different version of the bag.
+     */
+    common::result<common::ok, common::unix_err> open(const bag_rdr& rdr);
+    common::result<common::ok, common::unix_err> open(const std::string& path);
+
+    const filter* find(common::string_view topic, common::string_view field) const;
+
+    /**
+     * Masks for bag_rdr::view::with_chunk_mask, set for chunks which
+     * may hold a message with a matching field. Empty, so every chunk
+     * is read, when there is no filter of the right kind for the field.
+     */
+    std::vector<bool> may_equal(const filter& f, common::string_view value) const;
+    std::vector<bool> may_overlap(const filter& f, double min, double max) const;
+    std::vector<bool> may_equal(common::string_view topic, common::string_view field, common::string_view value) const;
+    std::vector<bool> may_overlap(common::string_view topic, common::string_view field, double min, double max) const;
+
+    const std::vector<filter>& all_filters() const { return m_filters; }
+
+    // detail
+    struct storage
+    {
+        std::vector<uint32_t> count;
+        std::vector<uint64_t> bloom;
+        std::vector<double> min, max;
+    };
+    static void bloom_insert(uint64_t* words, uint32_t bits, uint32_t hashes, common::string_view value);
+    static bool bloom_test(const uint64_t* words, uint32_t bits, uint32_t hashes, common::string_view value);
+
+    std::vector<filter> m_filters;
+    // owned filter arrays when built rather than opened
+    std::vector<storage> m_storage;
+    bag_sidecar m_sidecar;
+};
+
+#endif // BAG_CHUNK_FILTERS_HPP
@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_fields.hpp"
+#pragma GCC diagnostic pop
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+
+using prim = bag_msg_schema::prim;
+
+int32_t bag_msg_schema::prim_size(prim p)
+{
+    switch (p) {
+      case prim::BOOL:
+      case prim::INT8:
+      case prim::UINT8:    return 1;
+      case prim::INT16:
+      case prim::UINT16:   return 2;
+      case prim::INT32:
+      case prim::UINT32:
+      case prim::FLOAT32:  return 4;
+      case prim::INT64:
+      case prim::UINT64:
+      case prim::FLOAT64:
+      case prim::TIME:
+      case prim::DURATION: return 8;
+      case prim::STRING:
+      case prim::MESSAGE:  return -1;
+    }
+    return -1;
+}
+
+static bool s_prim_from_name(const std::string& name, prim& out)
+{
+    static const struct { const char* name; prim type; } table[] = {
+        {"bool", prim::BOOL},
+        {"int8", prim::INT8},     {"uint8", prim::UINT8},
+        {"byte", prim::INT8},     {"char", prim::UINT8},
+        {"int16", prim::INT16},   {"uint16", prim::UINT16},
+        {"int32", prim::INT32},   {"uint32", prim::UINT32},
+        {"int64", prim::INT64},   {"uint64", prim::UINT64},
+        {"float32", prim::FLOAT32}, {"float64", prim::FLOAT64},
+        {"string", prim::STRING},
+        {"time", prim::TIME},     {"duration", prim::DURATION},
+    };
+    for (const auto& entry : table) {
+        if (name == entry.name) {
+            out = entry.type;
+            return true;
+        }
+    }
+    return false;
+}
+
+static common::string_view trim(common::string_view str)
+{
+    const char* begin = str.begin();
+    const char* end = str.end();
+    while ((begin != end) && std::isspace((unsigned char) *begin))
+        ++begin;
+    while ((end != begin) && std::isspace((unsigned char) *(end - 1)))
+        --end;
+    return common::string_view{begin, end};
+}
+
+static std::string package_of(const std::string& type_name)
+{
+    const size_t slash = type_name.find('/');
+    if (slash == std::string::npos)
+        return {};
+    return type_name.substr(0, slash);
+}
+
+namespace {
+
+struct pending_field
+{
+    bag_msg_schema::field field;
+    std::string type_name;
+};
+
+struct pending_type
+{
+    std::string name;
+    std::vector<pending_field> fields;
+};
+
+}
+
+static bool s_parse_field_line(common::string_view line, pending_field& out)
+{
+    const char* it = line.begin();
+    const char* type_end = std::find_if(it, line.end(), [] (char c) { return std::isspace((unsigned char) c); });
+    std::string type_token {it, type_end};
+    common::string_view rest = trim(common::string_view{type_end, line.end()});
+    if (!type_token.size() || !rest.size())
+        return false;
+    // constant, e.g. "uint8 DEBUG=1"
+    if (std::find(rest.begin(), rest.end(), '=') != rest.end())
+        return false;
+    const char* name_end = std::find_if(rest.begin(), rest.end(), [] (char c) { return std::isspace((unsigned char) c); });
+    out.field.name.assign(rest.begin(), name_end);
+
+    const size_t bracket = type_token.find('[');
+    if (bracket != std::string::npos) {
+        out.field.is_array = true;
+        const std::string len = type_token.substr(bracket + 1, type_token.size() - bracket - 2);
+        out.field.array_length = len.size() ? std::atoi(len.c_str()) : -1;
+        type_token.resize(bracket);
+    }
+    if (s_prim_from_name(type_token, out.field.type))
+        return true;
+    out.field.type = prim::MESSAGE;
+    out.type_name = (type_token == "Header") ? "std_msgs/Header" : type_token;
+    return true;
+}
+
+static int32_t s_compute_fixed_size(std::vector<bag_msg_schema::type>& types, int32_t index, int depth)
+{
+    bag_msg_schema::type& t = types[index];
+    if (depth > 32)
+        return -1;
+    int32_t total = 0;
+    for (const bag_msg_schema::field& f : t.fields) {
+        int32_t element = (f.type == prim::MESSAGE) ? s_compute_fixed_size(types, f.message, depth + 1) : bag_msg_schema::prim_size(f.type);
+        if ((element < 0) || (f.is_array && (f.array_length < 0))) {
+            total = -1;
+            continue;
+        }
+        if (total >= 0)
+            total += f.is_array ? element * f.array_length : element;
+    }
+    t.fixed_size = total;
+    return total;
+}
+
+bool bag_msg_schema::parse(common::string_view datatype, common::string_view definition)
+{
+    types.clear();
+    std::vector<pending_type> pending(1);
+    pending[0].name = datatype.to_string();
+
+    common::string_view remaining = definition;
+    while (remaining.size()) {
+        const char* eol = std::find(remaining.begin(), remaining.end(), '\n');
+        common::string_view line {remaining.begin(), eol};
+        remaining = common::string_view{eol == remaining.end() ? eol : eol + 1, remaining.end()};
+
+        const char* comment = std::find(line.begin(), line.end(), '#');
+        line = trim(common::string_view{line.begin(), comment});
+        if (!line.size())
+            continue;
+        if (line.begins_with("==")) {
+            pending.emplace_back();
+            continue;
+        }
+        if (line.begins_with("MSG:")) {
+            pending.back().name = trim(line.advance(4)).to_string();
+            continue;
+        }
+        pending_field f;
+        if (s_parse_field_line(line, f))
+            pending.back().fields.emplace_back(std::move(f));
+    }
+
+    auto find_type = [&pending] (const std::string& name) -> int32_t {
+        for (size_t i = 0; i < pending.size(); ++i)
+            if (pending[i].name == name)
+                return int32_t(i);
+        // unqualified dependency from another package
+        for (size_t i = 0; i < pending.size(); ++i) {
+            const std::string& n = pending[i].name;
+            if ((n.size() > name.size()) && (n.compare(n.size() - name.size(), name.size(), name) == 0) && (n[n.size() - name.size() - 1] == '/'))
+                return int32_t(i);
+        }
+        return -1;
+    };
+
+    types.resize(pending.size());
+    for (size_t i = 0; i < pending.size(); ++i) {
+        types[i].name = pending[i].name;
+        const std::string package = package_of(pending[i].name);
+        for (pending_field& pf : pending[i].fields) {
+            if (pf.field.type == prim::MESSAGE) {
+                std::string qualified = pf.type_name;
+                if ((qualified.find('/') == std::string::npos) && package.size())
+                    qualified = package + "/" + qualified;
+                int32_t index = find_type(qualified);
+                if (index == -1)
+                    index = find_type(pf.type_name);
+                if (index == -1) {
+                    fprintf(stderr, "bag_msg_schema: '%s' depends on unknown type '%s'\n", pending[i].name.c_str(), pf.type_name.c_str());
+                    types.clear();
+                    return false;
+                }
+                pf.field.message = index;
+            }
+            types[i].fields.emplace_back(std::move(pf.field));
+        }
+    }
+    for (size_t i = 0; i < types.size(); ++i) {
+        s_compute_fixed_size(types, int32_t(i), 0);
+        const std::vector<field>& fields = types[i].fields;
+        types[i].has_header = fields.size() && (fields[0].type == prim::MESSAGE) && !fields[0].is_array
+                           && (types[fields[0].message].name == "std_msgs/Header");
+    }
+    return true;
+}
+
+bool bag_msg_schema::skip_element(const field& f, bag_payload_cursor& cur) const
+{
+    if (f.type == prim::STRING)
+        return cur.skip(cur.read<uint32_t>());
+    if (f.type == prim::MESSAGE)
+        return skip_message(f.message, cur);
+    return cur.skip(prim_size(f.type));
+}
+
+bool bag_msg_schema::skip_field(const field& f, bag_payload_cursor& cur) const
+{
+    if (!f.is_array)
+        return skip_element(f, cur);
+    const uint32_t count = (f.array_length >= 0) ? uint32_t(f.array_length) : cur.read<uint32_t>();
+    const int32_t element_size = (f.type == prim::MESSAGE) ? types[f.message].fixed_size : prim_size(f.type);
+    if (element_size >= 0)
+        return cur.skip(size_t(element_size) * count);
+    for (uint32_t i = 0; (i < count) && cur.ok(); ++i)
+        skip_element(f, cur);
+    return cur.ok();
+}
+
+bool bag_msg_schema::skip_message(int32_t type_index, bag_payload_cursor& cur) const
+{
+    const type& t = types[type_index];
+    if (t.fixed_size >= 0)
+        return cur.skip(t.fixed_size);
+    for (const field& f : t.fields) {
+        if (!skip_field(f, cur))
+            return false;
+    }
+    return true;
+}
+
+bool bag_field_accessor::compile(const bag_msg_schema& s, common::string_view path)
+{
+    schema = nullptr;
+    steps.clear();
+    fixed_offset = 0;
+    if (s.types.empty())
+        return false;
+
+    int32_t type_index = 0;
+    common::string_view remaining = path;
+    while (true) {
+        const char* dot = std::find(remaining.begin(), remaining.end(), '.');
+        common::string_view segment {remaining.begin(), dot};
+        const bool last = (dot == remaining.end());
+        remaining = common::string_view{last ? dot : dot + 1, remaining.end()};
+
+        int32_t element = -1;
+        const char* bracket = std::find(segment.begin(), segment.end(), '[');
+        if (bracket != segment.end()) {
+            element = std::atoi(std::string{bracket + 1, segment.end()}.c_str());
+            segment = common::string_view{segment.begin(), bracket};
+        }
+
+        const bag_msg_schema::type& t = s.types[type_index];
+        auto it = std::find_if(t.fields.begin(), t.fields.end(), [&segment] (const bag_msg_schema::field& f) {
+            return segment == common::string_view{f.name};
+        });
+        if (it == t.fields.end()) {
+            fprintf(stderr, "bag_field_accessor: no field '%.*s' in '%s'\n", segment.sizei(), segment.data(), t.name.c_str());
+            return false;
+        }
+        const bag_msg_schema::field& f = *it;
+        if (f.is_array != (element >= 0)) {
+            fprintf(stderr, "bag_field_accessor: field '%s' in '%s' %s\n", f.name.c_str(), t.name.c_str(),
+                    f.is_array ? "needs an [index]" : "is not an array");
+            return false;
+        }
+        if ((f.array_length >= 0) && (element >= f.array_length))
+            return false;
+        const int32_t field_index = int32_t(std::distance(t.fields.begin(), it));
+        steps.push_back(step{type_index, field_index, element});
+
+        if (fixed_offset >= 0) {
+            for (int32_t i = 0; i < field_index; ++i) {
+                const bag_msg_schema::field& before = t.fields[i];
+                const int32_t element_size = (before.type == prim::MESSAGE) ? s.types[before.message].fixed_size : bag_msg_schema::prim_size(before.type);
+                if ((element_size < 0) || (before.is_array && (before.array_length < 0))) {
+                    fixed_offset = -1;
+                    break;
+                }
+                fixed_offset += before.is_array ? element_size * before.array_length : element_size;
+            }
+        }
+        if ((fixed_offset >= 0) && f.is_array) {
+            const int32_t element_size = (f.type == prim::MESSAGE) ? s.types[f.message].fixed_size : bag_msg_schema::prim_size(f.type);
+            if ((f.array_length < 0) || (element_size < 0))
+                fixed_offset = -1;
+            else
+                fixed_offset += element_size * element;
+        }
+
+        if (last) {
+            if (f.type == prim::MESSAGE) {
+                fprintf(stderr, "bag_field_accessor: path '%.*s' ends at a message, not a value\n", path.sizei(), path.data());
+                return false;
+            }
+            leaf = f;
+            leaf.is_array = false;
+            break;
+        }
+        if (f.type != prim::MESSAGE)
+            return false;
+        type_index = f.message;
+    }
+    schema = &s;
+    return true;
+}
+
+bool bag_field_accessor::is_numeric() const
+{
+    return (leaf.type != prim::STRING) && (leaf.type != prim::MESSAGE);
+}
+
+bool bag_field_accessor::seek(bag_payload_cursor& cur) const
+{
+    if (!schema)
+        return false;
+    if (fixed_offset >= 0)
+        return cur.skip(fixed_offset);
+    for (const step& st : steps) {
+        const bag_msg_schema::type& t = schema->types[st.type_index];
+        for (int32_t i = 0; i < st.field_index; ++i) {
+            if (!schema->skip_field(t.fields[i], cur))
+                return false;
+        }
+        const bag_msg_schema::field& f = t.fields[st.field_index];
+        if (!f.is_array)
+            continue;
+        const uint32_t count = (f.array_length >= 0) ? uint32_t(f.array_length) : cur.read<uint32_t>();
+        if (!cur.ok() || (uint32_t(st.element) >= count))
+            return false;
+        bag_msg_schema::field element_field = f;
+        element_field.is_array = false;
+        for (int32_t i = 0; i < st.element; ++i) {
+            if (!schema->skip_element(element_field, cur))
+                return false;
+        }
+    }
+    return cur.ok();
+}
+
+template <typename T>
+static bool s_read_number(bag_payload_cursor& cur, prim type, T& out)
+{
+    switch (type) {
+      case prim::BOOL:
+      case prim::UINT8:    out = T(cur.read<uint8_t>()); break;
+      case prim::INT8:     out = T(cur.read<int8_t>()); break;
+      case prim::INT16:    out = T(cur.read<int16_t>()); break;
+      case prim::UINT16:   out = T(cur.read<uint16_t>()); break;
+      case prim::INT32:    out = T(cur.read<int32_t>()); break;
+      case prim::UINT32:   out = T(cur.read<uint32_t>()); break;
+      case prim::INT64:    out = T(cur.read<int64_t>()); break;
+      case prim::UINT64:   out = T(cur.read<uint64_t>()); break;
+      case prim::FLOAT32:  out = T(cur.read<float>()); break;
+      case prim::FLOAT64:  out = T(cur.read<double>()); break;
+      case prim::TIME: {
+        const int64_t secs = cur.read<uint32_t>();
+        const int64_t nsecs = cur.read<uint32_t>();
+        out = T(secs) + T(nsecs) / T(1000000000);
+        break;
+      }
+      case prim::DURATION: {
+        const int64_t secs = cur.read<int32_t>();
+        const int64_t nsecs = cur.read<int32_t>();
+        out = T(secs) + T(nsecs) / T(1000000000);
+        break;
+      }
+      case prim::STRING:
+      case prim::MESSAGE:  return false;
+    }
+    return cur.ok();
+}
+
+bool bag_field_accessor::read_double(common::array_view<const char> payload, double& out) const
+{
+    bag_payload_cursor cur{payload};
+    return seek(cur) && s_read_number(cur, leaf.type, out);
+}
+
+bool bag_field_accessor::read_int(common::array_view<const char> payload, int64_t& out) const
+{
+    bag_payload_cursor cur{payload};
+    return seek(cur) && s_read_number(cur, leaf.type, out);
+}
+
+bool bag_field_accessor::read_string(common::array_view<const char> payload, common::string_view& out) const
+{
+    if (leaf.type != prim::STRING)
+        return false;
+    bag_payload_cursor cur{payload};
+    if (!seek(cur))
+        return false;
+    out = cur.read_string();
+    return cur.ok();
+}
+
+bool bag_field_accessor::read_time(common::array_view<const char> payload, common::timestamp& out) const
+{
+    if ((leaf.type != prim::TIME) && (leaf.type != prim::DURATION))
+        return false;
+    bag_payload_cursor cur{payload};
+    if (!seek(cur))
+        return false;
+    out = cur.read_time();
+    return cur.ok();
+}
+
+std::vector<bool> bag_connection_fields::resolve(const bag_rdr& rdr, const std::vector<bag_field_spec>& specs,
+                                                 bool (*accept)(const bag_field_accessor&))
+{
+    connections.clear();
+    connections.resize(rdr.connection_count());
+    std::vector<bool> resolved(specs.size(), false);
+    for (size_t id = 0; id < connections.size(); ++id) {
+        const bag_rdr::connection_info info = rdr.get_connection_info(int32_t(id));
+        connection& conn = connections[id];
+        bool schema_parsed = false;
+        for (size_t i = 0; i < specs.size(); ++i) {
+            if (info.topic != common::string_view{specs[i].topic})
+                continue;
+            if (!schema_parsed) {
+                schema_parsed = true;
+                if (!conn.schema.parse(info.datatype, info.msg_def))
+                    break;
+            }
+            bag_field_accessor accessor;
+            if (!accessor.compile(conn.schema, specs[i].field) || (accept && !accept(accessor)))
+                continue;
+            conn.accessors.emplace_back(i, accessor);
+            resolved[i] = true;
+        }
+    }
+    return resolved;
+}
+
+bool bag_connection_fields::any_in(common::array_view<const int32_t> connection_ids) const
+{
+    return std::any_of(connection_ids.begin(), connection_ids.end(), [this] (int32_t id) {
+        return (size_t(id) < connections.size()) && (connections[id].accessors.size() != 0);
+    });
+}
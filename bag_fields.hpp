@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_FIELDS_HPP
+#define BAG_FIELDS_HPP
+
+#include "bag_payload.hpp"
+#include "bag_rdr.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ * Message layout parsed from a connection's message_definition,
+ * enough to locate fields in a serialised payload by path
+ * without the generated C++ message code.
+ */
+struct bag_msg_schema
+{
+    enum class prim : uint8_t
+    {
+        BOOL, INT8, UINT8, INT16, UINT16, INT32, UINT32, INT64, UINT64,
+        FLOAT32, FLOAT64, STRING, TIME, DURATION,
+        MESSAGE,
+    };
+    static int32_t prim_size(prim p);
+
+    struct field
+    {
+        std::string name;
+        prim type = prim::MESSAGE;
+        // index into types for prim::MESSAGE
+        int32_t message = -1;
+        bool is_array = false;
+        // -1 for variable length arrays
+        int32_t array_length = -1;
+    };
+    struct type
+    {
+        std::string name;
+        std::vector<field> fields;
+        // -1 when any field is variable length
+        int32_t fixed_size = -1;
+        bool has_header = false;
+    };
+    // types[0] is the connection's own type
+    std::vector<type> types;
+
+    /**
+     * Parse a "msg definition" text as stored in the bag connection
+     * header: the root type, followed by its dependencies each introduced
+     * by a "MSG: pkg/Name" line after a line of '=' characters.
+     */
+    bool parse(common::string_view datatype, common::string_view definition);
+
+    const type& root() const { return types[0]; }
+
+    // detail
+    bool skip_message(int32_t type_index, bag_payload_cursor& cur) const;
+    bool skip_field(const field& f, bag_payload_cursor& cur) const;
+    bool skip_element(const field& f, bag_payload_cursor& cur) const;
+};
+
+/**
+ * A compiled field path such as "twist.linear.x" or "wheels[2].speed",
+ * reading a single primitive leaf out of a payload. When every field
+ * before the leaf is fixed size the leaf is read at a constant offset.
+ */
+struct bag_field_accessor
+{
+    using prim = bag_msg_schema::prim;
+
+    // schema must outlive the accessor
+    bool compile(const bag_msg_schema& schema, common::string_view path);
+    bool valid() const { return schema != nullptr; }
+    prim leaf_type() const { return leaf.type; }
+    bool is_numeric() const;
+
+    bool read_double(common::array_view<const char> payload, double& out) const;
+    bool read_int(common::array_view<const char> payload, int64_t& out) const;
+    bool read_string(common::array_view<const char> payload, common::string_view& out) const;
+    bool read_time(common::array_view<const char> payload, common::timestamp& out) const;
+
+    // detail
+    struct step
+    {
+        int32_t type_index;
+        int32_t field_index;
+        // element of an array field to descend into, -1 if not an array
+        int32_t element;
+    };
+    bool seek(bag_payload_cursor& cur) const;
+
+    const bag_msg_schema* schema = nullptr;
+    std::vector<step> steps;
+    bag_msg_schema::field leaf;
+    // byte offset of the leaf when reachable without parsing, else -1
+    int32_t fixed_offset = -1;
+};
+
+/**
+ * A field of the messages on a topic, see bag_field_accessor for paths.
+ */
+struct bag_field_spec
+{
+    std::string topic;
+    // e.g. "twist.linear.x"
+    std::string field;
+};
+
+/**
+ * Field specs resolved against the connections of a bag, so
+ * chunk passes can look up accessors by connection id.
+ */
+struct bag_connection_fields
+{
+    struct connection
+    {
+        bag_msg_schema schema;
+        // (index into field specs, accessor)
+        std::vector<std::pair<size_t, bag_field_accessor>> accessors;
+    };
+
+    bag_connection_fields() = default;
+    // accessors point into the schemas
+    bag_connection_fields(const bag_connection_fields&) = delete;
+    bag_connection_fields& operator=(const bag_connection_fields&) = delete;
+
+    /**
+     * Compile every spec against each connection on its topic, keeping
+     * accessors accept() agrees with. Returns which specs resolved
+     * on at least one connection.
+     */
+    std::vector<bool> resolve(const bag_rdr& rdr, const std::vector<bag_field_spec>& specs,
+                              bool (*accept)(const bag_field_accessor&) = nullptr);
+    const connection& operator[](int32_t connection_id) const { return connections[connection_id]; }
+    // whether a chunk holds messages of any resolved connection
+    bool any_in(common::array_view<const int32_t> connection_ids) const;
+
+    std::vector<connection> connections;
+};
+
+#endif // BAG_FIELDS_HPP
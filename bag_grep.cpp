@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_grep.hpp"
+#pragma GCC diagnostic pop
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+const char* bag_grep::find(const char* p, const char* const end, common::array_view<const char> pattern)
+{
+    const size_t n = pattern.size();
+    if (!n || (size_t(end - p) < n))
+        return nullptr;
+    if (n == 1)
+        return static_cast<const char*>(std::memchr(p, pattern[0], end - p));
+
+#if defined(__SSE2__)
+    // compare the first and last pattern byte at 16 positions at once,
+    // only candidates matching both are checked in full
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[n - 1]);
+    for (; size_t(end - p) >= n - 1 + 16; p += 16) {
+        const __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + n - 1));
+        unsigned mask = unsigned(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                                 _mm_cmpeq_epi8(block_last, last))));
+        while (mask) {
+            const int bit = __builtin_ctz(mask);
+            if (!std::memcmp(p + bit + 1, pattern.data() + 1, n - 2))
+                return p + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; size_t(end - p) >= n; ++p) {
+        p = static_cast<const char*>(std::memchr(p, pattern[0], end - p - n + 1));
+        if (!p)
+            return nullptr;
+        if (!std::memcmp(p, pattern.data(), n))
+            return p;
+    }
+    return nullptr;
+}
+
+std::vector<bag_grep::hit> bag_grep::search(const bag_rdr& rdr, common::array_view<const char> pattern, const options& opts)
+{
+    std::vector<bool> selected(rdr.connection_count(), opts.topics.empty());
+    for (size_t id = 0; id < selected.size(); ++id) {
+        const common::string_view topic = rdr.get_connection_info(int32_t(id)).topic;
+        for (const std::string& t : opts.topics)
+            selected[id] = selected[id] || (topic == common::string_view{t});
+    }
+
+    std::vector<hit> hits;
+    std::mutex hits_lock;
+    std::atomic<size_t> hit_count{0};
+    if (!pattern.size())
+        return hits;
+    rdr.parallel_for_chunks(opts.threads, [&] (size_t chunk_index) {
+        if (opts.max_hits && (hit_count.load() >= opts.max_hits))
+            return;
+        const bag_rdr::chunk_summary summary = rdr.get_chunk_summary(chunk_index);
+        const bool relevant = std::any_of(summary.connection_ids.begin(), summary.connection_ids.end(), [&selected] (int32_t id) {
+            return (size_t(id) < selected.size()) && selected[id];
+        });
+        if (!relevant)
+            return;
+
+        std::vector<char> buffer;
+        std::vector<hit> local;
+        rdr.for_each_chunk_message(chunk_index, buffer, [&] (const bag_rdr::chunk_message& msg) {
+            if (!selected[msg.connection_id])
+                return;
+            const char* const begin = msg.data.data();
+            const char* const end = begin + msg.data.size();
+            for (const char* p = begin; (p = find(p, end, pattern)); ++p)
+                local.push_back(hit{msg.stamp, msg.connection_id, uint32_t(chunk_index), msg.offset, uint32_t(p - begin)});
+        });
+        if (local.empty())
+            return;
+        hit_count += local.size();
+        std::lock_guard<std::mutex> guard{hits_lock};
+        hits.insert(hits.end(), local.begin(), local.end());
+    });
+
+    std::sort(hits.begin(), hits.end(), [] (const hit& a, const hit& b) {
+        const int64_t a_ns = bag_rdr::stamp_to_ns(a.stamp), b_ns = bag_rdr::stamp_to_ns(b.stamp);
+        if (a_ns != b_ns)
+            return a_ns < b_ns;
+        if (a.chunk_index != b.chunk_index)
+            return a.chunk_index < b.chunk_index;
+        if (a.message_offset != b.message_offset)
+            return a.message_offset < b.message_offset;
+        return a.offset < b.offset;
+    });
+    if (opts.max_hits && (hits.size() > opts.max_hits))
+        hits.resize(opts.max_hits);
+    return hits;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_GREP_HPP
+#define BAG_GREP_HPP
+
+#include "bag_rdr.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ * Byte pattern search over raw message payloads of any type,
+ * e.g. for serial numbers or error strings. Chunks are scanned
+ * in parallel, each worker decompressing into its own buffer and
+ * scanning it while still in cache; chunks without a selected
+ * connection are not decompressed at all.
+ */
+struct bag_grep
+{
+    struct options
+    {
+        // empty searches every topic
+        std::vector<std::string> topics;
+        unsigned threads = 0;
+        // stop scanning once this many hits are found, 0 for no limit,
+        // with several threads the hits kept are not necessarily the earliest
+        size_t max_hits = 0;
+    };
+    struct hit
+    {
+        common::timestamp stamp;
+        int32_t connection_id;
+        uint32_t chunk_index;
+        // of the message in the uncompressed chunk, see bag_rdr::for_each_chunk_message_at
+        uint32_t message_offset;
+        // of the match in the message payload
+        uint32_t offset;
+    };
+
+    // hits ordered by message time, then position
+    static std::vector<hit> search(const bag_rdr& rdr, common::array_view<const char> pattern, const options& opts);
+    static std::vector<hit> search(const bag_rdr& rdr, common::array_view<const char> pattern) { return search(rdr, pattern, options{}); }
+
+    // first occurrence of pattern in [begin, end), or nullptr
+    static const char* find(const char* begin, const char* end, common::array_view<const char> pattern);
+};
+
+#endif // BAG_GREP_HPP
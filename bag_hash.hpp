@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_HASH_HPP
+#define BAG_HASH_HPP
+
+#include "common/array_view.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * XXH64, a fast non-cryptographic hash, for content identity
+ * and hashed filters. Output matches the reference implementation.
+ */
+struct bag_hash
+{
+    static constexpr uint64_t prime_1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t prime_2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t prime_3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t prime_4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t prime_5 = 0x27D4EB2F165667C5ULL;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t read64(const char* p) { uint64_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+    static uint32_t read32(const char* p) { uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+    static uint64_t round(uint64_t acc, uint64_t input)
+    {
+        acc += input * prime_2;
+        acc = rotl(acc, 31);
+        return acc * prime_1;
+    }
+    static uint64_t merge_round(uint64_t acc, uint64_t val)
+    {
+        acc ^= round(0, val);
+        return acc * prime_1 + prime_4;
+    }
+
+    static uint64_t xxh64(common::array_view<const char> data, uint64_t seed = 0)
+    {
+        const char* p = data.data();
+        const char* const end = p + data.size();
+        uint64_t h;
+        if (data.size() >= 32) {
+            uint64_t v1 = seed + prime_1 + prime_2;
+            uint64_t v2 = seed + prime_2;
+            uint64_t v3 = seed;
+            uint64_t v4 = seed - prime_1;
+            for (; p + 32 <= end; p += 32) {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+            }
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge_round(h, v1);
+            h = merge_round(h, v2);
+            h = merge_round(h, v3);
+            h = merge_round(h, v4);
+        } else {
+            h = seed + prime_5;
+        }
+        h += uint64_t(data.size());
+        for (; p + 8 <= end; p += 8) {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * prime_1 + prime_4;
+        }
+        if (p + 4 <= end) {
+            h ^= uint64_t(read32(p)) * prime_1;
+            h = rotl(h, 23) * prime_2 + prime_3;
+            p += 4;
+        }
+        for (; p < end; ++p) {
+            h ^= uint64_t(uint8_t(*p)) * prime_5;
+            h = rotl(h, 11) * prime_1;
+        }
+        h ^= h >> 33;
+        h *= prime_2;
+        h ^= h >> 29;
+        h *= prime_3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+#endif // BAG_HASH_HPP
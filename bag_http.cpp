@@ -0,0 +1,685 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_source.hpp"
+
+#include "common/array_view.hpp"
+#include "common/common_optional.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <vector>
+
+// requests sent ahead of their responses on one connection
+static const size_t s_pipeline_depth = 16;
+// of the bag, fetched first for the bag header
+static const uint64_t s_initial_fetch = 64 << 10;
+// fetched at the start of each chunk for its record header
+static const uint64_t s_chunk_head = 1024;
+
+struct range_request
+{
+    uint64_t begin;
+    uint64_t end;
+    char* out;
+};
+
+// One keep-alive HTTP/1.1 connection, reconnected as needed
+struct http_connection
+{
+    std::string url, authority, host, port, target;
+    int timeout_ms = 30000;
+    int fd = -1;
+    std::vector<char> in;
+    size_t in_begin = 0;
+
+    // from the responses: the size of the bag and its ETag or Last-Modified
+    uint64_t total_size = 0;
+    std::string validator;
+
+    ~http_connection() { close(); }
+
+    void close()
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        in.clear();
+        in_begin = 0;
+    }
+
+    bool connect()
+    {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        const int err = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+        if (err) {
+            fprintf(stderr, "bag_rdr: '%s': can't resolve '%s' (%s)\n", url.c_str(), host.c_str(), gai_strerror(err));
+            return false;
+        }
+        for (addrinfo* a = found; a && (fd < 0); a = a->ai_next) {
+            fd = ::socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (::connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        ::freeaddrinfo(found);
+        if (fd < 0) {
+            fprintf(stderr, "bag_rdr: '%s': can't connect (%m)\n", url.c_str());
+            return false;
+        }
+        const int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        const timeval timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        return true;
+    }
+
+    bool send_all(const std::string& data)
+    {
+        for (size_t sent = 0; sent < data.size(); ) {
+            const ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                if ((n < 0) && (errno == EINTR))
+                    continue;
+                return false;
+            }
+            sent += size_t(n);
+        }
+        return true;
+    }
+
+    bool read_more()
+    {
+        if (in_begin == in.size()) {
+            in.clear();
+            in_begin = 0;
+        }
+        const size_t at = in.size();
+        in.resize(at + (64 << 10));
+        ssize_t n;
+        do {
+            n = ::recv(fd, in.data() + at, in.size() - at, 0);
+        } while ((n < 0) && (errno == EINTR));
+        in.resize(at + size_t(std::max<ssize_t>(n, 0)));
+        return n > 0;
+    }
+
+    bool read_line(std::string& line)
+    {
+        for (;;) {
+            const auto begin = in.begin() + in_begin;
+            const auto newline = std::find(begin, in.end(), '\n');
+            if (newline != in.end()) {
+                line.assign(begin, newline);
+                if (line.size() && (line.back() == '\r'))
+                    line.pop_back();
+                in_begin = size_t(newline - in.begin()) + 1;
+                return true;
+            }
+            if (!read_more())
+                return false;
+        }
+    }
+
+    bool read_exact(char* out, size_t size)
+    {
+        while (size) {
+            if (in_begin == in.size()) {
+                // large bodies skip the buffer
+                if (size >= (64 << 10)) {
+                    const ssize_t n = ::recv(fd, out, size, 0);
+                    if ((n < 0) && (errno == EINTR))
+                        continue;
+                    if (n <= 0)
+                        return false;
+                    out += n;
+                    size -= size_t(n);
+                    continue;
+                }
+                if (!read_more())
+                    return false;
+            }
+            const size_t n = std::min(size, in.size() - in_begin);
+            memcpy(out, in.data() + in_begin, n);
+            in_begin += n;
+            out += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    std::string request_for(const range_request& r) const
+    {
+        return "GET " + target + " HTTP/1.1\r\nHost: " + authority
+             + "\r\nRange: bytes=" + std::to_string(r.begin) + "-" + std::to_string(r.end - 1)
+             + "\r\nAccept-Encoding: identity\r\nUser-Agent: bag_rdr\r\n\r\n";
+    }
+
+    enum class response { OK, RETRY, FAILED };
+
+    /**
+     * Reads the response to r. A short range is accepted only where the
+     * bag ends, r.end is then moved back to it. keep_alive is false once
+     * the server closes the connection after this response.
+     */
+    response read_response(range_request& r, bool& keep_alive)
+    {
+        std::string line;
+        if (!read_line(line))
+            return response::RETRY;
+        unsigned status = 0;
+        if (sscanf(line.c_str(), "HTTP/%*u.%*u %u", &status) != 1) {
+            fprintf(stderr, "bag_rdr: '%s': bad response '%s'\n", url.c_str(), line.c_str());
+            return response::FAILED;
+        }
+        keep_alive = (line.compare(0, 8, "HTTP/1.0") != 0);
+        common::optional<uint64_t> length;
+        uint64_t first = 0, last = 0, total = 0;
+        bool has_range = false, chunked = false;
+        std::string response_validator;
+        for (;;) {
+            if (!read_line(line))
+                return response::RETRY;
+            if (line.empty())
+                break;
+            const size_t colon = line.find(':');
+            if (colon == std::string::npos)
+                continue;
+            std::string name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), [] (char c) { return char(tolower(c)); });
+            const size_t value_begin = line.find_first_not_of(' ', colon + 1);
+            const std::string value = (value_begin == std::string::npos) ? std::string{} : line.substr(value_begin);
+            if (name == "content-length")
+                length = uint64_t(strtoull(value.c_str(), nullptr, 10));
+            else if (name == "content-range")
+                has_range = (sscanf(value.c_str(), "bytes %" SCNu64 "-%" SCNu64 "/%" SCNu64, &first, &last, &total) == 3);
+            else if (name == "transfer-encoding")
+                chunked = (value != "identity");
+            else if (name == "connection")
+                keep_alive = (strcasecmp(value.c_str(), "close") != 0);
+            else if ((name == "etag") || ((name == "last-modified") && response_validator.empty()))
+                response_validator = value;
+        }
+
+        if (status != 206) {
+            if (status == 200)
+                fprintf(stderr, "bag_rdr: '%s': server doesn't support range requests\n", url.c_str());
+            else
+                fprintf(stderr, "bag_rdr: '%s': HTTP status %u for bytes %" PRIu64 "-%" PRIu64 "\n", url.c_str(), status, r.begin, r.end);
+            return response::FAILED;
+        }
+        if (!has_range || chunked || !length || (first != r.begin) || (last < first) || (last >= r.end)
+                || (length.get() != last - first + 1) || ((last + 1 != r.end) && (last + 1 != total))) {
+            fprintf(stderr, "bag_rdr: '%s': unexpected response for bytes %" PRIu64 "-%" PRIu64 "\n", url.c_str(), r.begin, r.end);
+            return response::FAILED;
+        }
+        if (!total_size) {
+            total_size = total;
+            validator = response_validator;
+        } else if ((total != total_size) || (response_validator != validator)) {
+            fprintf(stderr, "bag_rdr: '%s' changed on the server\n", url.c_str());
+            return response::FAILED;
+        }
+        r.end = last + 1;
+        return read_exact(r.out, size_t(length.get())) ? response::OK : response::RETRY;
+    }
+
+    // each request pipelined on the connection, reconnecting and resending if it drops
+    bool get(std::vector<range_request>& requests)
+    {
+        size_t answered = 0;
+        int attempts = 0;
+        while (answered < requests.size()) {
+            if ((fd < 0) && !connect())
+                return false;
+            const size_t window_end = std::min(requests.size(), answered + s_pipeline_depth);
+            std::string batch;
+            for (size_t i = answered; i < window_end; ++i)
+                batch += request_for(requests[i]);
+            bool dropped = !send_all(batch);
+            while (!dropped && (answered < window_end)) {
+                bool keep_alive = true;
+                switch (read_response(requests[answered], keep_alive)) {
+                  case response::OK:
+                    ++answered;
+                    attempts = 0;
+                    dropped = !keep_alive;
+                    break;
+                  case response::RETRY:
+                    dropped = true;
+                    break;
+                  case response::FAILED:
+                    close();
+                    return false;
+                }
+            }
+            if (dropped) {
+                close();
+                if ((answered < requests.size()) && (++attempts > 3)) {
+                    fprintf(stderr, "bag_rdr: '%s': connection lost\n", url.c_str());
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+// [begin, end) ranges, sorted and merged
+struct range_set
+{
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+
+    bool covers(uint64_t begin, uint64_t end) const
+    {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(begin, UINT64_MAX));
+        return (it != ranges.begin()) && (std::prev(it)->first <= begin) && (std::prev(it)->second >= end);
+    }
+    void add(uint64_t begin, uint64_t end)
+    {
+        auto it = std::lower_bound(ranges.begin(), ranges.end(), std::make_pair(begin, uint64_t(0)));
+        if ((it != ranges.begin()) && (std::prev(it)->second >= begin))
+            --it;
+        auto last = it;
+        while ((last != ranges.end()) && (last->first <= end)) {
+            begin = std::min(begin, last->first);
+            end = std::max(end, last->second);
+            ++last;
+        }
+        it = ranges.erase(it, last);
+        ranges.insert(it, std::make_pair(begin, end));
+    }
+};
+
+/**
+ * cache_path holds fetched bytes at their offsets, cache_path + ".ranges"
+ * which ranges those are: a magic, the bag size, the validator and the
+ * ranges, replaced whole after every fetch.
+ */
+struct http_cache
+{
+    std::string path;
+    int fd = -1;
+    range_set present;
+
+    static constexpr uint64_t magic = 0x31484354544842ull; // "BHTTCH1"
+
+    ~http_cache()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    bool open(const std::string& cache_path, uint64_t size, const std::string& validator)
+    {
+        path = cache_path;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "bag_rdr: can't open cache '%s' (%m)\n", path.c_str());
+            return false;
+        }
+        bool valid = false;
+        if (FILE* f = fopen((path + ".ranges").c_str(), "rb")) {
+            uint64_t header[3] = {};
+            // the stored validator's length is checked before it sizes anything
+            if ((fread(header, sizeof(header), 1, f) == 1) && (header[0] == magic) && (header[1] == size)
+                && (header[2] == validator.size())) {
+                std::string stored(size_t(header[2]), '\0');
+                valid = (fread(&stored[0], 1, stored.size(), f) == stored.size()) && (stored == validator) && validator.size();
+                uint64_t range[2];
+                while (valid && (fread(range, sizeof(range), 1, f) == 1))
+                    present.add(range[0], std::min(range[1], size));
+            }
+            fclose(f);
+        }
+        if (!valid) {
+            present.ranges.clear();
+            if ((::ftruncate(fd, 0) != 0) || (::ftruncate(fd, off_t(size)) != 0)) {
+                fprintf(stderr, "bag_rdr: can't size cache '%s' (%m)\n", path.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool read(uint64_t begin, uint64_t end, char* out) const
+    {
+        return ::pread(fd, out, size_t(end - begin), off_t(begin)) == ssize_t(end - begin);
+    }
+
+    void write(uint64_t begin, uint64_t end, const char* data)
+    {
+        if (::pwrite(fd, data, size_t(end - begin), off_t(begin)) == ssize_t(end - begin))
+            present.add(begin, end);
+        else
+            fprintf(stderr, "bag_rdr: can't write cache '%s' (%m)\n", path.c_str());
+    }
+
+    void save(uint64_t size, const std::string& validator) const
+    {
+        const std::string tmp = path + ".ranges.tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (!f)
+            return;
+        const uint64_t header[3] = {magic, size, validator.size()};
+        bool written = (fwrite(header, sizeof(header), 1, f) == 1) && (fwrite(validator.data(), 1, validator.size(), f) == validator.size());
+        for (const auto& r : present.ranges) {
+            const uint64_t range[2] = {r.first, r.second};
+            written = written && (fwrite(range, sizeof(range), 1, f) == 1);
+        }
+        if ((fclose(f) != 0) || !written || (::rename(tmp.c_str(), (path + ".ranges").c_str()) != 0))
+            ::unlink(tmp.c_str());
+    }
+};
+
+// a record at the start of remaining, advanced past it
+static bool s_next_record(common::array_view<const char>& remaining, common::array_view<const char>& header,
+                          common::array_view<const char>& data)
+{
+    uint32_t header_len, data_len;
+    if (remaining.size() < sizeof(uint32_t))
+        return false;
+    memcpy(&header_len, remaining.data(), sizeof(header_len));
+    if (remaining.size() < uint64_t(header_len) + 2 * sizeof(uint32_t))
+        return false;
+    memcpy(&data_len, remaining.data() + sizeof(uint32_t) + header_len, sizeof(data_len));
+    if (remaining.size() < uint64_t(header_len) + data_len + 2 * sizeof(uint32_t))
+        return false;
+    header = {remaining.data() + sizeof(uint32_t), header_len};
+    data = {header.end() + sizeof(uint32_t), data_len};
+    remaining = {data.end(), remaining.end()};
+    return true;
+}
+
+// the value of header field name, empty if absent
+static common::array_view<const char> s_field(common::array_view<const char> header, const char* name)
+{
+    const size_t name_len = strlen(name);
+    while (header.size() >= sizeof(uint32_t)) {
+        uint32_t len;
+        memcpy(&len, header.data(), sizeof(len));
+        if (header.size() - sizeof(uint32_t) < len)
+            break;
+        const char* field = header.data() + sizeof(uint32_t);
+        if ((len > name_len) && (field[name_len] == '=') && !memcmp(field, name, name_len))
+            return {field + name_len + 1, len - name_len - 1};
+        header = header.advance(sizeof(uint32_t) + len);
+    }
+    return {};
+}
+
+template <typename T>
+static bool s_field_value(common::array_view<const char> header, const char* name, T& out)
+{
+    const common::array_view<const char> value = s_field(header, name);
+    if (value.size() != sizeof(T))
+        return false;
+    memcpy(&out, value.data(), sizeof(T));
+    return true;
+}
+
+struct http_source : bag_source
+{
+    bag_source::http_options opts;
+    http_connection conn;
+    std::unique_ptr<http_cache> cache;
+    std::vector<uint64_t> offsets;
+    // ranges fetched at open, ahead of bag_rdr asking for them
+    struct staged_range
+    {
+        uint64_t begin;
+        std::vector<char> bytes;
+        uint64_t end() const { return begin + bytes.size(); }
+    };
+    std::vector<staged_range> staged;
+
+    uint64_t size() const override { return conn.total_size; }
+    size_t segment_count() const override { return offsets.size() - 1; }
+    uint64_t segment_offset(size_t i) const override { return offsets[i]; }
+    std::string name() const override { return conn.url; }
+
+    const staged_range* staged_for(uint64_t begin, uint64_t end) const
+    {
+        auto it = std::upper_bound(staged.begin(), staged.end(), begin, [] (uint64_t pos, const staged_range& r) { return pos < r.begin; });
+        if ((it == staged.begin()) || (std::prev(it)->end() < end))
+            return nullptr;
+        return &*std::prev(it);
+    }
+
+    bool is_local(uint64_t begin, uint64_t end) const
+    {
+        return staged_for(begin, end) || (cache && cache->present.covers(begin, end));
+    }
+
+    // ranges staged or cached are copied, the rest fetched in one pipeline
+    bool read(std::vector<range_request>& ranges)
+    {
+        std::vector<range_request> fetch;
+        for (const range_request& r : ranges) {
+            if (const staged_range* s = staged_for(r.begin, r.end)) {
+                memcpy(r.out, s->bytes.data() + (r.begin - s->begin), size_t(r.end - r.begin));
+                continue;
+            }
+            if (cache && cache->present.covers(r.begin, r.end) && cache->read(r.begin, r.end, r.out))
+                continue;
+            fetch.push_back(r);
+        }
+        if (fetch.empty())
+            return true;
+        if (!conn.get(fetch))
+            return false;
+        if (cache) {
+            for (const range_request& r : fetch)
+                cache->write(r.begin, r.end, r.out);
+            cache->save(conn.total_size, conn.validator);
+        }
+        return true;
+    }
+
+    bool fill(size_t first, size_t count, char* out) override
+    {
+        // adjacent segments not held locally become one request
+        std::vector<range_request> ranges;
+        bool extendable = false;
+        for (size_t i = first; i < first + count; ++i) {
+            const uint64_t begin = offsets[i], end = offsets[i + 1];
+            const bool local = is_local(begin, end);
+            if (!local && extendable)
+                ranges.back().end = end;
+            else
+                ranges.push_back(range_request{begin, end, out + (begin - offsets[first])});
+            extendable = !local;
+        }
+        return read(ranges);
+    }
+
+    /**
+     * From the bag header and index section, segment boundaries at each
+     * chunk, its record header, chunk data in segment_size pieces and the
+     * index data records after it, which are sized from the chunk info.
+     * Fetches the bag header, chunk headers and index data.
+     */
+    bool load_layout(std::vector<char>& initial)
+    {
+        const uint64_t size = conn.total_size;
+        common::array_view<const char> remaining{initial.data(), initial.size()};
+        const char magic[] = "#ROSBAG V2.0\n";
+        if ((remaining.size() < sizeof(magic) - 1) || memcmp(remaining.data(), magic, sizeof(magic) - 1)) {
+            fprintf(stderr, "bag_rdr: '%s' is not a v2.0 bag\n", conn.url.c_str());
+            return false;
+        }
+        remaining = remaining.advance(sizeof(magic) - 1);
+        common::array_view<const char> header, data;
+        int64_t index_pos = 0;
+        if (!s_next_record(remaining, header, data) || !s_field_value(header, "index_pos", index_pos)
+                || (index_pos <= 0) || (uint64_t(index_pos) >= size)) {
+            fprintf(stderr, "bag_rdr: '%s' has no index, it can't be read remotely\n", conn.url.c_str());
+            return false;
+        }
+        const uint64_t data_begin = uint64_t(remaining.data() - initial.data());
+        staged.push_back(staged_range{0, std::move(initial)});
+
+        staged_range index{uint64_t(index_pos), std::vector<char>(size_t(size - index_pos))};
+        std::vector<range_request> index_request{range_request{index.begin, size, index.bytes.data()}};
+        if (!read(index_request))
+            return false;
+
+        struct chunk_position
+        {
+            uint64_t pos;
+            // index data records after the chunk, an upper bound
+            uint64_t index_data;
+        };
+        std::vector<chunk_position> chunks;
+        for (remaining = {index.bytes.data(), index.bytes.size()}; s_next_record(remaining, header, data); ) {
+            int8_t op = 0;
+            int64_t chunk_pos = 0;
+            if (!s_field_value(header, "op", op) || (op != 0x06) || !s_field_value(header, "chunk_pos", chunk_pos))
+                continue;
+            // pairs of connection id and message count, an index data record per connection
+            uint64_t index_data = 0;
+            for (size_t at = 0; at + 8 <= data.size(); at += 8) {
+                uint32_t count;
+                memcpy(&count, data.data() + at + 4, sizeof(count));
+                index_data += 64 + 12 * uint64_t(count);
+            }
+            if ((chunk_pos > 0) && (uint64_t(chunk_pos) >= data_begin) && (chunk_pos < index_pos))
+                chunks.push_back(chunk_position{uint64_t(chunk_pos), index_data});
+        }
+        staged.push_back(std::move(index));
+        std::sort(chunks.begin(), chunks.end(), [] (const chunk_position& a, const chunk_position& b) { return a.pos < b.pos; });
+
+        offsets = {0, data_begin, uint64_t(index_pos), size};
+        std::vector<std::pair<uint64_t, uint64_t>> metadata{{data_begin, chunks.size() ? chunks.front().pos : uint64_t(index_pos)}};
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            const uint64_t pos = chunks[i].pos;
+            const uint64_t next = (i + 1 < chunks.size()) ? chunks[i + 1].pos : uint64_t(index_pos);
+            const uint64_t head_end = std::min(pos + s_chunk_head, next);
+            const uint64_t tail_begin = std::max(head_end, (next - pos > chunks[i].index_data) ? next - chunks[i].index_data : pos);
+            offsets.push_back(pos);
+            for (uint64_t at = head_end; at < tail_begin; at += opts.segment_size)
+                offsets.push_back(at);
+            offsets.push_back(tail_begin);
+            metadata.emplace_back(pos, head_end);
+            metadata.emplace_back(tail_begin, next);
+        }
+        std::sort(offsets.begin(), offsets.end());
+        offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+
+        // merged across small gaps, and without what is already staged or cached
+        std::sort(metadata.begin(), metadata.end());
+        std::vector<std::pair<uint64_t, uint64_t>> merged;
+        for (const auto& m : metadata) {
+            if ((m.first == m.second) || is_local(m.first, m.second))
+                continue;
+            if (merged.size() && (m.first <= merged.back().second + opts.merge_gap))
+                merged.back().second = std::max(merged.back().second, m.second);
+            else
+                merged.push_back(m);
+        }
+        std::vector<staged_range> fetched;
+        std::vector<range_request> requests;
+        fetched.reserve(merged.size());
+        for (const auto& m : merged) {
+            fetched.push_back(staged_range{m.first, std::vector<char>(size_t(m.second - m.first))});
+            requests.push_back(range_request{m.first, m.second, fetched.back().bytes.data()});
+        }
+        if (!read(requests))
+            return false;
+        for (staged_range& r : fetched)
+            staged.push_back(std::move(r));
+        std::sort(staged.begin(), staged.end(), [] (const staged_range& a, const staged_range& b) { return a.begin < b.begin; });
+        return true;
+    }
+};
+
+common::result<common::ok, common::unix_err> bag_source::open_http(const char* url, const http_options& opts,
+                                                                   std::unique_ptr<bag_source>& out)
+{
+    const std::string str{url};
+    if (str.compare(0, 8, "https://") == 0) {
+        fprintf(stderr, "bag_rdr: '%s': https isn't supported, use http through a TLS proxy\n", url);
+        return common::unix_err{ENOTSUP};
+    }
+    if ((str.compare(0, 7, "http://") != 0) || !opts.segment_size) {
+        fprintf(stderr, "bag_rdr: '%s' is not an http url\n", url);
+        return common::unix_err{EINVAL};
+    }
+
+    std::unique_ptr<http_source> source{new http_source};
+    source->opts = opts;
+    http_connection& conn = source->conn;
+    conn.url = str;
+    conn.timeout_ms = opts.timeout_ms;
+    const size_t authority_end = str.find('/', 7);
+    const std::string authority = str.substr(7, authority_end - 7);
+    conn.authority = authority;
+    conn.target = (authority_end == std::string::npos) ? "/" : str.substr(authority_end);
+    const size_t port_colon = authority.rfind(':');
+    if ((port_colon != std::string::npos) && (authority.find(']', port_colon) == std::string::npos)) {
+        conn.host = authority.substr(0, port_colon);
+        conn.port = authority.substr(port_colon + 1);
+    } else {
+        conn.host = authority;
+        conn.port = "80";
+    }
+    if ((conn.host.size() > 1) && (conn.host.front() == '['))
+        conn.host = conn.host.substr(1, conn.host.size() - 2);
+    if (conn.host.empty())
+        return common::unix_err{EINVAL};
+
+    std::vector<char> initial(s_initial_fetch);
+    std::vector<range_request> first{range_request{0, s_initial_fetch, initial.data()}};
+    if (!conn.get(first))
+        return common::unix_err{EIO};
+    initial.resize(size_t(first.front().end));
+    if (opts.cache_path.size()) {
+        source->cache.reset(new http_cache);
+        if (!source->cache->open(opts.cache_path, conn.total_size, conn.validator))
+            return common::unix_err{EIO};
+    }
+    if (!source->load_layout(initial))
+        return common::unix_err{EIO};
+
+    out = std::move(source);
+    return common::ok{};
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_loader.hpp"
+#pragma GCC diagnostic pop
+
+#include <algorithm>
+#include <cstdio>
+
+bag_loader::bag_loader(std::vector<const bag_rdr*> bags, options opts)
+: m_bags(std::move(bags)), m_opts(std::move(opts))
+{
+    const bool frames = !m_opts.frame_topics.empty();
+    const std::vector<std::string>& topics = frames ? m_opts.frame_topics : m_opts.topics;
+    for (size_t b = 0; b < m_bags.size(); ++b) {
+        const bag_rdr& rdr = *m_bags[b];
+        std::vector<int32_t> roles(rdr.connection_count(), topics.empty() ? 0 : -1);
+        for (size_t id = 0; id < roles.size() && !topics.empty(); ++id) {
+            const common::string_view topic = rdr.get_connection_info(int32_t(id)).topic;
+            for (size_t t = 0; t < topics.size(); ++t) {
+                if (topic == common::string_view{topics[t]}) {
+                    roles[id] = frames ? int32_t(t) : 0;
+                    break;
+                }
+            }
+        }
+        // frames are anchored on their first topic
+        for (size_t c = 0; c < rdr.chunk_count(); ++c) {
+            for (const int32_t id : rdr.get_chunk_summary(c).connection_ids) {
+                if ((size_t(id) < roles.size()) && (frames ? (roles[id] == 0) : (roles[id] >= 0))) {
+                    m_units.push_back(unit{uint32_t(b), uint32_t(c)});
+                    break;
+                }
+            }
+        }
+        m_roles.push_back(std::move(roles));
+    }
+    start_epoch(0);
+}
+
+bag_loader::~bag_loader()
+{
+    stop();
+}
+
+void bag_loader::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard{m_lock};
+        m_stop = true;
+    }
+    m_space.notify_all();
+    m_ready.notify_all();
+    for (std::thread& t : m_workers)
+        t.join();
+    m_workers.clear();
+}
+
+void bag_loader::start_epoch(uint64_t epoch)
+{
+    stop();
+    m_rng.seed(m_opts.seed ^ (epoch * 0x9e3779b97f4a7c15ull));
+    // by hand, as std::shuffle and the standard distributions differ between libraries
+    m_order = m_units;
+    for (size_t i = m_order.size(); i > 1; --i)
+        std::swap(m_order[i - 1], m_order[m_rng() % i]);
+
+    const size_t prefetch = std::max<size_t>(1, m_opts.prefetch_chunks);
+    m_slots.assign(prefetch, {});
+    m_slot_ready.assign(prefetch, 0);
+    m_next_unit = 0;
+    m_taken_units = 0;
+    m_stop = false;
+    m_pending.clear();
+    m_pending_pos = 0;
+    m_units_done = false;
+    m_buffer.clear();
+
+    unsigned threads = m_opts.threads ? m_opts.threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, std::max<size_t>(1, m_order.size()));
+    for (unsigned t = 0; t < threads; ++t)
+        m_workers.emplace_back([this] { work(); });
+}
+
+void bag_loader::work()
+{
+    const size_t prefetch = m_slots.size();
+    std::vector<char> buffer;
+    for (;;) {
+        size_t u;
+        {
+            std::unique_lock<std::mutex> lock{m_lock};
+            m_space.wait(lock, [&] { return m_stop || (m_next_unit >= m_order.size()) || (m_next_unit < m_taken_units + prefetch); });
+            if (m_stop || (m_next_unit >= m_order.size()))
+                return;
+            u = m_next_unit++;
+        }
+        std::vector<sample> samples;
+        load_unit(m_order[u], buffer, samples);
+        {
+            std::lock_guard<std::mutex> guard{m_lock};
+            m_slots[u % prefetch] = std::move(samples);
+            m_slot_ready[u % prefetch] = 1;
+        }
+        m_ready.notify_one();
+    }
+}
+
+bool bag_loader::take_unit(std::vector<sample>& out)
+{
+    const size_t prefetch = m_slots.size();
+    {
+        std::unique_lock<std::mutex> lock{m_lock};
+        m_ready.wait(lock, [&] { return (m_taken_units >= m_order.size()) || m_slot_ready[m_taken_units % prefetch]; });
+        if (m_taken_units >= m_order.size())
+            return false;
+        const size_t slot = m_taken_units % prefetch;
+        out = std::move(m_slots[slot]);
+        m_slots[slot].clear();
+        m_slot_ready[slot] = 0;
+        ++m_taken_units;
+    }
+    m_space.notify_one();
+    return true;
+}
+
+bool bag_loader::next(sample& out)
+{
+    while ((m_buffer.size() < std::max<size_t>(1, m_opts.shuffle_buffer)) && !m_units_done) {
+        if (m_pending_pos < m_pending.size()) {
+            m_buffer.push_back(std::move(m_pending[m_pending_pos++]));
+            continue;
+        }
+        m_pending.clear();
+        m_pending_pos = 0;
+        if (!take_unit(m_pending))
+            m_units_done = true;
+    }
+    if (m_buffer.empty())
+        return false;
+    const size_t i = m_rng() % m_buffer.size();
+    out = std::move(m_buffer[i]);
+    if (i + 1 != m_buffer.size())
+        m_buffer[i] = std::move(m_buffer.back());
+    m_buffer.pop_back();
+    return true;
+}
+
+static bag_loader::message s_copy(const bag_rdr::chunk_message& msg)
+{
+    return bag_loader::message{msg.connection_id, msg.stamp, std::vector<char>(msg.data.begin(), msg.data.end())};
+}
+
+void bag_loader::load_unit(const unit& u, std::vector<char>& buffer, std::vector<sample>& out) const
+{
+    const bag_rdr& rdr = *m_bags[u.bag_index];
+    const std::vector<int32_t>& roles = m_roles[u.bag_index];
+    bool read;
+    if (m_opts.frame_topics.empty()) {
+        read = rdr.for_each_chunk_message(u.chunk_index, buffer, [&] (const bag_rdr::chunk_message& msg) {
+            if (roles[msg.connection_id] < 0)
+                return;
+            out.push_back(sample{u.bag_index, u.chunk_index, {}});
+            out.back().messages.push_back(s_copy(msg));
+        });
+    } else {
+        // refer to buffer until the frames are copied out
+        std::vector<std::vector<bag_rdr::chunk_message>> by_topic(m_opts.frame_topics.size());
+        read = rdr.for_each_chunk_message(u.chunk_index, buffer, [&] (const bag_rdr::chunk_message& msg) {
+            if (roles[msg.connection_id] >= 0)
+                by_topic[roles[msg.connection_id]].push_back(msg);
+        });
+        for (std::vector<bag_rdr::chunk_message>& msgs : by_topic) {
+            std::stable_sort(msgs.begin(), msgs.end(), [] (const bag_rdr::chunk_message& a, const bag_rdr::chunk_message& b) {
+                return a.stamp < b.stamp;
+            });
+        }
+        std::vector<const bag_rdr::chunk_message*> members(by_topic.size());
+        for (const bag_rdr::chunk_message& anchor : by_topic[0]) {
+            const int64_t anchor_ns = bag_rdr::stamp_to_ns(anchor.stamp);
+            members[0] = &anchor;
+            bool complete = true;
+            for (size_t t = 1; complete && (t < by_topic.size()); ++t) {
+                const std::vector<bag_rdr::chunk_message>& msgs = by_topic[t];
+                auto it = std::lower_bound(msgs.begin(), msgs.end(), anchor.stamp, [] (const bag_rdr::chunk_message& m, common::timestamp stamp) {
+                    return m.stamp < stamp;
+                });
+                // the nearer of the neighbours around the anchor
+                const bag_rdr::chunk_message* nearest = nullptr;
+                int64_t nearest_dt = 0;
+                if (it != msgs.end()) {
+                    nearest = &*it;
+                    nearest_dt = bag_rdr::stamp_to_ns(it->stamp) - anchor_ns;
+                }
+                if ((it != msgs.begin()) && (!nearest || (anchor_ns - bag_rdr::stamp_to_ns((it - 1)->stamp) < nearest_dt))) {
+                    nearest = &*(it - 1);
+                    nearest_dt = anchor_ns - bag_rdr::stamp_to_ns(nearest->stamp);
+                }
+                complete = nearest && (nearest_dt <= m_opts.frame_tolerance_ns);
+                members[t] = nearest;
+            }
+            if (!complete)
+                continue;
+            out.push_back(sample{u.bag_index, u.chunk_index, {}});
+            out.back().messages.reserve(members.size());
+            for (const bag_rdr::chunk_message* m : members)
+                out.back().messages.push_back(s_copy(*m));
+        }
+    }
+    if (!read) {
+        fprintf(stderr, "bag_rdr: loader: chunk %u of '%s' couldn't be read\n", u.chunk_index, rdr.filename().c_str());
+        out.clear();
+    }
+}
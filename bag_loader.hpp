@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_LOADER_HPP
+#define BAG_LOADER_HPP
+
+#include "bag_rdr.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Training data loader, sampling messages or time synchronised frames
+ * from a collection of bags in a seeded pseudo-random order.
+ *
+ * Each epoch visits every chunk holding selected topics once, in a
+ * shuffled order. Background threads decompress chunks ahead of the
+ * consumer, and the samples they hold go through a bounded shuffle
+ * buffer that next() draws from at random. The same bags, options
+ * and epoch give the same sequence regardless of thread timing.
+ */
+struct bag_loader
+{
+    struct options
+    {
+        // empty samples every topic
+        std::vector<std::string> topics;
+        /**
+         * If set, samples are frames instead: each message of the first
+         * topic with the nearest message of every other topic within
+         * frame_tolerance_ns, from the same chunk. Incomplete frames are
+         * dropped. topics is ignored.
+         */
+        std::vector<std::string> frame_topics;
+        int64_t frame_tolerance_ns = 50000000;
+        size_t shuffle_buffer = 4096;
+        unsigned threads = 0;
+        // chunks decoded ahead of the shuffle buffer
+        size_t prefetch_chunks = 16;
+        uint64_t seed = 0;
+    };
+    struct message
+    {
+        int32_t connection_id;
+        common::timestamp stamp;
+        std::vector<char> data;
+    };
+    struct sample
+    {
+        size_t bag_index;
+        size_t chunk_index;
+        // one per message, or in frame_topics order for frames
+        std::vector<message> messages;
+    };
+
+    // the bags must stay open while the loader is alive
+    bag_loader(std::vector<const bag_rdr*> bags, options opts);
+    bag_loader(const bag_loader&) = delete;
+    bag_loader& operator=(const bag_loader&) = delete;
+    ~bag_loader();
+
+    // starts over, with an order derived from the seed and epoch
+    void start_epoch(uint64_t epoch);
+    // false at the end of the epoch
+    bool next(sample& out);
+    // chunks visited per epoch
+    size_t unit_count() const { return m_units.size(); }
+
+    // detail
+    struct unit
+    {
+        uint32_t bag_index;
+        uint32_t chunk_index;
+    };
+    void stop();
+    void work();
+    bool take_unit(std::vector<sample>& out);
+    void load_unit(const unit& u, std::vector<char>& buffer, std::vector<sample>& out) const;
+
+    const std::vector<const bag_rdr*> m_bags;
+    const options m_opts;
+    // per bag by connection id, which topic it is in frame_topics, 0 in
+    // message mode, or -1 if not selected
+    std::vector<std::vector<int32_t>> m_roles;
+    std::vector<unit> m_units;
+    std::mt19937_64 m_rng;
+
+    std::mutex m_lock;
+    std::condition_variable m_space, m_ready;
+    std::vector<unit> m_order;
+    std::vector<std::vector<sample>> m_slots;
+    std::vector<char> m_slot_ready;
+    size_t m_next_unit = 0;
+    size_t m_taken_units = 0;
+    bool m_stop = false;
+    std::vector<std::thread> m_workers;
+
+    // consumer side
+    std::vector<sample> m_pending;
+    size_t m_pending_pos = 0;
+    bool m_units_done = false;
+    std::vector<sample> m_buffer;
+};
+
+#endif // BAG_LOADER_HPP
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_memory_budget.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+// with m_lock held, the caller drops the returned buffer after unlocking
+static bag_memory_budget::buffer_ptr s_evict(bag_memory_budget& b, std::list<bag_memory_budget::entry>::iterator it)
+{
+    const bag_memory_budget::entry e = *it;
+    b.m_entries.erase(std::make_pair(e.owner->id, e.key));
+    b.m_lru.erase(it);
+    --e.owner->usage.cached_chunks;
+    ++e.owner->usage.evictions;
+    return e.owner->evict(e.key);
+}
+
+size_t bag_memory_budget::used() const
+{
+    std::lock_guard<std::mutex> guard{m_lock};
+    return m_chunk_bytes + m_index_bytes;
+}
+
+std::vector<bag_memory_budget::bag_usage> bag_memory_budget::usage() const
+{
+    std::lock_guard<std::mutex> guard{m_lock};
+    std::vector<bag_usage> ret;
+    ret.reserve(m_clients.size());
+    for (const client* c : m_clients)
+        ret.push_back(c->usage);
+    return ret;
+}
+
+void bag_memory_budget::attach(client& c, std::string filename)
+{
+    std::lock_guard<std::mutex> guard{m_lock};
+    c.id = m_next_id++;
+    c.usage = bag_usage{};
+    c.usage.filename = std::move(filename);
+    m_clients.push_back(&c);
+}
+
+void bag_memory_budget::detach(client& c)
+{
+    std::vector<buffer_ptr> evicted;
+    {
+        std::lock_guard<std::mutex> guard{m_lock};
+        for (auto it = m_lru.begin(); it != m_lru.end(); ) {
+            auto next = std::next(it);
+            if (it->owner == &c)
+                evicted.push_back(s_evict(*this, it));
+            it = next;
+        }
+        m_index_bytes -= c.usage.index_bytes;
+        c.usage.index_bytes = 0;
+        m_clients.erase(std::remove(m_clients.begin(), m_clients.end(), &c), m_clients.end());
+    }
+    evicted.clear();
+    m_released.notify_all();
+}
+
+void bag_memory_budget::set_index_bytes(client& c, size_t bytes)
+{
+    std::lock_guard<std::mutex> guard{m_lock};
+    m_index_bytes = m_index_bytes - c.usage.index_bytes + bytes;
+    c.usage.index_bytes = bytes;
+}
+
+bag_memory_budget::buffer_ptr bag_memory_budget::admit(client& c, size_t key, std::vector<char> buffer)
+{
+    const size_t bytes = buffer.size();
+    std::unique_lock<std::mutex> lock{m_lock};
+    // a single item over the limit is let through once nothing else is held
+    while ((m_chunk_bytes + m_index_bytes + bytes > m_limit) && m_chunk_bytes) {
+        if (m_lru.empty()) {
+            // the rest is in use, and released as soon as it is copied from
+            m_released.wait(lock);
+            continue;
+        }
+        buffer_ptr evicted = s_evict(*this, m_lru.begin());
+        lock.unlock();
+        evicted.reset();
+        lock.lock();
+    }
+    m_chunk_bytes += bytes;
+    c.usage.chunk_bytes += bytes;
+    ++c.usage.decompressions;
+
+    const uint64_t client_id = c.id;
+    buffer_ptr item{new std::vector<char>(std::move(buffer)), [this, client_id, bytes] (const std::vector<char>* b) {
+        delete b;
+        release(client_id, bytes);
+    }};
+    // installed with the lock held so an eviction can't come in between
+    buffer_ptr kept = c.install(key, item);
+    const auto found = m_entries.find(std::make_pair(c.id, key));
+    if (found != m_entries.end()) {
+        m_lru.splice(m_lru.end(), m_lru, found->second);
+    } else {
+        m_lru.push_back(entry{&c, key});
+        m_entries.emplace(std::make_pair(c.id, key), std::prev(m_lru.end()));
+        ++c.usage.cached_chunks;
+    }
+    lock.unlock();
+    // dropping a duplicate from a concurrent decompression releases its charge
+    item.reset();
+    return kept;
+}
+
+void bag_memory_budget::touch(const client& c, size_t key)
+{
+    std::lock_guard<std::mutex> guard{m_lock};
+    const auto found = m_entries.find(std::make_pair(c.id, key));
+    if (found != m_entries.end())
+        m_lru.splice(m_lru.end(), m_lru, found->second);
+}
+
+void bag_memory_budget::release(uint64_t client_id, size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> guard{m_lock};
+        m_chunk_bytes -= bytes;
+        for (client* c : m_clients) {
+            if (c->id == client_id) {
+                c->usage.chunk_bytes -= bytes;
+                break;
+            }
+        }
+    }
+    m_released.notify_all();
+}
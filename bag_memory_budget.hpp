@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_MEMORY_BUDGET_HPP
+#define BAG_MEMORY_BUDGET_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * A memory limit shared by any number of bag_rdr instances through
+ * bag_rdr::options::memory_budget.
+ *
+ * Readers with a budget keep decompressed chunks for the following
+ * messages instead of decompressing the chunk again per message.
+ * Past the limit the least recently used chunks of all readers are
+ * evicted, and when only chunks still being copied from are left,
+ * the reader waits for them. Index metadata counts against the
+ * limit but is never evicted.
+ */
+struct bag_memory_budget
+{
+    struct bag_usage
+    {
+        std::string filename;
+        size_t chunk_bytes = 0;
+        size_t index_bytes = 0;
+        size_t cached_chunks = 0;
+        uint64_t decompressions = 0;
+        uint64_t evictions = 0;
+    };
+
+    explicit bag_memory_budget(size_t limit_bytes) : m_limit(limit_bytes) {}
+    bag_memory_budget(const bag_memory_budget&) = delete;
+    bag_memory_budget& operator=(const bag_memory_budget&) = delete;
+
+    size_t limit() const { return m_limit; }
+    size_t used() const;
+    // one entry per open reader
+    std::vector<bag_usage> usage() const;
+
+    // detail, for bag_rdr
+    using buffer_ptr = std::shared_ptr<const std::vector<char>>;
+    struct client
+    {
+        virtual ~client() = default;
+        // both called with the budget locked
+        // keep item as cached item key unless one already is, returns the kept one
+        virtual buffer_ptr install(size_t key, buffer_ptr item) = 0;
+        // give up cached item key
+        virtual buffer_ptr evict(size_t key) = 0;
+
+        uint64_t id = 0;
+        bag_usage usage;
+    };
+    void attach(client& c, std::string filename);
+    // evicts everything c still caches
+    void detach(client& c);
+    void set_index_bytes(client& c, size_t bytes);
+    /**
+     * Charge buffer and install it as c's cached item key, evicting or
+     * waiting as needed. The charge is returned when the last reference
+     * to the buffer goes away.
+     */
+    buffer_ptr admit(client& c, size_t key, std::vector<char> buffer);
+    // mark key as recently used
+    void touch(const client& c, size_t key);
+
+    struct entry
+    {
+        client* owner;
+        size_t key;
+    };
+    void release(uint64_t client_id, size_t bytes);
+
+    const size_t m_limit;
+    mutable std::mutex m_lock;
+    std::condition_variable m_released;
+    size_t m_chunk_bytes = 0;
+    size_t m_index_bytes = 0;
+    uint64_t m_next_id = 1;
+    std::vector<client*> m_clients;
+    // least recently used first
+    std::list<entry> m_lru;
+    std::map<std::pair<uint64_t, size_t>, std::list<entry>::iterator> m_entries;
+};
+
+#endif // BAG_MEMORY_BUDGET_HPP
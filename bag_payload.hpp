@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_PAYLOAD_HPP
+#define BAG_PAYLOAD_HPP
+
+#include "common/array_view.hpp"
+#include "common/string_view.hpp"
+#include "common/common_timestamp.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Zero-copy reader over a serialised ROS message payload,
+ * for decoding known message layouts without the generated
+ * C++ message code. Little-endian only, as the rest of bag_rdr.
+ *
+ * Reads past the end of the payload set the failed flag
+ * and return zero values, check ok() once after decoding.
+ */
+struct bag_payload_cursor
+{
+    common::array_view<const char> remaining;
+    bool failed = false;
+
+    bag_payload_cursor(common::array_view<const char> payload)
+    : remaining{payload}
+    { }
+
+    bool ok() const { return !failed; }
+    size_t size() const { return remaining.size(); }
+
+    template <typename T>
+    T read()
+    {
+        T ret{};
+        if (failed || (remaining.size() < sizeof(T))) {
+            failed = true;
+            return ret;
+        }
+        std::memcpy(&ret, remaining.data(), sizeof(T));
+        remaining = remaining.advance(sizeof(T));
+        return ret;
+    }
+    common::timestamp read_time()
+    {
+        const uint32_t secs = read<uint32_t>();
+        const uint32_t nsecs = read<uint32_t>();
+        return common::timestamp{secs, nsecs};
+    }
+    common::string_view read_string()
+    {
+        const uint32_t len = read<uint32_t>();
+        if (failed || (remaining.size() < len)) {
+            failed = true;
+            return {};
+        }
+        common::string_view ret {remaining.head(len)};
+        remaining = remaining.advance(len);
+        return ret;
+    }
+    bool skip(size_t bytes)
+    {
+        if (failed || (remaining.size() < bytes)) {
+            failed = true;
+            return false;
+        }
+        remaining = remaining.advance(bytes);
+        return true;
+    }
+};
+
+#endif // BAG_PAYLOAD_HPP
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_pipeline.hpp"
+#pragma GCC diagnostic pop
+
+#include <algorithm>
+#include <cstdio>
+#include <utility>
+
+bag_pipeline_base::bag_pipeline_base(const bag_rdr& rdr, const options& opts)
+: m_rdr(rdr),
+  m_threads(opts.threads ? opts.threads : std::max(1u, std::thread::hardware_concurrency())),
+  m_window(std::max<size_t>(1, opts.window)),
+  m_done(m_window, 0)
+{ }
+
+bag_pipeline_base::~bag_pipeline_base()
+{
+    stop();
+}
+
+bool bag_pipeline_base::failed() const
+{
+    std::lock_guard<std::mutex> guard{m_lock};
+    return m_failed;
+}
+
+void bag_pipeline_base::start(bag_rdr::view v)
+{
+    m_producer = std::thread{[this, v] () mutable { produce(v); }};
+    for (unsigned t = 0; t < m_threads; ++t)
+        m_workers.emplace_back([this] { work(); });
+}
+
+void bag_pipeline_base::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard{m_lock};
+        m_stop = true;
+    }
+    m_space.notify_all();
+    m_work.notify_all();
+    m_ready.notify_all();
+    if (m_producer.joinable())
+        m_producer.join();
+    for (std::thread& t : m_workers)
+        t.join();
+    m_workers.clear();
+}
+
+// with m_lock held
+void bag_pipeline_base::end_at(size_t seq)
+{
+    m_end = std::min(m_end, seq);
+    m_space.notify_all();
+    m_ready.notify_all();
+}
+
+void bag_pipeline_base::produce(bag_rdr::view& v)
+{
+    // runs short enough to spread over the workers when the window is full
+    const size_t max_run = std::max<size_t>(1, m_window / (2 * size_t(m_threads)));
+    // chunks of batches still queued or running, shared instead of decompressed again
+    std::vector<std::pair<size_t, std::weak_ptr<chunk_data>>> recent;
+    auto chunk_for = [&recent] (size_t chunk_index) {
+        recent.erase(std::remove_if(recent.begin(), recent.end(), [] (const std::pair<size_t, std::weak_ptr<chunk_data>>& r) {
+            return r.second.expired();
+        }), recent.end());
+        for (const auto& r : recent) {
+            if (r.first == chunk_index) {
+                if (std::shared_ptr<chunk_data> held = r.second.lock())
+                    return held;
+            }
+        }
+        auto made = std::make_shared<chunk_data>();
+        recent.emplace_back(chunk_index, made);
+        return made;
+    };
+
+    batch current{};
+    auto flush = [&] {
+        if (current.offsets.empty())
+            return;
+        {
+            std::lock_guard<std::mutex> guard{m_lock};
+            m_queue.push_back(std::move(current));
+        }
+        m_work.notify_one();
+        current = batch{};
+    };
+    auto finish = [&] (size_t seq, bool failed) {
+        flush();
+        {
+            std::lock_guard<std::mutex> guard{m_lock};
+            m_failed |= failed;
+            end_at(seq);
+            m_produced_all = true;
+        }
+        m_work.notify_all();
+    };
+
+    // the consumer only moves forward, so a stale bound is safe to check against
+    size_t bound = m_window;
+    size_t seq = 0;
+    const auto end = v.end();
+    for (auto it = v.begin(); it != end; ++it, ++seq) {
+        size_t chunk_index;
+        uint32_t offset;
+        if (!m_rdr.locate(it.handle(), chunk_index, offset)) {
+            fprintf(stderr, "bag_rdr: pipeline: message %zu not found in the index\n", seq);
+            return finish(seq, true);
+        }
+        if (current.offsets.size() && ((chunk_index != current.chunk_index) || (current.offsets.size() >= max_run)))
+            flush();
+        if (seq >= bound) {
+            // hand over what is pending before waiting for the consumer
+            flush();
+            std::unique_lock<std::mutex> lock{m_lock};
+            m_space.wait(lock, [&] { return m_stop || (seq >= m_end) || (seq < m_consumed + m_window); });
+            if (m_stop || (seq >= m_end))
+                return;
+            bound = m_consumed + m_window;
+        }
+        if (current.offsets.empty()) {
+            current.first = seq;
+            current.chunk_index = chunk_index;
+            current.chunk = chunk_for(chunk_index);
+        }
+        current.offsets.push_back(offset);
+    }
+    finish(seq, false);
+}
+
+void bag_pipeline_base::work()
+{
+    for (;;) {
+        batch b;
+        {
+            std::unique_lock<std::mutex> lock{m_lock};
+            m_work.wait(lock, [this] { return m_stop || !m_queue.empty() || m_produced_all; });
+            if (m_stop || m_queue.empty())
+                return;
+            b = std::move(m_queue.front());
+            m_queue.pop_front();
+            if (b.first >= m_end)
+                continue;
+        }
+
+        chunk_data& chunk = *b.chunk;
+        {
+            std::lock_guard<std::mutex> guard{chunk.lock};
+            if (!chunk.loaded) {
+                chunk.memory = m_rdr.uncompressed_chunk(b.chunk_index, chunk.buffer);
+                chunk.loaded = true;
+            }
+        }
+
+        size_t seq = b.first;
+        bool threw = false;
+        const bool read = chunk.memory.size() && m_rdr.for_each_chunk_message_at(b.chunk_index, b.offsets, chunk.memory,
+                                                                                [&] (const bag_rdr::chunk_message& cm) {
+            if (threw)
+                return;
+            const bag_rdr::message msg{.stamp = cm.stamp,
+                                       .md5 = cm.md5(),
+                                       .message_data_block = bag_rdr::message_payload{cm.data},
+                                       .connection = cm.connection};
+            try {
+                process(seq % m_window, msg);
+            } catch (...) {
+                threw = true;
+                std::lock_guard<std::mutex> guard{m_lock};
+                if (seq < m_end) {
+                    m_error = std::current_exception();
+                    m_error_seq = seq;
+                    end_at(seq);
+                }
+                return;
+            }
+            bool next_in_order;
+            {
+                std::lock_guard<std::mutex> guard{m_lock};
+                m_done[seq % m_window] = 1;
+                next_in_order = (seq == m_consumed);
+            }
+            if (next_in_order)
+                m_ready.notify_one();
+            ++seq;
+        });
+        if (!read && !threw) {
+            fprintf(stderr, "bag_rdr: pipeline: chunk %zu couldn't be read\n", b.chunk_index);
+            std::lock_guard<std::mutex> guard{m_lock};
+            m_failed = true;
+            end_at(seq);
+        }
+    }
+}
+
+bool bag_pipeline_base::wait_next(size_t& slot)
+{
+    std::unique_lock<std::mutex> lock{m_lock};
+    m_ready.wait(lock, [this] { return (m_consumed >= m_end) || m_done[m_consumed % m_window]; });
+    if (m_error && (m_consumed == m_error_seq)) {
+        std::exception_ptr error = std::move(m_error);
+        m_error = nullptr;
+        lock.unlock();
+        std::rethrow_exception(error);
+    }
+    if (m_consumed >= m_end)
+        return false;
+    slot = m_consumed % m_window;
+    return true;
+}
+
+void bag_pipeline_base::release_next()
+{
+    {
+        std::lock_guard<std::mutex> guard{m_lock};
+        m_done[m_consumed % m_window] = 0;
+        ++m_consumed;
+    }
+    m_space.notify_one();
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_PIPELINE_HPP
+#define BAG_PIPELINE_HPP
+
+#include "bag_rdr.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Decodes a view's messages on a pool of worker threads, e.g. to
+ * deserialise images or point clouds, while handing the results to
+ * the consumer strictly in view order. One thread walks the view's
+ * index and hands runs of messages from the same chunk to workers,
+ * which decompress each chunk once between them. At most window
+ * results are decoded ahead of the consumer.
+ *
+ * The bag_rdr is read from several threads, so other views of it
+ * used meanwhile need options::threadsafe.
+ */
+struct bag_pipeline_base
+{
+    struct options
+    {
+        // 0 uses the hardware concurrency
+        unsigned threads = 0;
+        // results held for the consumer at most, bounds memory use
+        size_t window = 64;
+    };
+
+    bag_pipeline_base(const bag_pipeline_base&) = delete;
+    bag_pipeline_base& operator=(const bag_pipeline_base&) = delete;
+
+    // iteration ended early as a chunk couldn't be read
+    bool failed() const;
+
+    // detail
+    bag_pipeline_base(const bag_rdr& rdr, const options& opts);
+    virtual ~bag_pipeline_base();
+    // decode msg into result slot, called from the workers
+    virtual void process(size_t slot, const bag_rdr::message& msg) = 0;
+    void start(bag_rdr::view v);
+    // joins all threads, before the derived results go away
+    void stop();
+    // waits for the next result in order, false at the end
+    bool wait_next(size_t& slot);
+    void release_next();
+
+    struct chunk_data
+    {
+        std::mutex lock;
+        bool loaded = false;
+        std::vector<char> buffer;
+        common::array_view<const char> memory;
+    };
+    struct batch
+    {
+        size_t first;
+        size_t chunk_index;
+        std::vector<uint32_t> offsets;
+        std::shared_ptr<chunk_data> chunk;
+    };
+    void produce(bag_rdr::view& v);
+    void work();
+    void end_at(size_t seq);
+
+    const bag_rdr& m_rdr;
+    const unsigned m_threads;
+    const size_t m_window;
+    mutable std::mutex m_lock;
+    std::condition_variable m_space, m_work, m_ready;
+    std::deque<batch> m_queue;
+    // per result slot, whether it holds a result not yet consumed
+    std::vector<char> m_done;
+    size_t m_consumed = 0;
+    // sequence number iteration ends at, once known
+    size_t m_end = size_t(-1);
+    bool m_produced_all = false;
+    bool m_stop = false;
+    bool m_failed = false;
+    std::exception_ptr m_error;
+    size_t m_error_seq = 0;
+    std::thread m_producer;
+    std::vector<std::thread> m_workers;
+};
+
+/**
+ * Results of fn over a view's messages, in view order:
+ *
+ *   bag_pipeline<sensor_msgs::Image> images{view, [] (const bag_rdr::message& msg) {
+ *       sensor_msgs::Image image;
+ *       msg.to(image);
+ *       return image;
+ *   }};
+ *   for (sensor_msgs::Image image; images.next(image); )
+ *       evaluate(image);
+ *
+ * The message payload is only valid during fn. T must be default
+ * constructible. An exception from fn is rethrown from next() in
+ * place of its result, after which iteration ends.
+ */
+template <class T>
+struct bag_pipeline : bag_pipeline_base
+{
+    using transform = std::function<T (const bag_rdr::message& msg)>;
+
+    bag_pipeline(bag_rdr::view v, transform fn, const options& opts = options{})
+    : bag_pipeline_base(v.rdr, opts), m_fn(std::move(fn)), m_results(m_window)
+    {
+        start(std::move(v));
+    }
+    ~bag_pipeline()
+    {
+        stop();
+    }
+
+    // the next result in view order, false at the end
+    bool next(T& out)
+    {
+        size_t slot;
+        if (!wait_next(slot))
+            return false;
+        out = std::move(m_results[slot]);
+        m_results[slot] = T{};
+        release_next();
+        return true;
+    }
+
+    // detail
+    void process(size_t slot, const bag_rdr::message& msg) override
+    {
+        m_results[slot] = m_fn(msg);
+    }
+
+    transform m_fn;
+    std::vector<T> m_results;
+};
+
+#endif // BAG_PIPELINE_HPP
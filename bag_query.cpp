@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_query.hpp"
+#pragma GCC diagnostic pop
+
+#include <algorithm>
+
+struct bag_query::state
+{
+    state(bag_rdr::view& v, std::vector<bag_query::stage> stages)
+    : it(v.begin()), last(v.end()), stages(std::move(stages)), counters(this->stages.size(), 0)
+    { }
+
+    bag_rdr::view::iterator it, last;
+    // a copy, so that iterators survive the query being moved
+    const std::vector<bag_query::stage> stages;
+    // per stage, messages that reached it
+    std::vector<size_t> counters;
+    bool done = false;
+};
+
+// a take stage has let its last message through
+static bool s_exhausted(const std::vector<bag_query::stage>& stages, const bag_query::state& s)
+{
+    for (size_t i = 0; i < stages.size(); ++i) {
+        if ((stages[i].what == bag_query::stage::kind::take) && (s.counters[i] >= stages[i].n))
+            return true;
+    }
+    return false;
+}
+
+// from the view's current message on, stops at the first one passing every stage
+static void s_settle(const std::vector<bag_query::stage>& stages, bag_query::state& s)
+{
+    using kind = bag_query::stage::kind;
+    for (; !(s.it == s.last); ++s.it) {
+        const common::timestamp stamp = s.it.get_current_msg_stamp();
+        bool pass = true;
+        for (size_t i = 0; pass && (i < stages.size()); ++i) {
+            const bag_query::stage& st = stages[i];
+            switch (st.what) {
+              case kind::filter:
+                pass = st.pred(stamp);
+                break;
+              case kind::take_while:
+                if (!st.pred(stamp)) {
+                    s.done = true;
+                    return;
+                }
+                break;
+              case kind::time_range:
+                // a connection's records needn't be in time order, so this can't end iteration
+                pass = (!st.start || (stamp >= st.start)) && (!st.end || (stamp <= st.end));
+                break;
+              case kind::topics: {
+                const int32_t connection_id = s.it.handle().connection_id;
+                pass = (size_t(connection_id) < st.connections.size()) && st.connections[connection_id];
+                break;
+              }
+              case kind::stride:
+                pass = !(s.counters[i]++ % st.n);
+                break;
+              case kind::take:
+                if (s.counters[i] >= st.n) {
+                    s.done = true;
+                    return;
+                }
+                ++s.counters[i];
+                break;
+            }
+        }
+        if (pass)
+            return;
+    }
+    s.done = true;
+}
+
+bool bag_query::iterator::at_end() const
+{
+    return !s || s->done;
+}
+
+bag_rdr::message bag_query::iterator::operator*() const
+{
+    return *s->it;
+}
+
+common::timestamp bag_query::iterator::stamp() const
+{
+    return s->it.get_current_msg_stamp();
+}
+
+bag_rdr::message_handle bag_query::iterator::handle() const
+{
+    return s->it.handle();
+}
+
+bag_query::iterator& bag_query::iterator::operator++()
+{
+    if (s_exhausted(s->stages, *s)) {
+        s->done = true;
+        return *this;
+    }
+    ++s->it;
+    s_settle(s->stages, *s);
+    return *this;
+}
+
+bag_query::bag_query(bag_rdr::view v)
+: m_view(new bag_rdr::view(std::move(v)))
+{ }
+
+bag_query::bag_query(const bag_query& other)
+: m_view(other.m_view ? new bag_rdr::view(*other.m_view) : nullptr),
+  m_stages(other.m_stages),
+  m_pushdown(other.m_pushdown)
+{ }
+
+bag_query::bag_query(bag_query&& other) noexcept = default;
+
+bag_query& bag_query::operator=(const bag_query& other)
+{
+    return *this = bag_query{other};
+}
+
+bag_query& bag_query::operator=(bag_query&& other) noexcept = default;
+
+bag_query::~bag_query() = default;
+
+bag_query::iterator bag_query::begin()
+{
+    if (!m_view)
+        return iterator{};
+    m_state.reset(new state{*m_view, m_stages});
+    if (s_exhausted(m_state->stages, *m_state))
+        m_state->done = true;
+    else
+        s_settle(m_state->stages, *m_state);
+    return iterator{m_state.get()};
+}
+
+void bag_query::add_topics(const std::vector<std::string>& topics)
+{
+    const bag_rdr& rdr = m_view->rdr;
+    auto selected = [&topics] (common::string_view topic) {
+        return std::any_of(topics.begin(), topics.end(), [topic] (const std::string& t) { return topic == common::string_view{t}; });
+    };
+    if (m_pushdown) {
+        std::vector<common::string_view> keep;
+        if (m_view->m_connections) {
+            for (const int32_t connection_id : *m_view->m_connections) {
+                const common::string_view topic = rdr.get_connection_info(connection_id).topic;
+                if (selected(topic) && (std::find(keep.begin(), keep.end(), topic) == keep.end()))
+                    keep.push_back(topic);
+            }
+        } else {
+            keep.assign(topics.begin(), topics.end());
+        }
+        m_view->set_topics(common::array_view<common::string_view>{keep});
+        return;
+    }
+    stage s{.what = stage::kind::topics};
+    s.connections.resize(rdr.connection_count());
+    for (size_t i = 0; i < s.connections.size(); ++i)
+        s.connections[i] = selected(rdr.get_connection_info(int32_t(i)).topic);
+    add_stage(std::move(s));
+}
+
+void bag_query::add_time_range(timestamp start, timestamp end)
+{
+    if (m_pushdown) {
+        if (start && (!m_view->m_start_time || (m_view->m_start_time < start)))
+            m_view->m_start_time = start;
+        if (end && (!m_view->m_end_time || (end < m_view->m_end_time)))
+            m_view->m_end_time = end;
+        return;
+    }
+    add_stage(stage{.what = stage::kind::time_range, .start = start, .end = end});
+}
+
+void bag_query::add_stage(stage s)
+{
+    if ((s.what == stage::kind::take_while) || (s.what == stage::kind::stride) || (s.what == stage::kind::take))
+        m_pushdown = false;
+    m_stages.push_back(std::move(s));
+}
+
+bag_query::adaptor bag_query::topics(std::vector<std::string> topics)
+{
+    return adaptor{[topics] (bag_query& q) { q.add_topics(topics); }};
+}
+
+bag_query::adaptor bag_query::time_range(timestamp start, timestamp end)
+{
+    return adaptor{[start, end] (bag_query& q) { q.add_time_range(start, end); }};
+}
+
+bag_query::adaptor bag_query::filter_stamp(stamp_predicate pred)
+{
+    return adaptor{[pred] (bag_query& q) { q.add_stage(stage{.what = stage::kind::filter, .pred = pred}); }};
+}
+
+bag_query::adaptor bag_query::take_while_stamp(stamp_predicate pred)
+{
+    return adaptor{[pred] (bag_query& q) { q.add_stage(stage{.what = stage::kind::take_while, .pred = pred}); }};
+}
+
+bag_query::adaptor bag_query::stride(size_t n)
+{
+    return adaptor{[n] (bag_query& q) { q.add_stage(stage{.what = stage::kind::stride, .n = std::max<size_t>(n, 1)}); }};
+}
+
+bag_query::adaptor bag_query::take(size_t n)
+{
+    return adaptor{[n] (bag_query& q) { q.add_stage(stage{.what = stage::kind::take, .n = n}); }};
+}
+
+bag_query operator|(bag_rdr::view v, const bag_query::adaptor& a)
+{
+    bag_query q{std::move(v)};
+    a.apply(q);
+    return q;
+}
+
+bag_query operator|(bag_query q, const bag_query::adaptor& a)
+{
+    q.m_state.reset();
+    a.apply(q);
+    return q;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_QUERY_HPP
+#define BAG_QUERY_HPP
+
+#include "bag_rdr.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if (__cplusplus >= 202002L) && __has_include(<ranges>)
+#include <ranges>
+#endif
+
+/**
+ * A lazily filtered view, composed with operator|:
+ *
+ *   for (bag_rdr::message msg : bag.get_view() | bag_query::topics({"/odom"})
+ *                                              | bag_query::stride(10)
+ *                                              | bag_query::take(100))
+ *
+ * Every adaptor is decided from the index, so skipped messages are never
+ * decompressed, and take() or a failing take_while_stamp() end iteration
+ * without planning any further. Topics and time ranges are folded into
+ * the underlying view while only filters come before them, otherwise
+ * they filter on record time like filter_stamp().
+ *
+ * An input range; with C++20 it models std::ranges::view, so standard
+ * adaptors such as std::views::transform compose after it.
+ */
+struct bag_query
+{
+    using timestamp = common::timestamp;
+    using stamp_predicate = std::function<bool (timestamp stamp)>;
+
+    struct adaptor
+    {
+        std::function<void (bag_query& q)> apply;
+    };
+    static adaptor topics(std::vector<std::string> topics);
+    // inclusive, a zero bound is open as in bag_rdr::view
+    static adaptor time_range(timestamp start, timestamp end);
+    // on record time
+    static adaptor filter_stamp(stamp_predicate pred);
+    static adaptor take_while_stamp(stamp_predicate pred);
+    // every nth message
+    static adaptor stride(size_t n);
+    static adaptor take(size_t n);
+
+    struct state;
+    struct iterator
+    {
+        using iterator_category = std::input_iterator_tag;
+        using value_type = bag_rdr::message;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = bag_rdr::message;
+
+        bag_rdr::message operator*() const;
+        // of the current message, without decoding it
+        timestamp stamp() const;
+        bag_rdr::message_handle handle() const;
+        iterator& operator++();
+        void operator++(int) { ++*this; }
+        bool operator==(const iterator& other) const { return at_end() == other.at_end(); }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+
+        bool at_end() const;
+        state* s = nullptr;
+    };
+
+    bag_query() = default;
+    explicit bag_query(bag_rdr::view v);
+    bag_query(const bag_query& other);
+    bag_query(bag_query&& other) noexcept;
+    bag_query& operator=(const bag_query& other);
+    bag_query& operator=(bag_query&& other) noexcept;
+    ~bag_query();
+
+    // starts over, invalidating earlier iterators
+    iterator begin();
+    iterator end() const { return iterator{}; }
+
+    // detail
+    struct stage
+    {
+        enum class kind { filter, take_while, time_range, topics, stride, take };
+        kind what = kind::filter;
+        stamp_predicate pred = {};
+        timestamp start = {}, end = {};
+        // by connection id
+        std::vector<bool> connections = {};
+        size_t n = 0;
+    };
+    void add_topics(const std::vector<std::string>& topics);
+    void add_time_range(timestamp start, timestamp end);
+    void add_stage(stage s);
+
+    std::unique_ptr<bag_rdr::view> m_view;
+    std::vector<stage> m_stages;
+    // nothing order dependent has been added yet
+    bool m_pushdown = true;
+    std::unique_ptr<state> m_state;
+};
+
+bag_query operator|(bag_rdr::view v, const bag_query::adaptor& a);
+bag_query operator|(bag_query q, const bag_query::adaptor& a);
+
+#ifdef __cpp_lib_ranges
+template <>
+inline constexpr bool std::ranges::enable_view<bag_query> = true;
+#endif
+
+#endif // BAG_QUERY_HPP
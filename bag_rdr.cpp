@@ -31,12 +31,26 @@
 #include "common/common_timestamp.hpp"
 #include "common/common_optional.hpp"
 
+#include "bag_fields.hpp"
+#include "bag_hash.hpp"
+#include "bag_memory_budget.hpp"
+#include "bag_sidecar.hpp"
+#include "bag_source.hpp"
+
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
 #include <numeric>
 #include <mutex>
+#include <atomic>
+#include <thread>
 
 #ifndef DISABLE_BZ2
 #include <bzlib.h>
@@ -146,7 +160,9 @@ struct header
         if (!inner.size())
             return;
         real_range = {memory_range.begin(), inner.end()};
-        auto sep = std::find(inner.begin(), inner.end(), '=');
+        const char* sep = static_cast<const char*>(std::memchr(inner.data(), '=', inner.size()));
+        if (!sep)
+            sep = inner.end();
         name = {inner.begin(), sep};
         value = {sep+1, inner.end()};
     }
@@ -222,36 +238,108 @@ struct headers
     {
         return iterator{{}};
     }
-    template <typename T>
-    size_t extract_headers_inner(const header& hdr, const char* field, common::optional<T>& t)
+
+    // Field names are string literals, so their lengths are compile-time
+    // constants: a name is only compared when its length is one of them,
+    // and then against the single candidate of that length and first byte.
+    template <size_t N>
+    static constexpr uint64_t length_bit(const char (&)[N]) { return (N - 1 < 64) ? (uint64_t(1) << (N - 1)) : 0; }
+    static constexpr uint64_t length_mask() { return 0; }
+    template <size_t N, typename T, typename... Ts>
+    static constexpr uint64_t length_mask(const char (&field)[N], const common::optional<T>&, const Ts&... remaining_string_type_pairs)
+    {
+        return length_bit(field) | length_mask(remaining_string_type_pairs...);
+    }
+
+    static size_t extract_headers_inner(common::string_view, common::array_view<const char>) { return 0; }
+    template <size_t N, typename T, typename... Ts>
+    static size_t extract_headers_inner(common::string_view name, common::array_view<const char> value,
+                                        const char (&field)[N], common::optional<T>& t, Ts&... remaining_string_type_pairs)
     {
-        if (hdr.name != field)
-            return 0;
+        if ((name.size() != N - 1) || (name.data()[0] != field[0]) || std::memcmp(name.data(), field, N - 1))
+            return extract_headers_inner(name, value, remaining_string_type_pairs...);
         T val;
-        if (extract_type(hdr.value, val)) {
+        if (extract_type(value, val)) {
             t = std::move(val);
         }
         return 1;
     }
-    template <typename T, typename... Ts>
-    size_t extract_headers_inner(const header& hdr, const char* field, common::optional<T>& t, Ts&... remaining_string_type_pairs)
-    {
-        return extract_headers_inner(hdr, field, t) || extract_headers_inner(hdr, remaining_string_type_pairs...);
-    }
+    // single pass over the fields, without building header objects
     template <typename... Ts>
     size_t extract_headers(Ts&... string_type_pairs)
     {
         size_t count_filled = 0;
         enum { TOTAL_PAIR_COUNT = sizeof...(string_type_pairs)/2 };
-        for (const header& h: *this) {
-            count_filled += extract_headers_inner(h, string_type_pairs...);
-            if (count_filled == TOTAL_PAIR_COUNT)
+        const uint64_t lengths = length_mask(string_type_pairs...);
+        const char* pos = memory_range.begin();
+        const char* const end = memory_range.end();
+        while (end - pos >= int(sizeof(uint32_t))) {
+            uint32_t field_size;
+            std::memcpy(&field_size, pos, sizeof(field_size));
+            pos += sizeof(uint32_t);
+            if (!field_size || (field_size > size_t(end - pos)))
                 break;
+            const char* const field_end = pos + field_size;
+            const char* const sep = static_cast<const char*>(std::memchr(pos, '=', field_size));
+            if (sep && (size_t(sep - pos) < 64) && (lengths & (uint64_t(1) << (sep - pos)))) {
+                count_filled += extract_headers_inner(common::string_view{pos, sep}, common::array_view<const char>{sep + 1, field_end},
+                                                      string_type_pairs...);
+                if (count_filled == TOTAL_PAIR_COUNT)
+                    break;
+            }
+            pos = field_end;
         }
         return count_filled;
     }
 };
 
+// For bags opened from a bag_source, fills the reserved mapping
+// priv::memory views, segment by segment, as ranges are first needed.
+// Filled segments are kept, views and payloads point into them.
+struct source_fill
+{
+    std::unique_ptr<bag_source> source;
+    char* base = nullptr;
+    // segment starts, and the end
+    std::vector<uint64_t> offsets;
+    std::vector<std::atomic<uint8_t>> filled;
+    std::mutex lock;
+
+    bool fetch(common::array_view<const char> range)
+    {
+        if (!range.size())
+            return true;
+        const uint64_t begin = range.data() - base;
+        const uint64_t end = begin + range.size();
+        const size_t first = std::upper_bound(offsets.begin(), offsets.end(), begin) - offsets.begin() - 1;
+        const size_t last = std::lower_bound(offsets.begin(), offsets.end(), end) - offsets.begin();
+        size_t i = first;
+        while ((i < last) && filled[i].load(std::memory_order_acquire))
+            ++i;
+        if (i == last)
+            return true;
+
+        std::lock_guard<std::mutex> guard{lock};
+        while (i < last) {
+            if (filled[i].load(std::memory_order_relaxed)) {
+                ++i;
+                continue;
+            }
+            size_t run = i;
+            while ((run < last) && !filled[run].load(std::memory_order_relaxed))
+                ++run;
+            if (!source->fill(i, run - i, base + offsets[i])) {
+                fprintf(stderr, "bag_rdr: '%s': failed to read bytes %" PRIu64 "-%" PRIu64 "\n",
+                        source->name().c_str(), offsets[i], offsets[run]);
+                return false;
+            }
+            for (; i < run; ++i)
+                filled[i].store(1, std::memory_order_release);
+        }
+        return true;
+    }
+};
+
 struct chunk_info
 {
     common::timestamp start_timestamp, end_timestamp;
@@ -284,7 +372,15 @@ struct chunk
     std::vector<char> uncompressed_buffer;
     int32_t uncompressed_size = 0;
     chunk_info info;
+    // in bag_rdr::priv::arena
+    common::array_view<const int32_t> connection_ids;
     chunk_threading_noncopying decompression_lock;
+    // options::memory_budget, the decompressed chunk views read from
+    // while the budget lets it stay, instead of uncompressed_buffer
+    bag_memory_budget::buffer_ptr cached;
+    chunk_threading_noncopying cache_lock;
+    // set when the bag is read from a bag_source
+    source_fill* fill = nullptr;
 
     enum chunk_type {
         NORMAL,
@@ -293,6 +389,10 @@ struct chunk
     } type;
 
     constexpr bool requires_decompression() const noexcept { return type != NORMAL; }
+    // the stored data is readable, fetched from the bag_source if there is one
+    bool present() const { return !fill || fill->fetch(memory); }
+    // the stored data, empty if it can't be read
+    common::array_view<const char> stored() const { return present() ? memory : common::array_view<const char>{}; }
     void setup_multithreaded()
     {
         if (!requires_decompression())
@@ -300,10 +400,21 @@ struct chunk
         this->decompression_lock.reset_default();
     }
     bool decompress();
+    bool decompress_into(common::array_view<char> to) const;
+    // without touching the shared cache, buffer is used only if compressed
+    common::array_view<const char> uncompressed_into(std::vector<char>& buffer) const
+    {
+        if (!requires_decompression())
+            return stored();
+        buffer.resize(uncompressed_size);
+        if (!decompress_into(buffer))
+            return {};
+        return buffer;
+    }
     common::array_view<const char> get_uncompressed()
     {
         if (!requires_decompression())
-            return uncompressed;
+            return present() ? uncompressed : common::array_view<const char>{};
 
         common::optional<std::lock_guard<std::mutex>> guard;
         decompression_lock.with([&guard] (std::mutex& m) mutable {
@@ -330,6 +441,8 @@ struct index_block
 {
     common::array_view<const char> memory;
     chunk* into_chunk;
+    // index of the first record among all blocks of the connection
+    uint32_t first_record;
     size_t count() const { return memory.size() / sizeof(index_record); }
     common::array_view<const index_record> as_records() const
     {
@@ -363,13 +476,26 @@ struct connection_data
     }
 };
 
+// Connection metadata, only read when a message is handed out
 struct bag_rdr::connection_record
 {
-    std::vector<index_block> blocks;
     common::string_view      topic;
     connection_data          data;
 };
 
+// What iteration reads per connection, kept apart from the metadata
+struct connection_index
+{
+    // this connection's range of priv::index_blocks
+    common::array_view<const index_block> blocks;
+    uint32_t record_count = 0;
+
+    // header.stamp per record, empty unless indexed
+    common::array_view<const common::timestamp> header_stamps;
+    // bounds of record time - header.stamp
+    int64_t min_latency_ns = 0, max_latency_ns = 0;
+};
+
 chunk::chunk(record r)
 : outer_memory(r.real_range)
 , memory(r.memory_data)
@@ -452,23 +578,24 @@ static bool s_decompress_lz4(common::array_view<const char> memory, common::arra
 }
 #endif
 
-bool chunk::decompress()
+bool chunk::decompress_into(common::array_view<char> to) const
 {
     if (!assert_print((type == BZ2) || (type == LZ4)))
         return false;
 
-    if (type == NORMAL)
-        return true;
+    if (!assert_printv(to.size() == size_t(uncompressed_size), to.size()))
+        return false;
 
-    uncompressed_buffer.resize(uncompressed_size);
+    if (!present())
+        return false;
 
     switch (type) {
         case BZ2: {
 #ifndef DISABLE_BZ2
             const int bzapi_small = 0;
             const int bzapi_verbosity = 0;
-            unsigned int dest_len = uncompressed_buffer.size();
-            int bzip2_ret = BZ2_bzBuffToBuffDecompress(uncompressed_buffer.data(), &dest_len,
+            unsigned int dest_len = to.size();
+            int bzip2_ret = BZ2_bzBuffToBuffDecompress(to.data(), &dest_len,
                                                        (char*) memory.data(), memory.size(),
                                                        bzapi_small,
                                                        bzapi_verbosity);
@@ -484,11 +611,22 @@ bool chunk::decompress()
             break;
         }
         case LZ4: {
-            if (!s_decompress_lz4(memory, uncompressed_buffer))
+            if (!s_decompress_lz4(memory, to))
                 return false;
         }
         case NORMAL: break;
     }
+    return true;
+}
+
+bool chunk::decompress()
+{
+    if (type == NORMAL)
+        return true;
+
+    uncompressed_buffer.resize(uncompressed_size);
+    if (!decompress_into(uncompressed_buffer))
+        return false;
 
     uncompressed = uncompressed_buffer;
     return true;
@@ -511,6 +649,62 @@ struct mmap_handle_t
     }
 };
 
+// One allocation for a bag's index metadata, sized by counting the
+// records before loading them. Only holds trivially destructible
+// types, so releasing it is a single free.
+struct index_arena
+{
+    std::unique_ptr<char[]> memory;
+    size_t capacity = 0;
+    size_t used = 0;
+
+    template <typename T>
+    static size_t bytes_for(size_t count) { return count * sizeof(T) + alignof(T) - 1; }
+
+    void reserve(size_t bytes)
+    {
+        memory.reset(new char[bytes]);
+        capacity = bytes;
+        used = 0;
+    }
+
+    template <typename T>
+    common::array_view<T> allocate(size_t count)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "index_arena never runs destructors");
+        const size_t offset = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+        if (!assert_print(offset + count * sizeof(T) <= capacity))
+            return {};
+        T* items = reinterpret_cast<T*>(memory.get() + offset);
+        for (size_t i = 0; i < count; ++i)
+            new (items + i) T{};
+        used = offset + count * sizeof(T);
+        return common::array_view<T>{items, count};
+    }
+};
+
+// options::memory_budget hook, items are chunk indices
+struct chunk_budget_client : public bag_memory_budget::client
+{
+    std::vector<chunk>& chunks;
+
+    explicit chunk_budget_client(std::vector<chunk>& chunks) : chunks(chunks) {}
+    bag_memory_budget::buffer_ptr install(size_t key, bag_memory_budget::buffer_ptr item) override
+    {
+        chunk& ch = chunks[key];
+        std::lock_guard<std::mutex> guard{ch.cache_lock.get()};
+        if (!ch.cached)
+            ch.cached = std::move(item);
+        return ch.cached;
+    }
+    bag_memory_budget::buffer_ptr evict(size_t key) override
+    {
+        chunk& ch = chunks[key];
+        std::lock_guard<std::mutex> guard{ch.cache_lock.get()};
+        return std::move(ch.cached);
+    }
+};
+
 struct bag_rdr::priv
 {
     std::string filename;
@@ -520,11 +714,49 @@ struct bag_rdr::priv
     common::string_view version_string;
     common::array_view<const char> content;
 
-    std::vector<connection_record> connections;
+    // backing for connections, connection_indices, index_blocks
+    // and chunk::connection_ids
+    index_arena arena;
+    // both indexed by connection id
+    common::array_view<connection_record> connections;
+    common::array_view<connection_index> connection_indices;
+    // index blocks of every connection, contiguous per connection
+    common::array_view<index_block> index_blocks;
+    // reserved up front, index_block::into_chunk points into it
     std::vector<chunk> chunks;
     bag_rdr::options opts;
 
+    // backing for connection_index::header_stamps, by connection id
+    std::vector<std::vector<common::timestamp>> header_stamp_storage;
+    bag_sidecar header_stamp_sidecar;
+
+    // bag_rdr::chunk_hash cache, 0 until computed
+    std::vector<std::atomic<uint64_t>> chunk_hashes;
+
+    // bag_rdr::chunk_message_table cache, null until built, owned
+    std::vector<std::atomic<const std::vector<bag_rdr::chunk_table_entry>*>> chunk_tables;
+    std::atomic<size_t> chunk_table_bytes{0};
+
+    // expected checksums from open_chunk_checksums, and the
+    // verify_state of each chunk for options::verify_checksums
+    std::vector<bag_rdr::chunk_checksum> chunk_checksums;
+    enum verify_state : uint8_t { UNVERIFIED, VERIFIED, CORRUPT };
+    std::vector<std::atomic<uint8_t>> chunk_verified;
+
+    // set while attached to opts.memory_budget
+    std::unique_ptr<chunk_budget_client> budget_client;
+
+    // set when opened from a bag_source, memory is then a reserved
+    // mapping owned by mmap_handle and filled through it
+    std::unique_ptr<source_fill> fill;
+
     bool is_compressed = false;
+
+    ~priv()
+    {
+        for (const auto& table : chunk_tables)
+            delete table.load();
+    }
 };
 
 bag_rdr::bag_rdr()
@@ -536,10 +768,16 @@ bag_rdr::bag_rdr(bag_rdr::options opts)
 : d(new priv)
 {
     d->opts = std::move(opts);
+    if (d->opts.payload_alignment & (d->opts.payload_alignment - 1)) {
+        fprintf(stderr, "bag_rdr: payload_alignment %zu is not a power of two, ignored\n", d->opts.payload_alignment);
+        d->opts.payload_alignment = 0;
+    }
 }
 
 bag_rdr::~bag_rdr()
 {
+    if (d->budget_client)
+        d->opts.memory_budget->detach(*d->budget_client);
     delete d;
 }
 
@@ -593,10 +831,247 @@ result<ok, unix_err> bag_rdr::internal_map_file(const char* filename)
     return ok{};
 }
 
+result<ok, unix_err> bag_rdr::open_tar_member(const char* tar_filename, const char* member_name)
+{
+    result_try(internal_map_tar_member(tar_filename, member_name));
+    if (!internal_read_initial().size()) {
+        return unix_err{EFAULT};
+    }
+    if (!internal_load_records()) {
+        return unix_err{ESPIPE};
+    }
+    return ok{};
+}
+
+// a tar header number field, octal or GNU base-256
+static uint64_t s_tar_number(const char* field, size_t len)
+{
+    uint64_t ret = 0;
+    if (uint8_t(field[0]) & 0x80) {
+        ret = uint8_t(field[0]) & 0x7f;
+        for (size_t i = 1; i < len; ++i)
+            ret = (ret << 8) | uint8_t(field[i]);
+        return ret;
+    }
+    size_t i = 0;
+    while ((i < len) && ((field[i] == ' ') || (field[i] == '\0')))
+        ++i;
+    for (; (i < len) && (field[i] >= '0') && (field[i] <= '7'); ++i)
+        ret = (ret * 8) + (field[i] - '0');
+    return ret;
+}
+
+static common::string_view s_tar_field(const char* field, size_t len)
+{
+    return common::string_view{field, strnlen(field, len)};
+}
+
+static common::string_view s_tar_strip_dot(common::string_view name)
+{
+    while (name.begins_with("./"))
+        name = name.advance(2);
+    return name;
+}
+
+static const uint64_t s_tar_max_extension = 1 << 20;
+
+/**
+ * Walks the headers of a ustar, GNU or pax archive, reading only them,
+ * to the regular file member_name. Long names from GNU 'L' records and
+ * pax path and size keywords are followed.
+ */
+static result<ok, unix_err> s_find_tar_member(int fd, const char* tar_filename, common::string_view member_name,
+                                              uint64_t& offset, uint64_t& size)
+{
+    member_name = s_tar_strip_dot(member_name);
+    char header[512];
+    std::string long_name;
+    common::optional<uint64_t> pax_size;
+    std::vector<char> extension;
+    for (uint64_t pos = 0; ; ) {
+        const ssize_t got = ::pread(fd, header, sizeof(header), pos);
+        if (got < 0)
+            return unix_err::current();
+        if ((got != sizeof(header)) || std::all_of(header, header + sizeof(header), [] (char c) { return !c; }))
+            break;
+
+        unsigned checksum = 0;
+        for (size_t i = 0; i < sizeof(header); ++i)
+            checksum += ((i >= 148) && (i < 156)) ? ' ' : uint8_t(header[i]);
+        if (checksum != s_tar_number(header + 148, 8)) {
+            fprintf(stderr, "bag_rdr: '%s': bad tar header checksum at offset %" PRIu64 "\n", tar_filename, pos);
+            return unix_err{EINVAL};
+        }
+
+        const char type = header[156];
+        const bool is_extension = (type == 'L') || (type == 'x');
+        // a pax size is for the next member, extension headers have their own
+        const uint64_t member_size = (pax_size && !is_extension) ? pax_size.get() : s_tar_number(header + 124, 12);
+        const uint64_t data = pos + sizeof(header);
+        const uint64_t next = data + ((member_size + 511) & ~uint64_t(511));
+
+        if (is_extension) {
+            // names and pax records are short, the size is not trusted
+            if (member_size > s_tar_max_extension) {
+                fprintf(stderr, "bag_rdr: '%s': tar extension header of %" PRIu64 " bytes at offset %" PRIu64 "\n", tar_filename, member_size, pos);
+                return unix_err{EINVAL};
+            }
+            extension.resize(member_size);
+            if (::pread(fd, extension.data(), member_size, data) != ssize_t(member_size))
+                return unix_err{EINVAL};
+            if (type == 'L') {
+                long_name.assign(extension.data(), strnlen(extension.data(), extension.size()));
+            } else {
+                // records of "<length> <key>=<value>\n"
+                for (size_t at = 0; at < extension.size(); ) {
+                    // the data isn't terminated, so the length is parsed within it
+                    size_t length = 0, digits = 0;
+                    for (; (at + digits < extension.size()) && (digits < 18)
+                           && (extension[at + digits] >= '0') && (extension[at + digits] <= '9'); ++digits)
+                        length = length * 10 + size_t(extension[at + digits] - '0');
+                    if (!digits || (at + digits >= extension.size()) || (extension[at + digits] != ' ')
+                        || (length <= digits + 1) || (length > extension.size() - at))
+                        break;
+                    const common::string_view record{extension.data() + at, length - 1};
+                    const char* space = record.data() + digits;
+                    const char* eq = static_cast<const char*>(memchr(space, '=', record.end() - space));
+                    if (eq) {
+                        const common::string_view key{space + 1, eq};
+                        const common::string_view value{eq + 1, record.end()};
+                        if (key == "path")
+                            long_name = value.to_string();
+                        else if (key == "size")
+                            pax_size = uint64_t(strtoull(value.to_string().c_str(), nullptr, 10));
+                    }
+                    at += length;
+                }
+            }
+            pos = next;
+            continue;
+        }
+
+        std::string name = long_name;
+        if (name.empty()) {
+            const common::string_view prefix = s_tar_field(header + 345, 155);
+            if ((s_tar_field(header + 257, 6) == "ustar") && prefix.size())
+                name = prefix.to_string() + "/";
+            name += s_tar_field(header, 100).to_string();
+        }
+        if (((type == '0') || (type == '\0') || (type == '7')) && (s_tar_strip_dot(name) == member_name)) {
+            offset = data;
+            size = member_size;
+            return ok{};
+        }
+        long_name.clear();
+        pax_size.reset();
+        pos = next;
+    }
+    fprintf(stderr, "bag_rdr: '%s' has no member '%.*s'\n", tar_filename, member_name.sizei(), member_name.data());
+    return unix_err{ENOENT};
+}
+
+result<ok, unix_err> bag_rdr::internal_map_tar_member(const char* tar_filename, const char* member_name)
+{
+    result_try(d->file_handle.open(tar_filename));
+    const int fd = ::fileno(d->file_handle.file);
+
+    uint64_t offset, size;
+    result_try(s_find_tar_member(fd, tar_filename, member_name, offset, size));
+    if (!size)
+        return unix_err{ERANGE};
+    // a truncated archive would map past the end of the file
+    const uint64_t file_size = d->file_handle.size();
+    if ((offset > file_size) || (size > file_size - offset)) {
+        fprintf(stderr, "bag_rdr: member '%s' of '%s' extends past the end of the archive\n", member_name, tar_filename);
+        return unix_err{EINVAL};
+    }
+
+    // tar members are 512 byte aligned, mappings need page alignment
+    const uint64_t page = uint64_t(::sysconf(_SC_PAGESIZE));
+    const uint64_t map_offset = offset & ~(page - 1);
+    const size_t map_size = size_t(offset - map_offset + size);
+    void* ptr = ::mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, off_t(map_offset));
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "bag_rdr: mmap of member '%s' of '%s' failed (%m)\n", member_name, tar_filename);
+        return unix_err::current();
+    }
+    d->memory = common::array_view<const char>{reinterpret_cast<const char*>(ptr) + (offset - map_offset), size_t(size)};
+    d->mmap_handle = mmap_handle_t{common::array_view<char>{(char*)ptr, map_size}};
+    d->filename = std::string{tar_filename} + ":" + member_name;
+
+    return ok{};
+}
+
+result<ok, unix_err> bag_rdr::open_source(std::unique_ptr<bag_source> source)
+{
+    result_try(internal_map_source(std::move(source)));
+    if (!internal_read_initial().size()) {
+        return unix_err{EFAULT};
+    }
+    if (!internal_load_records()) {
+        return unix_err{ESPIPE};
+    }
+    return ok{};
+}
+
+result<ok, unix_err> bag_rdr::open_compressed(const char* filename)
+{
+    common::file_handle file;
+    result_try(file.open(filename));
+    unsigned char magic[6] = {};
+    const ssize_t got = ::pread(::fileno(file.file), magic, sizeof(magic), 0);
+    if (got < 0)
+        return unix_err::current();
+
+    std::unique_ptr<bag_source> source;
+    // a zstd frame, or a skippable frame in front of one
+    if ((got >= 4) && (((magic[0] == 0x28) && (magic[1] == 0xb5) && (magic[2] == 0x2f) && (magic[3] == 0xfd))
+                    || (((magic[0] & 0xf0) == 0x50) && (magic[1] == 0x2a) && (magic[2] == 0x4d) && (magic[3] == 0x18)))) {
+        result_try(bag_source::open_zstd(filename, source));
+    } else if ((got == 6) && !memcmp(magic, "\xfd" "7zXZ\0", 6)) {
+        result_try(bag_source::open_xz(filename, source));
+    } else {
+        fprintf(stderr, "bag_rdr: '%s' is neither zstd nor xz compressed\n", filename);
+        return unix_err{EINVAL};
+    }
+    return open_source(std::move(source));
+}
+
+result<ok, unix_err> bag_rdr::internal_map_source(std::unique_ptr<bag_source> source)
+{
+    const uint64_t size = source->size();
+    const size_t segments = source->segment_count();
+    if (!size || !segments)
+        return unix_err{ERANGE};
+
+    // address space for the whole bag, pages are only backed once filled
+    void* ptr = ::mmap(nullptr, size_t(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "bag_rdr: mmap of %" PRIu64 " bytes for '%s' failed (%m)\n", size, source->name().c_str());
+        return unix_err::current();
+    }
+    d->mmap_handle = mmap_handle_t{common::array_view<char>{(char*)ptr, size_t(size)}};
+    d->memory = common::array_view<const char>{reinterpret_cast<const char*>(ptr), size_t(size)};
+    d->filename = source->name();
+
+    d->fill.reset(new source_fill);
+    d->fill->base = static_cast<char*>(ptr);
+    d->fill->offsets.resize(segments + 1);
+    for (size_t i = 0; i < segments; ++i)
+        d->fill->offsets[i] = source->segment_offset(i);
+    d->fill->offsets[segments] = size;
+    d->fill->filled = std::vector<std::atomic<uint8_t>>(segments);
+    d->fill->source = std::move(source);
+
+    return ok{};
+}
+
 common::string_view bag_rdr::internal_read_initial()
 {
     if (!assert_print(d->memory.size()))
         return {};
+    if (d->fill && !d->fill->fetch(d->memory.head(std::min<size_t>(d->memory.size(), 4096))))
+        return {};
 
     common::string_view str {d->memory};
 
@@ -618,8 +1093,105 @@ common::string_view bag_rdr::internal_read_initial()
 }
 
 
+// index metadata held on the heap, for options::memory_budget
+static void s_charge_index_bytes(bag_rdr::priv& d)
+{
+    if (!d.budget_client)
+        return;
+    size_t bytes = d.arena.capacity + d.chunk_table_bytes.load();
+    for (const std::vector<common::timestamp>& stamps : d.header_stamp_storage)
+        bytes += stamps.size() * sizeof(common::timestamp);
+    d.opts.memory_budget->set_index_bytes(*d.budget_client, bytes);
+}
+
+// Sizes for priv::arena, from a pass over the record headers
+// following the same null record and index_pos rules as the load
+struct record_counts
+{
+    size_t chunk_count = 0;
+    size_t index_data_count = 0;
+    // index data records per connection id
+    std::vector<uint32_t> connection_blocks;
+};
+
+// with a bag_source, fetch what record{remaining} reads: both lengths and the header
+static bool s_fetch_record_header(source_fill* fill, common::array_view<const char> remaining)
+{
+    if (!fill)
+        return true;
+    if (!fill->fetch(remaining.head(std::min(remaining.size(), sizeof(uint32_t)))))
+        return false;
+    uint32_t header_len = 0;
+    if (!extract_type<uint32_t>(remaining, header_len))
+        return true;
+    return fill->fetch(remaining.head(std::min<uint64_t>(remaining.size(), uint64_t(header_len) + 2 * sizeof(uint32_t))));
+}
+
+static record_counts s_count_records(common::array_view<const char> memory, common::array_view<const char> content, source_fill* fill)
+{
+    record_counts counts;
+    common::array_view<const char> remaining = content;
+    int64_t index_pos = 0;
+    while (remaining.size()) {
+        if (!s_fetch_record_header(fill, remaining))
+            break;
+        record r{remaining};
+        if (r.is_null_record()) {
+            if (remaining.data() - memory.begin() >= index_pos)
+                break;
+            remaining = {memory.data() + index_pos, memory.end()};
+            continue;
+        }
+        remaining = remaining.advance(r.real_range.size());
+        common::optional<int8_t> op_hdr;
+        common::optional<int32_t> conn_count, conn;
+        common::optional<int64_t> c_index_pos;
+        headers{r.memory_header}.extract_headers("op", op_hdr, "conn_count", conn_count, "index_pos", c_index_pos, "conn", conn);
+        if (!op_hdr)
+            break;
+        switch (header::op(op_hdr.get())) {
+          case header::op::BAG_HEADER:
+            if (conn_count && (conn_count.get() > 0))
+                counts.connection_blocks.assign(conn_count.get(), 0);
+            if (c_index_pos)
+                index_pos = c_index_pos.get();
+            break;
+          case header::op::CHUNK:
+            ++counts.chunk_count;
+            break;
+          case header::op::INDEX_DATA:
+            if (conn && (conn.get() >= 0) && (size_t(conn.get()) < counts.connection_blocks.size())) {
+                ++counts.connection_blocks[conn.get()];
+                ++counts.index_data_count;
+            }
+            break;
+          default:
+            break;
+        }
+    }
+    return counts;
+}
+
 bool bag_rdr::internal_load_records()
 {
+    const record_counts counts = s_count_records(d->memory, d->content, d->fill.get());
+    const size_t conn_count = counts.connection_blocks.size();
+    d->arena.reserve(index_arena::bytes_for<connection_record>(conn_count)
+                   + index_arena::bytes_for<connection_index>(conn_count)
+                   + index_arena::bytes_for<index_block>(counts.index_data_count)
+                   + index_arena::bytes_for<int32_t>(counts.index_data_count));
+    d->connections = d->arena.allocate<connection_record>(conn_count);
+    d->connection_indices = d->arena.allocate<connection_index>(conn_count);
+    d->index_blocks = d->arena.allocate<index_block>(counts.index_data_count);
+    const common::array_view<int32_t> chunk_connection_ids = d->arena.allocate<int32_t>(counts.index_data_count);
+    d->chunks.reserve(counts.chunk_count);
+
+    // each connection's blocks start at the sum of the counts before it
+    std::vector<size_t> blocks_begin(conn_count, 0), blocks_filled(conn_count, 0);
+    for (size_t conn_id = 1; conn_id < conn_count; ++conn_id)
+        blocks_begin[conn_id] = blocks_begin[conn_id - 1] + counts.connection_blocks[conn_id - 1];
+    size_t chunk_connection_ids_used = 0, chunk_connection_ids_first = 0;
+
     common::array_view<const char> remaining = d->content;
 
     bool had_chunk = false;
@@ -627,6 +1199,8 @@ bool bag_rdr::internal_load_records()
     using lld_t = long long;
     int64_t index_pos = 0;
     while (remaining.size()) {
+        if (!s_fetch_record_header(d->fill.get(), remaining))
+            return false;
         record r{remaining};
         if (r.is_null_record()) {
             const int64_t pos = remaining.data() - d->memory.begin();
@@ -646,6 +1220,9 @@ bool bag_rdr::internal_load_records()
         if (!assert_print(bool(op_hdr)))
             return false;
         header::op op = header::op(op_hdr.get());
+        // chunk data is fetched when the chunk is read
+        if (d->fill && (op != header::op::CHUNK) && !d->fill->fetch(r.memory_data))
+            return false;
 
         switch (op) {
           case header::op::BAG_HEADER: {
@@ -659,17 +1236,22 @@ bool bag_rdr::internal_load_records()
                 return true;
             if (!assert_print((conn_count.get() > 0) && (chunk_count.get() > 0) && (c_index_pos.get() > 64)))
                 return false;
-            d->connections.resize(conn_count.get());
-            d->chunks.reserve(chunk_count.get());
+            if (!assert_print(size_t(conn_count.get()) == d->connections.size()))
+                return false;
             index_pos = *c_index_pos;
             break;
           }
           case header::op::CHUNK: {
+            // index_block::into_chunk must stay valid
+            if (!assert_print(d->chunks.size() < d->chunks.capacity()))
+                return false;
             had_chunk = true;
-            const auto& chunk = d->chunks.emplace_back(r);
+            auto& chunk = d->chunks.emplace_back(r);
+            chunk.fill = d->fill.get();
             if (chunk.requires_decompression()) {
                 d->is_compressed = true;
             }
+            chunk_connection_ids_first = chunk_connection_ids_used;
             break;
           }
           case header::op::INDEX_DATA: {
@@ -683,7 +1265,15 @@ bool bag_rdr::internal_load_records()
             const int32_t conn_id = conn.get();
             if (!assert_print((conn_id >= 0) && (size_t(conn_id) < d->connections.size())))
                 continue;
-            d->connections[conn.get()].blocks.emplace_back(index_block{.memory=r.memory_data, .into_chunk=&d->chunks.back()});
+            if (!assert_print(blocks_filled[conn_id] < counts.connection_blocks[conn_id]))
+                continue;
+            connection_index& conn_index = d->connection_indices[conn_id];
+            index_block& block = d->index_blocks[blocks_begin[conn_id] + blocks_filled[conn_id]++];
+            block = index_block{.memory=r.memory_data, .into_chunk=&d->chunks.back(), .first_record=conn_index.record_count};
+            conn_index.record_count += block.count();
+            chunk_connection_ids[chunk_connection_ids_used++] = conn_id;
+            d->chunks.back().connection_ids = common::array_view<const int32_t>{chunk_connection_ids.data() + chunk_connection_ids_first,
+                                                                                chunk_connection_ids_used - chunk_connection_ids_first};
             break;
           }
           case header::op::CONNECTION: {
@@ -713,10 +1303,11 @@ bool bag_rdr::internal_load_records()
             hdrs.extract_headers("ver", ver, "chunk_pos", chunk_pos, "count", count, "start_time", start_time, "end_time", end_time);
             if (!assert_print(ver && chunk_pos && count && start_time && end_time))
                 continue;
-            auto chunk_it = std::find_if(d->chunks.begin(), d->chunks.end(), [this, &chunk_pos] (const chunk& c) {
-                return (c.outer_memory.data() - d->memory.data()) == chunk_pos.get();
+            // chunks are in file order
+            auto chunk_it = std::lower_bound(d->chunks.begin(), d->chunks.end(), chunk_pos.get(), [this] (const chunk& c, int64_t pos) {
+                return (c.outer_memory.data() - d->memory.data()) < pos;
             });
-            if (!assert_print(chunk_it != d->chunks.end()))
+            if (!assert_print((chunk_it != d->chunks.end()) && ((chunk_it->outer_memory.data() - d->memory.data()) == chunk_pos.get())))
                 continue;
             assert_print(chunk_it->info.message_count == 0);
             chunk_it->info = chunk_info{start_time.get(), end_time.get(), count.get()};
@@ -733,6 +1324,19 @@ bool bag_rdr::internal_load_records()
             ch.setup_multithreaded();
         }
     }
+    for (size_t conn_id = 0; conn_id < conn_count; ++conn_id)
+        d->connection_indices[conn_id].blocks = common::array_view<const index_block>{d->index_blocks.data() + blocks_begin[conn_id], blocks_filled[conn_id]};
+    d->chunk_hashes = std::vector<std::atomic<uint64_t>>(d->chunks.size());
+    d->chunk_tables = std::vector<std::atomic<const std::vector<chunk_table_entry>*>>(d->chunks.size());
+    d->chunk_verified = std::vector<std::atomic<uint8_t>>(d->chunks.size());
+
+    if (d->opts.memory_budget && !d->budget_client) {
+        for (chunk& ch : d->chunks)
+            ch.cache_lock.reset_default();
+        d->budget_client.reset(new chunk_budget_client{d->chunks});
+        d->opts.memory_budget->attach(*d->budget_client, d->filename);
+        s_charge_index_bytes(*d);
+    }
     return true;
 }
 
@@ -753,15 +1357,14 @@ common::timestamp bag_rdr::end_timestamp() const
 size_t bag_rdr::size() const
 {
     size_t ret = 0;
-    for (const connection_record& c: d->connections)
-        for (const index_block& block: c.blocks)
-            ret += block.count();
+    for (const connection_index& c: d->connection_indices)
+        ret += c.record_count;
     return ret;
 }
 
 size_t bag_rdr::file_size() const
 {
-    return d->file_handle.size();
+    return d->memory.size();
 }
 
 bool bag_rdr::is_compressed() const
@@ -769,83 +1372,744 @@ bool bag_rdr::is_compressed() const
     return d->is_compressed;
 }
 
-bag_rdr::view::view(const bag_rdr& rdr)
-: rdr(rdr)
+const std::string& bag_rdr::filename() const
 {
+    return d->filename;
 }
 
-void bag_rdr::view::ensure_indices()
+size_t bag_rdr::chunk_count() const
 {
-    if (m_connections)
-        return;
-    m_connections.reset_default();
-    m_connections->reserve(rdr.d->connections.size());
-    for (auto& conn : rdr.d->connections)
-        m_connections->push_back(&conn);
+    return d->chunks.size();
 }
 
-bag_rdr::view bag_rdr::get_view() const
+size_t bag_rdr::connection_count() const
 {
-    return view{*this};
+    return d->connections.size();
 }
 
-static void add_connection_ptr(std::vector<bag_rdr::connection_record*>& connection_ptrs, std::vector<bag_rdr::connection_record>& connections, common::string_view topic)
+bag_rdr::chunk_summary bag_rdr::get_chunk_summary(size_t chunk_index) const
 {
-    for (bag_rdr::connection_record& conn : connections) {
-        if (conn.data.topic.size() && (conn.topic != conn.data.topic)) {
-            fprintf(stderr, "bag_rdr: Inner topic [%zu]'%.*s' doesn't match outer '%.*s', not yet handled.\n",
-                conn.data.topic.size(), conn.data.topic.sizei(), conn.data.topic.data(),
-                conn.topic.sizei(), conn.topic.data());
-        }
-        if (conn.topic == topic) {
-            auto it = std::find(connection_ptrs.begin(), connection_ptrs.end(), &conn);
-            if (it != connection_ptrs.end())
-                break;
-            connection_ptrs.emplace_back(&conn);
+    if (!assert_print(chunk_index < d->chunks.size()))
+        return chunk_summary{};
+    const chunk& ch = d->chunks[chunk_index];
+    return chunk_summary{
+        .start_timestamp = ch.info.start_timestamp,
+        .end_timestamp = ch.info.end_timestamp,
+        .message_count = ch.info.message_count,
+        .offset = size_t(ch.outer_memory.data() - d->memory.data()),
+        .compressed_size = ch.memory.size(),
+        .uncompressed_size = ch.requires_decompression() ? size_t(ch.uncompressed_size) : ch.memory.size(),
+        .compressed = ch.requires_decompression(),
+        .connection_ids = ch.connection_ids,
+        .data = ch.stored(),
+    };
+}
+
+void bag_rdr::for_each_chunk_index_entry(size_t chunk_index,
+                                         const std::function<void (int32_t connection_id, timestamp stamp, uint32_t offset)>& fn) const
+{
+    if (!assert_print(chunk_index < d->chunks.size()))
+        return;
+    const chunk* const ch = &d->chunks[chunk_index];
+    for (const int32_t conn_id : ch->connection_ids) {
+        const connection_index& conn = d->connection_indices[conn_id];
+        for (const index_block& block : conn.blocks) {
+            if (block.into_chunk != ch)
+                continue;
+            for (const index_record& record : block.as_records())
+                fn(conn_id, record.to_stamp(), uint32_t(record.offset));
         }
     }
 }
 
-void bag_rdr::view::set_topics(common::array_view<const std::string> topics)
+bag_rdr::connection_info bag_rdr::get_connection_info(int32_t connection_id) const
 {
-    m_connections.reset_default();
-    m_connections->reserve(topics.size());
-    for (const std::string& topic : topics)
-        add_connection_ptr(*m_connections, rdr.d->connections, topic);
+    if (!assert_print((connection_id >= 0) && (size_t(connection_id) < d->connections.size())))
+        return connection_info{};
+    const connection_record& conn = d->connections[connection_id];
+    return connection_info {
+        .topic = conn.topic,
+        .datatype = conn.data.type,
+        .md5sum = conn.data.md5sum,
+        .msg_def = conn.data.message_definition,
+        .callerid = conn.data.callerid,
+        .latching = conn.data.latching,
+    };
 }
 
-void bag_rdr::view::set_topics(array_view<const char*> topics)
+// parse the record at the start of remaining, false if it is not a valid record
+static bool s_chunk_message_at(const bag_rdr::priv& d, size_t chunk_index, common::array_view<const char> chunk_memory,
+                               common::array_view<const char> remaining, size_t& record_size,
+                               common::optional<bag_rdr::chunk_message>& out)
 {
-    m_connections.reset_default();
-    m_connections->reserve(topics.size());
-    for (const char* topic : topics)
-        add_connection_ptr(*m_connections, rdr.d->connections, topic);
+    record r{remaining};
+    if (r.is_null_record()) {
+        fprintf(stderr, "bag_rdr: chunk %zu: null record at offset %zu\n", chunk_index, size_t(remaining.data() - chunk_memory.data()));
+        return false;
+    }
+    record_size = r.real_range.size();
+    common::optional<int8_t> op_hdr;
+    common::optional<int32_t> conn;
+    common::optional<common::timestamp> time;
+    headers{r.memory_header}.extract_headers("op", op_hdr, "conn", conn, "time", time);
+    if (op_hdr && (header::op(op_hdr.get()) == header::op::MESSAGE_DATA) && conn && time) {
+        const int32_t conn_id = conn.get();
+        if (assert_print((conn_id >= 0) && (size_t(conn_id) < d.connections.size()))) {
+            out = bag_rdr::chunk_message{
+                .stamp = time.get(),
+                .connection_id = conn_id,
+                .offset = uint32_t(remaining.data() - chunk_memory.data()),
+                .data = r.memory_data,
+                .connection = &d.connections[conn_id],
+            };
+        }
+    }
+    return true;
 }
 
-void bag_rdr::view::set_topics(std::initializer_list<const char*> topics)
+// bag_rdr::chunk_message_table, built by whichever thread gets there first
+static const std::vector<bag_rdr::chunk_table_entry>* s_chunk_table(bag_rdr::priv& d, size_t chunk_index, common::array_view<const char> chunk_memory)
 {
-    m_connections.reset_default();
-    m_connections->reserve(topics.size());
-    for (const char* topic : topics)
-        add_connection_ptr(*m_connections, rdr.d->connections, topic);
+    std::atomic<const std::vector<bag_rdr::chunk_table_entry>*>& slot = d.chunk_tables[chunk_index];
+    if (const auto* table = slot.load(std::memory_order_acquire))
+        return table;
+
+    std::unique_ptr<std::vector<bag_rdr::chunk_table_entry>> built{new std::vector<bag_rdr::chunk_table_entry>};
+    built->reserve(std::max(d.chunks[chunk_index].info.message_count, 0));
+    common::array_view<const char> remaining = chunk_memory;
+    while (remaining.size()) {
+        size_t record_size;
+        common::optional<bag_rdr::chunk_message> msg;
+        if (!s_chunk_message_at(d, chunk_index, chunk_memory, remaining, record_size, msg))
+            return nullptr;
+        if (msg) {
+            built->push_back(bag_rdr::chunk_table_entry{
+                .connection_id = msg->connection_id,
+                .offset = msg->offset,
+                .data_offset = uint32_t(msg->data.data() - chunk_memory.data()),
+                .data_size = uint32_t(msg->data.size()),
+                .stamp = msg->stamp,
+            });
+        }
+        remaining = remaining.advance(record_size);
+    }
+
+    const std::vector<bag_rdr::chunk_table_entry>* expected = nullptr;
+    if (!slot.compare_exchange_strong(expected, built.get(), std::memory_order_acq_rel))
+        return expected;
+    d.chunk_table_bytes += built->capacity() * sizeof(bag_rdr::chunk_table_entry);
+    s_charge_index_bytes(d);
+    return built.release();
 }
 
-void bag_rdr::view::set_topics(array_view<common::string_view> topics)
+common::array_view<const bag_rdr::chunk_table_entry> bag_rdr::chunk_message_table(size_t chunk_index, std::vector<char>& buffer) const
 {
-    m_connections.reset_default();
-    m_connections->reserve(topics.size());
-    for (const common::string_view& topic : topics)
-        add_connection_ptr(*m_connections, rdr.d->connections, topic);
+    if (!assert_print(chunk_index < d->chunks.size()))
+        return {};
+    if (const auto* table = d->chunk_tables[chunk_index].load(std::memory_order_acquire))
+        return *table;
+    const common::array_view<const char> chunk_memory = d->chunks[chunk_index].uncompressed_into(buffer);
+    if (!chunk_memory.size())
+        return {};
+    const auto* table = s_chunk_table(*d, chunk_index, chunk_memory);
+    if (!table)
+        return {};
+    return *table;
 }
 
-std::vector<common::string_view> bag_rdr::view::present_topics()
+bool bag_rdr::for_each_chunk_message(size_t chunk_index, std::vector<char>& buffer,
+                                     const std::function<void (const chunk_message& msg)>& fn) const
 {
-    ensure_indices();
-    std::vector<common::string_view> ret;
+    if (!assert_print(chunk_index < d->chunks.size()))
+        return false;
+    const common::array_view<const char> chunk_memory = d->chunks[chunk_index].uncompressed_into(buffer);
+    if (!chunk_memory.size())
+        return false;
 
-    for (const auto& conn : *m_connections) {
-        common::string_view topic = conn->data.topic;
-        auto it = std::find(ret.begin(), ret.end(), topic);
+    if (const auto* table = d->chunk_tables[chunk_index].load(std::memory_order_acquire)) {
+        for (const chunk_table_entry& e : *table) {
+            fn(chunk_message{
+                .stamp = e.stamp,
+                .connection_id = e.connection_id,
+                .offset = e.offset,
+                .data = common::array_view<const char>{chunk_memory.data() + e.data_offset, e.data_size},
+                .connection = &d->connections[e.connection_id],
+            });
+        }
+        return true;
+    }
+
+    common::array_view<const char> remaining = chunk_memory;
+    while (remaining.size()) {
+        size_t record_size;
+        common::optional<chunk_message> msg;
+        if (!s_chunk_message_at(*d, chunk_index, chunk_memory, remaining, record_size, msg))
+            return false;
+        if (msg)
+            fn(msg.get());
+        remaining = remaining.advance(record_size);
+    }
+    return true;
+}
+
+common::array_view<const char> bag_rdr::uncompressed_chunk(size_t chunk_index, std::vector<char>& buffer) const
+{
+    if (!assert_print(chunk_index < d->chunks.size()))
+        return {};
+    return d->chunks[chunk_index].uncompressed_into(buffer);
+}
+
+bool bag_rdr::for_each_chunk_message_at(size_t chunk_index, array_view<const uint32_t> offsets, std::vector<char>& buffer,
+                                        const std::function<void (const chunk_message& msg)>& fn) const
+{
+    const common::array_view<const char> chunk_memory = uncompressed_chunk(chunk_index, buffer);
+    if (!chunk_memory.size())
+        return false;
+    return for_each_chunk_message_at(chunk_index, offsets, chunk_memory, fn);
+}
+
+bool bag_rdr::for_each_chunk_message_at(size_t chunk_index, array_view<const uint32_t> offsets, array_view<const char> chunk_memory,
+                                        const std::function<void (const chunk_message& msg)>& fn) const
+{
+    if (!assert_print(chunk_index < d->chunks.size()))
+        return false;
+    for (const uint32_t offset : offsets) {
+        if (offset >= chunk_memory.size()) {
+            fprintf(stderr, "bag_rdr: chunk %zu: message offset %u out of range\n", chunk_index, offset);
+            return false;
+        }
+        size_t record_size;
+        common::optional<chunk_message> msg;
+        if (!s_chunk_message_at(*d, chunk_index, chunk_memory, chunk_memory.advance(offset), record_size, msg))
+            return false;
+        if (!msg) {
+            fprintf(stderr, "bag_rdr: chunk %zu: no message at offset %u\n", chunk_index, offset);
+            return false;
+        }
+        fn(msg.get());
+    }
+    return true;
+}
+
+static_assert(sizeof(bag_rdr::message_handle) == 16, "message_handle is meant to be 16 bytes");
+static_assert(std::is_trivially_copyable<bag_rdr::message_handle>::value, "message_handle is meant to be trivially copyable");
+
+bool bag_rdr::locate(message_handle handle, size_t& chunk_index, uint32_t& offset) const
+{
+    if ((handle.connection_id < 0) || (size_t(handle.connection_id) >= d->connection_indices.size()))
+        return false;
+    const connection_index& conn = d->connection_indices[handle.connection_id];
+    if (handle.record >= conn.record_count)
+        return false;
+    // the last block starting at or before the record
+    auto block_it = std::upper_bound(conn.blocks.begin(), conn.blocks.end(), handle.record, [] (uint32_t record, const index_block& block) {
+        return record < block.first_record;
+    });
+    const index_block& block = *(block_it - 1);
+    chunk_index = block.into_chunk - d->chunks.data();
+    offset = uint32_t(block.as_records()[handle.record - block.first_record].offset);
+    return true;
+}
+
+bool bag_rdr::resolve(array_view<const message_handle> handles, std::vector<char>& buffer,
+                      const std::function<void (size_t handle_index, const chunk_message& msg)>& fn) const
+{
+    struct located
+    {
+        size_t chunk_index;
+        uint32_t offset;
+        size_t handle_index;
+    };
+    std::vector<located> order(handles.size());
+    for (size_t i = 0; i < handles.size(); ++i) {
+        order[i].handle_index = i;
+        if (!locate(handles[i], order[i].chunk_index, order[i].offset)) {
+            fprintf(stderr, "bag_rdr: message handle %zu is not from '%s'\n", i, d->filename.c_str());
+            return false;
+        }
+    }
+    std::sort(order.begin(), order.end(), [] (const located& a, const located& b) {
+        return (a.chunk_index != b.chunk_index) ? (a.chunk_index < b.chunk_index) : (a.offset < b.offset);
+    });
+
+    std::vector<uint32_t> offsets;
+    for (size_t begin = 0; begin < order.size(); ) {
+        size_t end = begin;
+        offsets.clear();
+        for (; (end < order.size()) && (order[end].chunk_index == order[begin].chunk_index); ++end)
+            offsets.push_back(order[end].offset);
+        size_t next = begin;
+        if (!for_each_chunk_message_at(order[begin].chunk_index, offsets, buffer, [&] (const chunk_message& msg) {
+            fn(order[next++].handle_index, msg);
+        }))
+            return false;
+        begin = end;
+    }
+    return true;
+}
+
+void bag_rdr::parallel_for_chunks(unsigned threads, const std::function<void (size_t chunk_index)>& fn) const
+{
+    const size_t count = d->chunks.size();
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, count);
+
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t i; (i = next.fetch_add(1)) < count; )
+            fn(i);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for (std::thread& t : pool)
+        t.join();
+}
+
+static void s_update_latency_bounds(connection_index& conn)
+{
+    conn.min_latency_ns = conn.max_latency_ns = 0;
+    bool first = true;
+    for (const index_block& block : conn.blocks) {
+        const auto records = block.as_records();
+        for (size_t i = 0; i < records.size(); ++i) {
+            const int64_t latency = bag_rdr::stamp_to_ns(records[i].to_stamp()) - bag_rdr::stamp_to_ns(conn.header_stamps[block.first_record + i]);
+            conn.min_latency_ns = first ? latency : std::min(conn.min_latency_ns, latency);
+            conn.max_latency_ns = first ? latency : std::max(conn.max_latency_ns, latency);
+            first = false;
+        }
+    }
+}
+
+bool bag_rdr::build_header_stamp_index(unsigned threads)
+{
+    d->header_stamp_sidecar.close();
+    d->header_stamp_storage.assign(d->connections.size(), {});
+
+    // (connection, block) pairs per chunk
+    std::vector<std::vector<std::pair<int32_t, int32_t>>> chunk_blocks(d->chunks.size());
+    for (size_t conn_id = 0; conn_id < d->connections.size(); ++conn_id) {
+        const connection_record& meta = d->connections[conn_id];
+        connection_index& conn = d->connection_indices[conn_id];
+        conn.header_stamps = {};
+        bag_msg_schema schema;
+        if (!meta.data.md5sum.size() || !schema.parse(meta.data.type, meta.data.message_definition) || !schema.root().has_header)
+            continue;
+        d->header_stamp_storage[conn_id].resize(conn.record_count);
+        for (size_t b = 0; b < conn.blocks.size(); ++b)
+            chunk_blocks[conn.blocks[b].into_chunk - d->chunks.data()].emplace_back(int32_t(conn_id), int32_t(b));
+    }
+
+    std::atomic<bool> failed{false};
+    parallel_for_chunks(threads, [&] (size_t chunk_index) {
+        if (chunk_blocks[chunk_index].empty())
+            return;
+        std::vector<char> buffer;
+        const common::array_view<const char> chunk_memory = d->chunks[chunk_index].uncompressed_into(buffer);
+        if (!chunk_memory.size()) {
+            failed = true;
+            return;
+        }
+        for (const auto& conn_block : chunk_blocks[chunk_index]) {
+            const connection_index& conn = d->connection_indices[conn_block.first];
+            const index_block& block = conn.blocks[conn_block.second];
+            common::timestamp* out = d->header_stamp_storage[conn_block.first].data() + block.first_record;
+            for (const index_record& rec : block.as_records()) {
+                record r{chunk_memory.advance(rec.offset)};
+                uint32_t stamp[2];
+                // uint32 seq, then time stamp
+                if (r.memory_data.size() >= sizeof(uint32_t) + sizeof(stamp)) {
+                    std::memcpy(stamp, r.memory_data.data() + sizeof(uint32_t), sizeof(stamp));
+                    *out++ = common::timestamp{stamp[0], stamp[1]};
+                } else {
+                    *out++ = rec.to_stamp();
+                }
+            }
+        }
+    });
+    if (failed) {
+        d->header_stamp_storage.clear();
+        s_charge_index_bytes(*d);
+        return false;
+    }
+    s_charge_index_bytes(*d);
+
+    bool any = false;
+    for (size_t conn_id = 0; conn_id < d->connections.size(); ++conn_id) {
+        connection_index& conn = d->connection_indices[conn_id];
+        if (!d->header_stamp_storage[conn_id].size())
+            continue;
+        conn.header_stamps = d->header_stamp_storage[conn_id];
+        s_update_latency_bounds(conn);
+        any = true;
+    }
+    return any;
+}
+
+bool bag_rdr::has_header_stamp_index() const
+{
+    return std::any_of(d->connection_indices.begin(), d->connection_indices.end(), [] (const connection_index& conn) {
+        return conn.header_stamps.size() != 0;
+    });
+}
+
+result<ok, unix_err> bag_rdr::write_header_stamp_index() const
+{
+    return write_header_stamp_index(bag_sidecar_path(*this, header_stamp_sidecar_suffix()));
+}
+
+result<ok, unix_err> bag_rdr::write_header_stamp_index(const std::string& path) const
+{
+    bag_sidecar_buffer buf;
+    buf.append(uint32_t(d->connection_indices.size()));
+    for (const connection_index& conn : d->connection_indices) {
+        buf.append(conn.min_latency_ns);
+        buf.append(conn.max_latency_ns);
+        buf.append(uint64_t(conn.header_stamps.size()));
+        buf.append_array(conn.header_stamps.data(), conn.header_stamps.size());
+    }
+    bag_sidecar_writer writer;
+    writer.add_section("header_stamps", std::move(buf.bytes));
+    return writer.write(path, bag_sidecar_identity::of(*this));
+}
+
+result<ok, unix_err> bag_rdr::open_header_stamp_index()
+{
+    return open_header_stamp_index(bag_sidecar_path(*this, header_stamp_sidecar_suffix()));
+}
+
+result<ok, unix_err> bag_rdr::open_header_stamp_index(const std::string& path)
+{
+    for (connection_index& conn : d->connection_indices)
+        conn.header_stamps = {};
+    d->header_stamp_storage.clear();
+    s_charge_index_bytes(*d);
+    result_try(d->header_stamp_sidecar.open(path));
+    if (!d->header_stamp_sidecar.matches(*this)) {
+        fprintf(stderr, "bag_rdr: header stamp index '%s' is stale\n", path.c_str());
+        d->header_stamp_sidecar.close();
+        return unix_err{ESTALE};
+    }
+
+    bag_sidecar_reader rdr{d->header_stamp_sidecar.section("header_stamps")};
+    if (rdr.read<uint32_t>() != d->connection_indices.size()) {
+        d->header_stamp_sidecar.close();
+        return unix_err{EINVAL};
+    }
+    for (connection_index& conn : d->connection_indices) {
+        conn.min_latency_ns = rdr.read<int64_t>();
+        conn.max_latency_ns = rdr.read<int64_t>();
+        const uint64_t count = rdr.read<uint64_t>();
+        if (count && (count != conn.record_count)) {
+            fprintf(stderr, "bag_rdr: header stamp index '%s' doesn't match the bag index\n", path.c_str());
+            rdr.failed = true;
+        }
+        conn.header_stamps = rdr.read_array<common::timestamp>(count);
+    }
+    if (!rdr.ok()) {
+        for (connection_index& conn : d->connection_indices)
+            conn.header_stamps = {};
+        d->header_stamp_sidecar.close();
+        return unix_err{EINVAL};
+    }
+    return ok{};
+}
+
+uint64_t bag_rdr::chunk_hash(size_t chunk_index) const
+{
+    if (!assert_print(chunk_index < d->chunks.size()))
+        return 0;
+    std::atomic<uint64_t>& cached = d->chunk_hashes[chunk_index];
+    uint64_t hash = cached.load(std::memory_order_relaxed);
+    if (!hash) {
+        hash = bag_hash::xxh64(d->chunks[chunk_index].stored());
+        cached.store(hash, std::memory_order_relaxed);
+    }
+    return hash;
+}
+
+void bag_rdr::compute_chunk_hashes(unsigned threads) const
+{
+    parallel_for_chunks(threads, [this] (size_t chunk_index) {
+        chunk_hash(chunk_index);
+    });
+}
+
+uint64_t bag_rdr::content_hash(unsigned threads) const
+{
+    compute_chunk_hashes(threads);
+    std::vector<uint64_t> hashes(d->chunks.size());
+    for (size_t i = 0; i < hashes.size(); ++i)
+        hashes[i] = chunk_hash(i);
+    return bag_hash::xxh64({reinterpret_cast<const char*>(hashes.data()), hashes.size() * sizeof(uint64_t)});
+}
+
+result<ok, unix_err> bag_rdr::write_chunk_hashes() const
+{
+    return write_chunk_hashes(bag_sidecar_path(*this, chunk_hash_sidecar_suffix()));
+}
+
+result<ok, unix_err> bag_rdr::write_chunk_hashes(const std::string& path) const
+{
+    compute_chunk_hashes();
+    bag_sidecar_buffer buf;
+    buf.append(uint64_t(d->chunks.size()));
+    for (size_t i = 0; i < d->chunks.size(); ++i)
+        buf.append(chunk_hash(i));
+    bag_sidecar_writer writer;
+    writer.add_section("chunk_hashes", std::move(buf.bytes));
+    return writer.write(path, bag_sidecar_identity::of(*this));
+}
+
+result<ok, unix_err> bag_rdr::open_chunk_hashes()
+{
+    return open_chunk_hashes(bag_sidecar_path(*this, chunk_hash_sidecar_suffix()));
+}
+
+result<ok, unix_err> bag_rdr::open_chunk_hashes(const std::string& path)
+{
+    bag_sidecar sidecar;
+    result_try(sidecar.open(path));
+    if (!sidecar.matches(*this)) {
+        fprintf(stderr, "bag_rdr: chunk hashes '%s' are stale\n", path.c_str());
+        return unix_err{ESTALE};
+    }
+    bag_sidecar_reader rdr{sidecar.section("chunk_hashes")};
+    const uint64_t count = rdr.read<uint64_t>();
+    const auto hashes = rdr.read_array<uint64_t>(count);
+    if (!rdr.ok() || (count != d->chunks.size()))
+        return unix_err{EINVAL};
+    for (size_t i = 0; i < hashes.size(); ++i)
+        d->chunk_hashes[i].store(hashes[i], std::memory_order_relaxed);
+    return ok{};
+}
+
+bag_rdr::chunk_checksum bag_rdr::compute_chunk_checksum(size_t chunk_index, std::vector<char>& buffer) const
+{
+    if (!assert_print(chunk_index < d->chunks.size()))
+        return chunk_checksum{};
+    const chunk& ch = d->chunks[chunk_index];
+    const uint64_t stored = bag_hash::xxh64(ch.stored());
+    if (!ch.requires_decompression())
+        return chunk_checksum{stored, stored};
+    const common::array_view<const char> uncompressed = ch.uncompressed_into(buffer);
+    if (!uncompressed.size())
+        return chunk_checksum{stored, 0};
+    return chunk_checksum{stored, bag_hash::xxh64(uncompressed)};
+}
+
+bool bag_rdr::compute_chunk_checksums(unsigned threads)
+{
+    std::vector<chunk_checksum> checksums(d->chunks.size());
+    std::atomic<bool> failed{false};
+    parallel_for_chunks(threads, [&] (size_t chunk_index) {
+        std::vector<char> buffer;
+        checksums[chunk_index] = compute_chunk_checksum(chunk_index, buffer);
+        if (!checksums[chunk_index].uncompressed) {
+            fprintf(stderr, "bag_rdr: chunk %zu failed to decompress\n", chunk_index);
+            failed = true;
+        }
+    });
+    if (failed)
+        return false;
+    d->chunk_checksums = std::move(checksums);
+    for (std::atomic<uint8_t>& state : d->chunk_verified)
+        state = priv::VERIFIED;
+    return true;
+}
+
+bool bag_rdr::has_chunk_checksums() const
+{
+    return d->chunk_checksums.size() != 0;
+}
+
+result<ok, unix_err> bag_rdr::write_chunk_checksums() const
+{
+    return write_chunk_checksums(bag_sidecar_path(*this, chunk_checksum_sidecar_suffix()));
+}
+
+result<ok, unix_err> bag_rdr::write_chunk_checksums(const std::string& path) const
+{
+    if (!has_chunk_checksums())
+        return unix_err{ENODATA};
+    bag_sidecar_buffer buf;
+    buf.append(uint64_t(d->chunk_checksums.size()));
+    buf.append_array(d->chunk_checksums.data(), d->chunk_checksums.size());
+    bag_sidecar_writer writer;
+    writer.add_section("chunk_checksums", std::move(buf.bytes));
+    return writer.write(path, bag_sidecar_identity::of(*this));
+}
+
+result<ok, unix_err> bag_rdr::open_chunk_checksums()
+{
+    return open_chunk_checksums(bag_sidecar_path(*this, chunk_checksum_sidecar_suffix()));
+}
+
+result<ok, unix_err> bag_rdr::open_chunk_checksums(const std::string& path)
+{
+    d->chunk_checksums.clear();
+    bag_sidecar sidecar;
+    result_try(sidecar.open(path));
+    if (!sidecar.matches(*this)) {
+        fprintf(stderr, "bag_rdr: chunk checksums '%s' are stale\n", path.c_str());
+        return unix_err{ESTALE};
+    }
+    bag_sidecar_reader rdr{sidecar.section("chunk_checksums")};
+    const uint64_t count = rdr.read<uint64_t>();
+    const auto checksums = rdr.read_array<chunk_checksum>(count);
+    if (!rdr.ok() || (count != d->chunks.size()))
+        return unix_err{EINVAL};
+    d->chunk_checksums.assign(checksums.begin(), checksums.end());
+    for (std::atomic<uint8_t>& state : d->chunk_verified)
+        state = priv::UNVERIFIED;
+    return ok{};
+}
+
+bool bag_rdr::verify_chunk(size_t chunk_index, std::vector<char>& buffer) const
+{
+    if (!assert_print(chunk_index < d->chunks.size()) || !has_chunk_checksums())
+        return false;
+    const chunk_checksum expected = d->chunk_checksums[chunk_index];
+    const chunk_checksum actual = compute_chunk_checksum(chunk_index, buffer);
+    return (actual.stored == expected.stored) && (actual.uncompressed == expected.uncompressed);
+}
+
+// options::memory_budget, the chunk's cached decompression or a new one
+// in its place. The chunk lock is never held while taking the budget's,
+// which is held while evicting.
+static bag_memory_budget::buffer_ptr s_pin_chunk(bag_rdr::priv& d, chunk& ch)
+{
+    const size_t chunk_index = &ch - d.chunks.data();
+    bag_memory_budget::buffer_ptr pinned;
+    {
+        std::lock_guard<std::mutex> guard{ch.cache_lock.get()};
+        pinned = ch.cached;
+    }
+    if (pinned) {
+        d.opts.memory_budget->touch(*d.budget_client, chunk_index);
+        return pinned;
+    }
+    std::vector<char> buffer(ch.uncompressed_size);
+    if (!ch.decompress_into(buffer))
+        return {};
+    return d.opts.memory_budget->admit(*d.budget_client, chunk_index, std::move(buffer));
+}
+
+// options::verify_checksums, once per chunk when a view first reaches it,
+// decompressing into the chunk cache the view reads from next
+static bool s_verify_chunk_lazily(bag_rdr::priv& d, chunk& ch)
+{
+    if (!d.opts.verify_checksums || d.chunk_checksums.empty())
+        return true;
+    const size_t chunk_index = &ch - d.chunks.data();
+    std::atomic<uint8_t>& state = d.chunk_verified[chunk_index];
+    if (state.load() != bag_rdr::priv::UNVERIFIED)
+        return state.load() == bag_rdr::priv::VERIFIED;
+
+    const bag_rdr::chunk_checksum& expected = d.chunk_checksums[chunk_index];
+    bool valid = (bag_hash::xxh64(ch.stored()) == expected.stored);
+    if (valid && ch.requires_decompression()) {
+        bag_memory_budget::buffer_ptr pinned;
+        common::array_view<const char> uncompressed;
+        if (d.budget_client) {
+            pinned = s_pin_chunk(d, ch);
+            if (pinned)
+                uncompressed = *pinned;
+        } else {
+            uncompressed = ch.get_uncompressed();
+        }
+        valid = uncompressed.size() && (bag_hash::xxh64(uncompressed) == expected.uncompressed);
+    }
+    if (!valid)
+        fprintf(stderr, "bag_rdr: chunk %zu doesn't match its checksum, stopping\n", chunk_index);
+    state = valid ? bag_rdr::priv::VERIFIED : bag_rdr::priv::CORRUPT;
+    return valid;
+}
+
+uint64_t bag_rdr::message::hash() const
+{
+    return bag_hash::xxh64(message_data_block);
+}
+
+bag_rdr::view::view(const bag_rdr& rdr)
+: rdr(rdr)
+{
+}
+
+void bag_rdr::view::ensure_indices()
+{
+    if (m_connections)
+        return;
+    m_connections.reset_default();
+    m_connections->resize(rdr.d->connections.size());
+    std::iota(m_connections->begin(), m_connections->end(), 0);
+}
+
+bag_rdr::view bag_rdr::get_view() const
+{
+    return view{*this};
+}
+
+static void add_connection_id(std::vector<int32_t>& connection_ids, common::array_view<const bag_rdr::connection_record> connections, common::string_view topic)
+{
+    for (int32_t conn_id = 0; conn_id < int32_t(connections.size()); ++conn_id) {
+        const bag_rdr::connection_record& conn = connections[conn_id];
+        if (conn.data.topic.size() && (conn.topic != conn.data.topic)) {
+            fprintf(stderr, "bag_rdr: Inner topic [%zu]'%.*s' doesn't match outer '%.*s', not yet handled.\n",
+                conn.data.topic.size(), conn.data.topic.sizei(), conn.data.topic.data(),
+                conn.topic.sizei(), conn.topic.data());
+        }
+        if (conn.topic == topic) {
+            auto it = std::find(connection_ids.begin(), connection_ids.end(), conn_id);
+            if (it != connection_ids.end())
+                break;
+            connection_ids.emplace_back(conn_id);
+        }
+    }
+}
+
+void bag_rdr::view::set_topics(common::array_view<const std::string> topics)
+{
+    m_connections.reset_default();
+    m_connections->reserve(topics.size());
+    for (const std::string& topic : topics)
+        add_connection_id(*m_connections, rdr.d->connections, topic);
+}
+
+void bag_rdr::view::set_topics(array_view<const char*> topics)
+{
+    m_connections.reset_default();
+    m_connections->reserve(topics.size());
+    for (const char* topic : topics)
+        add_connection_id(*m_connections, rdr.d->connections, topic);
+}
+
+void bag_rdr::view::set_topics(std::initializer_list<const char*> topics)
+{
+    m_connections.reset_default();
+    m_connections->reserve(topics.size());
+    for (const char* topic : topics)
+        add_connection_id(*m_connections, rdr.d->connections, topic);
+}
+
+void bag_rdr::view::set_topics(array_view<common::string_view> topics)
+{
+    m_connections.reset_default();
+    m_connections->reserve(topics.size());
+    for (const common::string_view& topic : topics)
+        add_connection_id(*m_connections, rdr.d->connections, topic);
+}
+
+std::vector<common::string_view> bag_rdr::view::present_topics()
+{
+    ensure_indices();
+    std::vector<common::string_view> ret;
+
+    for (const int32_t conn_id : *m_connections) {
+        common::string_view topic = rdr.d->connections[conn_id].data.topic;
+        auto it = std::find(ret.begin(), ret.end(), topic);
         if (it == ret.end())
             ret.emplace_back(std::move(topic));
     }
@@ -856,8 +2120,8 @@ bool bag_rdr::view::has_topic(common::string_view topic)
 {
     ensure_indices();
 
-    for (const auto& conn : *m_connections) {
-        if (conn->data.topic == topic)
+    for (const int32_t conn_id : *m_connections) {
+        if (rdr.d->connections[conn_id].data.topic == topic)
             return true;
     }
     return false;
@@ -866,19 +2130,16 @@ bool bag_rdr::view::has_topic(common::string_view topic)
 void bag_rdr::view::for_each_connection(const std::function<void (const connection_data& data)>& fn)
 {
     ensure_indices();
-    for (const auto& conn : *m_connections) {
-        fn(connection_data {
-            .topic = conn->topic,
-            .datatype = conn->data.type,
-            .md5sum = conn->data.md5sum,
-            .msg_def = conn->data.message_definition,
-            .callerid = conn->data.callerid,
-            .latching = conn->data.latching,
-        });
-    }
+    for (const int32_t conn_id : *m_connections)
+        fn(rdr.get_connection_info(conn_id));
 }
 
-static bool increment_pos_ref(const bag_rdr::connection_record& conn, bag_rdr::view::iterator::pos_ref& pos)
+static const connection_index& view_connection(const bag_rdr::view& v, size_t index)
+{
+    return v.rdr.d->connection_indices[v.m_connections.value_unchecked()[index]];
+}
+
+static bool increment_pos_ref(const connection_index& conn, bag_rdr::view::iterator::pos_ref& pos)
 {
     assert_print(pos.block != -1);
     const index_block& block = conn.blocks[pos.block];
@@ -892,6 +2153,73 @@ static bool increment_pos_ref(const bag_rdr::connection_record& conn, bag_rdr::v
     return true;
 }
 
+static bool uses_header_stamps(const bag_rdr::view& v, const connection_index& conn)
+{
+    return (v.m_time_mode == bag_rdr::view::time_mode::sensor) && conn.header_stamps.size();
+}
+
+// Bounds on record time of messages whose selected stamp is in the view range
+static common::timestamp record_start_bound(const bag_rdr::view& v, const connection_index& conn)
+{
+    if (!v.m_start_time || !uses_header_stamps(v, conn))
+        return v.m_start_time;
+    return bag_rdr::stamp_from_ns(std::max<int64_t>(bag_rdr::stamp_to_ns(v.m_start_time) + conn.min_latency_ns, 0));
+}
+
+static common::timestamp record_end_bound(const bag_rdr::view& v, const connection_index& conn)
+{
+    if (!v.m_end_time || !uses_header_stamps(v, conn))
+        return v.m_end_time;
+    return bag_rdr::stamp_from_ns(std::max<int64_t>(bag_rdr::stamp_to_ns(v.m_end_time) + conn.max_latency_ns, 1));
+}
+
+static bool header_stamp_selected(const bag_rdr::view& v, const connection_index& conn, const bag_rdr::view::iterator::pos_ref& pos)
+{
+    if (!uses_header_stamps(v, conn))
+        return true;
+    const common::timestamp stamp = conn.header_stamps[conn.blocks[pos.block].first_record + pos.record];
+    return (!v.m_start_time || (stamp >= v.m_start_time)) && (!v.m_end_time || (stamp <= v.m_end_time));
+}
+
+static bool chunk_selected(const bag_rdr::view& v, const index_block& block)
+{
+    if (v.m_chunk_mask.empty())
+        return true;
+    const size_t chunk_index = block.into_chunk - v.rdr.d->chunks.data();
+    return (chunk_index < v.m_chunk_mask.size()) && v.m_chunk_mask[chunk_index];
+}
+
+// first record at or after pos in a chunk selected by the mask
+static bool skip_unselected_blocks(const bag_rdr::view& v, const connection_index& conn, bag_rdr::view::iterator::pos_ref& pos)
+{
+    while (!chunk_selected(v, conn.blocks[pos.block])) {
+        pos.record = 0;
+        if (++pos.block == int(conn.blocks.size())) {
+            pos.block = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+// increment_pos_ref, skipping masked out chunks and records not selected by
+// header stamp until past the end bound where iterator_update_connection_order drops it
+static bool advance_pos_ref(const bag_rdr::view& v, const connection_index& conn, bag_rdr::view::iterator::pos_ref& pos)
+{
+    if (!increment_pos_ref(conn, pos) || !skip_unselected_blocks(v, conn, pos))
+        return false;
+    if (!uses_header_stamps(v, conn))
+        return true;
+    const common::timestamp end_bound = record_end_bound(v, conn);
+    while (!header_stamp_selected(v, conn, pos)) {
+        if (end_bound && (conn.blocks[pos.block].as_records()[pos.record].to_stamp() > end_bound))
+            return true;
+        if (!increment_pos_ref(conn, pos) || !skip_unselected_blocks(v, conn, pos))
+            return false;
+    }
+    return true;
+}
+
 struct lowest_set
 {
     common::timestamp stamp;
@@ -903,12 +2231,24 @@ struct lowest_set
 };
 
 static common::timestamp pos_ref_timestamp(const bag_rdr::view::iterator& it, int32_t index)
+{
+    return it.next_stamps[index];
+}
+
+static void iterator_load_next_stamp(bag_rdr::view::iterator& it, int32_t index)
 {
     const bag_rdr::view::iterator::pos_ref& pos = it.connection_positions[index];
-    const bag_rdr::connection_record& conn = *it.v.m_connections.value_unchecked()[index];
-    const index_block& block = conn.blocks[pos.block];
-    const index_record& record = block.as_records()[pos.record];
-    return record.to_stamp();
+    const connection_index& conn = view_connection(it.v, index);
+    if ((pos.block == -1) || (size_t(pos.block) >= conn.blocks.size()))
+        return;
+    it.next_stamps[index] = conn.blocks[pos.block].as_records()[pos.record].to_stamp();
+}
+
+// messages with equal stamps are in view connection order, as in chunk-local mode
+static bool connection_order_before(const bag_rdr::view::iterator& it, int32_t ia, int32_t ib)
+{
+    const common::timestamp a = pos_ref_timestamp(it, ia), b = pos_ref_timestamp(it, ib);
+    return (a < b) || (!(b < a) && (ia < ib));
 }
 
 static void iterator_construct_connection_order(bag_rdr::view::iterator& it)
@@ -918,7 +2258,7 @@ static void iterator_construct_connection_order(bag_rdr::view::iterator& it)
         const bag_rdr::view::iterator::pos_ref& pos = it.connection_positions[i];
         if (pos.block == -1)
             continue;
-        const bag_rdr::connection_record& conn = *it.v.m_connections.value_unchecked()[i];
+        const connection_index& conn = view_connection(it.v, i);
         if ((size_t)pos.block >= conn.blocks.size()) {
             fprintf(stderr, "bag_rdr: invalid bag: conn index referenced non-existent block (index: %d, conn.blocks.size(): %zu).\n", pos.block, conn.blocks.size());
             continue;
@@ -926,7 +2266,7 @@ static void iterator_construct_connection_order(bag_rdr::view::iterator& it)
         it.connection_order.emplace_back(int32_t(i));
     }
     std::sort(it.connection_order.begin(), it.connection_order.end(), [&] (int32_t ia, int32_t ib) {
-        return pos_ref_timestamp(it, ia) < pos_ref_timestamp(it, ib);
+        return connection_order_before(it, ia, ib);
     });
 }
 
@@ -935,12 +2275,13 @@ static void iterator_update_connection_order(bag_rdr::view::iterator& it)
 {
     size_t head_index = it.connection_order[0];
     common::timestamp connection_next_stamp = pos_ref_timestamp(it, head_index);
-    if (it.v.m_end_time && (connection_next_stamp > it.v.m_end_time)) {
+    const common::timestamp end_bound = record_end_bound(it.v, view_connection(it.v, head_index));
+    if (end_bound && (connection_next_stamp > end_bound)) {
         it.connection_order.erase(it.connection_order.begin());
         return;
     }
-    auto elem_above = std::lower_bound(it.connection_order.begin() + 1, it.connection_order.end(), connection_next_stamp, [&] (int32_t index, const common::timestamp& find_stamp) {
-        return pos_ref_timestamp(it, index) < find_stamp;
+    auto elem_above = std::lower_bound(it.connection_order.begin() + 1, it.connection_order.end(), int32_t(head_index), [&] (int32_t index, int32_t head) {
+        return connection_order_before(it, index, head);
     });
     size_t index_after_first = std::distance(it.connection_order.begin(), elem_above) - 1;
     if (index_after_first == 0)
@@ -950,12 +2291,136 @@ static void iterator_update_connection_order(bag_rdr::view::iterator& it)
     *pos = head_index;
 }
 
+// Chunk-local mode applies when no connection selects by header stamp and
+// the chunks with messages of the view are in time order without overlap,
+// so chunk by chunk is time order. view_index is filled in on success.
+static bool chunk_local_eligible(const bag_rdr::view& v, std::vector<int32_t>& view_index)
+{
+    const bag_rdr::priv& d = *v.rdr.d;
+    if (v.m_connections->size() < 2)
+        return false;
+    view_index.assign(d.connections.size(), -1);
+    for (size_t i = 0; i < v.m_connections->size(); ++i) {
+        if (uses_header_stamps(v, view_connection(v, i)))
+            return false;
+        view_index[v.m_connections.value_unchecked()[i]] = int32_t(i);
+    }
+    bool first = true;
+    common::timestamp previous_end;
+    for (size_t c = 0; c < d.chunks.size(); ++c) {
+        const chunk& ch = d.chunks[c];
+        if (!v.m_chunk_mask.empty() && ((c >= v.m_chunk_mask.size()) || !v.m_chunk_mask[c]))
+            continue;
+        if (!std::any_of(ch.connection_ids.begin(), ch.connection_ids.end(), [&] (int32_t conn_id) { return view_index[conn_id] >= 0; }))
+            continue;
+        if (ch.info.message_count <= 0)
+            return false;
+        if (!first && !(previous_end < ch.info.start_timestamp))
+            return false;
+        previous_end = ch.info.end_timestamp;
+        first = false;
+    }
+    return true;
+}
+
+// The records of chunk c in the view's time range, searching for its
+// blocks from block_cursors and leaving advanced, if given, past them.
+// Each connection has at most one block per chunk.
+template <typename F>
+static void local_chunk_records(const bag_rdr::view::iterator& it, size_t c, const std::vector<int32_t>& block_cursors,
+                                std::vector<int32_t>* advanced, F&& fn)
+{
+    const chunk& ch = it.v.rdr.d->chunks[c];
+    for (const int32_t conn_id : ch.connection_ids) {
+        const int32_t index = it.local->view_index[conn_id];
+        if (index < 0)
+            continue;
+        const connection_index& conn = view_connection(it.v, index);
+        int32_t cursor = block_cursors[index];
+        while ((cursor < int32_t(conn.blocks.size())) && (conn.blocks[cursor].into_chunk < &ch))
+            ++cursor;
+        for (; (cursor < int32_t(conn.blocks.size())) && (conn.blocks[cursor].into_chunk == &ch); ++cursor) {
+            const auto records = conn.blocks[cursor].as_records();
+            for (int32_t r = 0; r < int32_t(records.size()); ++r) {
+                const common::timestamp stamp = records[r].to_stamp();
+                if ((it.v.m_start_time && (stamp < it.v.m_start_time)) || (it.v.m_end_time && (stamp > it.v.m_end_time)))
+                    continue;
+                fn(bag_rdr::view::iterator::local_entry{stamp, index, {cursor, r}});
+            }
+        }
+        if (advanced)
+            (*advanced)[index] = cursor;
+    }
+}
+
+static bool local_chunk_selected(const bag_rdr::view& v, size_t c)
+{
+    if (!v.m_chunk_mask.empty() && ((c >= v.m_chunk_mask.size()) || !v.m_chunk_mask[c]))
+        return false;
+    const chunk_info& info = v.rdr.d->chunks[c].info;
+    return !v.m_start_time || !(info.end_timestamp < v.m_start_time);
+}
+
+// the next chunk from `from` with selected records, sorted, false at the end
+static bool local_load_chunk(bag_rdr::view::iterator& it, size_t from)
+{
+    bag_rdr::view::iterator::local_state& local = it.local.get();
+    bag_rdr::priv& d = *it.v.rdr.d;
+    local.entries.clear();
+    local.next = 0;
+    for (size_t c = from; c < d.chunks.size(); ++c) {
+        if (it.v.m_end_time && (it.v.m_end_time < d.chunks[c].info.start_timestamp))
+            return false;
+        if (!local_chunk_selected(it.v, c))
+            continue;
+        local_chunk_records(it, c, local.block_cursors, &local.block_cursors, [&] (const bag_rdr::view::iterator::local_entry& e) {
+            local.entries.push_back(e);
+        });
+        if (local.entries.empty())
+            continue;
+        std::sort(local.entries.begin(), local.entries.end(), [] (const bag_rdr::view::iterator::local_entry& a, const bag_rdr::view::iterator::local_entry& b) {
+            if (a.stamp < b.stamp)
+                return true;
+            if (b.stamp < a.stamp)
+                return false;
+            return (a.index != b.index) ? (a.index < b.index) : (a.pos.record < b.pos.record);
+        });
+        local.chunk = int32_t(c);
+        return d.chunks[c].memory.size() && s_verify_chunk_lazily(d, d.chunks[c]);
+    }
+    return false;
+}
+
+// make the current local entry the head, or end the iteration
+static void local_set_head(bag_rdr::view::iterator& it, bool valid)
+{
+    if (!valid) {
+        it.connection_positions.clear();
+        it.connection_order.clear();
+        return;
+    }
+    const bag_rdr::view::iterator::local_state& local = it.local.get();
+    const bag_rdr::view::iterator::local_entry& e = local.entries[local.next];
+    it.connection_positions[e.index] = e.pos;
+    it.next_stamps[e.index] = e.stamp;
+    it.connection_order.assign(1, e.index);
+}
+
 bag_rdr::view::iterator& bag_rdr::view::iterator::operator++()
 {
     if (connection_positions.empty())
         return *this;
+    if (local) {
+        local_state& l = local.get();
+        if (++l.next < l.entries.size())
+            local_set_head(*this, true);
+        else
+            local_set_head(*this, local_load_chunk(*this, l.chunk + 1));
+        return *this;
+    }
     const size_t old_head_index = connection_order[0];
-    if (increment_pos_ref(*v.m_connections.value_unchecked()[old_head_index], connection_positions[old_head_index])) {
+    if (advance_pos_ref(v, view_connection(v, old_head_index), connection_positions[old_head_index])) {
+        iterator_load_next_stamp(*this, int32_t(old_head_index));
         iterator_update_connection_order(*this);
     } else {
         connection_order.erase(connection_order.begin());
@@ -964,10 +2429,10 @@ bag_rdr::view::iterator& bag_rdr::view::iterator::operator++()
         connection_positions.clear();
     } else {
         const size_t head_index = connection_order[0];
-        const connection_record& conn = *v.m_connections.value_unchecked()[head_index];
+        const connection_index& conn = view_connection(v, head_index);
         const pos_ref& head = connection_positions[head_index];
         const index_block& block = conn.blocks[head.block];
-        if (!block.into_chunk->memory.size()) {
+        if (!block.into_chunk->memory.size() || !s_verify_chunk_lazily(*v.rdr.d, *block.into_chunk)) {
             connection_positions.clear();
             return *this;
         }
@@ -988,19 +2453,23 @@ bag_rdr::view::iterator bag_rdr::view::end() const
 }
 
 static bag_rdr::view::iterator::pos_ref find_starting_position(const bag_rdr::view& v,
-                                                               const bag_rdr::connection_record& conn)
+                                                               const connection_index& conn)
 {
+    const common::timestamp start_bound = record_start_bound(v, conn);
+    const common::timestamp end_bound = record_end_bound(v, conn);
     bag_rdr::view::iterator::pos_ref pos{0, 0};
     for (; pos.block < int(conn.blocks.size()); ++pos.block) {
         const index_block& block = conn.blocks[pos.block];
+        if (!chunk_selected(v, block))
+            continue;
         const auto block_records = block.as_records();
         for (pos.record = 0; pos.record < int(block_records.size()); ++pos.record) {
             const index_record& record = block_records[pos.record];
-            if (v.m_end_time && (record.to_stamp() > v.m_end_time)) {
+            if (end_bound && (record.to_stamp() > end_bound)) {
                 pos.block = -1;
                 return {-1, 0};
             }
-            if (record.to_stamp() >= v.m_start_time)
+            if ((record.to_stamp() >= start_bound) && header_stamp_selected(v, conn, pos))
                 return pos;
         }
     }
@@ -1010,13 +2479,32 @@ static bag_rdr::view::iterator::pos_ref find_starting_position(const bag_rdr::vi
 bag_rdr::view::iterator::iterator(const bag_rdr::view& v, constructor_start_tag)
 : v(v)
 {
+    std::vector<int32_t> view_index;
+    if (chunk_local_eligible(v, view_index)) {
+        local.reset_default();
+        local->view_index = std::move(view_index);
+        local->block_cursors.assign(v.m_connections->size(), 0);
+        // a chunk's records fit, so loading the next chunk doesn't allocate
+        size_t most_records = 0;
+        for (const chunk& ch : v.rdr.d->chunks)
+            most_records = std::max(most_records, size_t(std::max(ch.info.message_count, 0)));
+        local->entries.reserve(most_records);
+        connection_positions.resize(v.m_connections->size(), pos_ref{-1, 0});
+        next_stamps.resize(connection_positions.size());
+        local_set_head(*this, local_load_chunk(*this, 0));
+        return;
+    }
+
     connection_positions.resize(v.m_connections->size(), pos_ref{0, 0});
-    if (v.m_start_time) {
+    if (v.m_start_time || (v.m_time_mode == bag_rdr::view::time_mode::sensor) || v.m_chunk_mask.size()) {
         for (size_t i = 0; i < connection_positions.size(); ++i) {
-            const connection_record& conn = *v.m_connections.value_unchecked()[i];
+            const connection_index& conn = view_connection(v, i);
             connection_positions[i] = find_starting_position(v, conn);
         }
     }
+    next_stamps.resize(connection_positions.size());
+    for (size_t i = 0; i < connection_positions.size(); ++i)
+        iterator_load_next_stamp(*this, int32_t(i));
     iterator_construct_connection_order(*this);
     if (!connection_order.size()) {
         connection_positions.clear();
@@ -1025,42 +2513,87 @@ bag_rdr::view::iterator::iterator(const bag_rdr::view& v, constructor_start_tag)
 
     const size_t head_index = connection_order[0];
 
-    const connection_record& conn = *v.m_connections.value_unchecked()[head_index];
+    const connection_index& conn = view_connection(v, head_index);
     const pos_ref& head = connection_positions[head_index];
     const index_block& block = conn.blocks[head.block];
-    if (!block.into_chunk->memory.size()) {
+    if (!block.into_chunk->memory.size() || !s_verify_chunk_lazily(*v.rdr.d, *block.into_chunk)) {
         connection_positions.clear();
     }
 }
 
 common::timestamp bag_rdr::view::iterator::get_current_msg_stamp() const {
   if (!assert_print(connection_order.size() > 0)) abort();
-  const size_t head_index = connection_order[0];
-  const connection_record& conn = *v.m_connections.value_unchecked()[head_index];
-  const pos_ref& head = connection_positions[head_index];
-  const index_block& block = conn.blocks[head.block];
-  const index_record& rec = block.as_records()[head.record];
-
-  return rec.to_stamp();
+  return next_stamps[connection_order[0]];
 }
 
 common::string_view bag_rdr::view::iterator::get_current_topic() const {
   if (!assert_print(connection_order.size() > 0)) abort();
   const size_t head_index = connection_order[0];
-  const connection_record& conn = *v.m_connections.value_unchecked()[head_index];
+  return v.rdr.d->connections[v.m_connections.value_unchecked()[head_index]].topic;
+}
 
-  return conn.topic;
+bag_rdr::message_handle bag_rdr::view::iterator::handle() const
+{
+    const size_t head_index = connection_order[0];
+    const connection_index& conn = view_connection(v, head_index);
+    const pos_ref& head = connection_positions[head_index];
+    return message_handle{
+        .connection_id = v.m_connections.value_unchecked()[head_index],
+        .record = conn.blocks[head.block].first_record + uint32_t(head.record),
+        .stamp = next_stamps[head_index],
+    };
 }
 
 std::optional<common::timestamp> bag_rdr::view::iterator::get_next_msg_stamp() const {
-  if (connection_order.size() <= 1) return std::nullopt;
-  const size_t head_index = connection_order[1];
-  const connection_record& conn = *v.m_connections.value_unchecked()[head_index];
-  const pos_ref& head = connection_positions[head_index];
-  const index_block& block = conn.blocks[head.block];
-  const index_record& rec = block.as_records()[head.record];
+  if (local && !connection_order.empty()) {
+    const local_state& l = local.get();
+    if (l.next + 1 < l.entries.size()) return l.entries[l.next + 1].stamp;
+    for (size_t c = l.chunk + 1; c < v.rdr.d->chunks.size(); ++c) {
+      if (v.m_end_time && (v.m_end_time < v.rdr.d->chunks[c].info.start_timestamp)) break;
+      if (!local_chunk_selected(v, c)) continue;
+      std::optional<common::timestamp> first;
+      local_chunk_records(*this, c, l.block_cursors, nullptr, [&] (const local_entry& e) { if (!first || (e.stamp < *first)) first = e.stamp; });
+      if (first) return first;
+    }
+    return std::nullopt;
+  }
+  if (connection_order.empty()) return std::nullopt;
+  std::optional<common::timestamp> next;
+  if (connection_order.size() > 1) next = next_stamps[connection_order[1]];
+  // the head connection's own next record may come before the others
+  const size_t head_index = connection_order[0];
+  const connection_index& conn = view_connection(v, head_index);
+  pos_ref pos = connection_positions[head_index];
+  if (advance_pos_ref(v, conn, pos)) {
+    const common::timestamp own = conn.blocks[pos.block].as_records()[pos.record].to_stamp();
+    const common::timestamp end_bound = record_end_bound(v, conn);
+    if (!(end_bound && (own > end_bound)) && (!next || !(*next < own))) next = own;
+  }
+  return next;
+}
 
-  return rec.to_stamp();
+bag_rdr::message_payload bag_rdr::message_payload::aligned_copy(array_view<const char> data, size_t alignment)
+{
+    message_payload ret;
+    ret.m_alignment = std::max<size_t>(alignment, 1);
+    ret.m_owned.resize(data.size() + ret.m_alignment - 1);
+    const size_t misalignment = uintptr_t(ret.m_owned.data()) & (ret.m_alignment - 1);
+    char* const start = ret.m_owned.data() + (misalignment ? ret.m_alignment - misalignment : 0);
+    std::memcpy(start, data.data(), data.size());
+    ret.m_view = array_view<const char>{start, data.size()};
+    return ret;
+}
+
+// data from a decompressed chunk is always copied, as the chunk isn't kept
+static bag_rdr::message_payload s_make_payload(const bag_rdr::options& opts, common::array_view<const char> data, bool from_decompressed)
+{
+    const size_t alignment = opts.payload_alignment;
+    const bool aligned = (alignment <= 1) || !(uintptr_t(data.data()) & (alignment - 1));
+    if (!from_decompressed && aligned)
+        return bag_rdr::message_payload{data};
+    if (alignment <= 1)
+        return bag_rdr::message_payload{data.to_owned()};
+    return bag_rdr::message_payload::aligned_copy(data, alignment);
 }
 
 bag_rdr::view::message bag_rdr::view::iterator::operator*() const
@@ -1068,27 +2601,38 @@ bag_rdr::view::message bag_rdr::view::iterator::operator*() const
     if (!assert_print(connection_order.size() > 0))
         abort();
     const size_t head_index = connection_order[0];
-    const connection_record& conn = *v.m_connections.value_unchecked()[head_index];
+    const connection_index& conn = view_connection(v, head_index);
     const pos_ref& head = connection_positions[head_index];
     const index_block& block = conn.blocks[head.block];
     const index_record& rec = block.as_records()[head.record];
     auto* chunk = block.into_chunk;
-    common::array_view<const char> chunk_memory = chunk->get_uncompressed();
+    const bool budgeted = v.rdr.d->budget_client && chunk->requires_decompression();
+    // keeps a budgeted chunk alive until the message is copied out
+    bag_memory_budget::buffer_ptr pinned;
+    common::array_view<const char> chunk_memory;
+    if (budgeted) {
+        pinned = s_pin_chunk(*v.rdr.d, *chunk);
+        if (pinned)
+            chunk_memory = *pinned;
+    } else {
+        chunk_memory = chunk->get_uncompressed();
+    }
     if (!chunk_memory.size())
         abort();
     common::array_view<const char> record_memory = chunk_memory.advance(rec.offset);
     record r{record_memory};
 
+    const connection_record& meta = v.rdr.d->connections[v.m_connections.value_unchecked()[head_index]];
     auto res = message{.stamp = rec.to_stamp(),
-                        .md5 = conn.data.md5sum,
-                        .message_data_block = r.memory_data.to_owned(),
-                        .connection = &conn};
+                        .md5 = meta.data.md5sum,
+                        .message_data_block = s_make_payload(v.rdr.d->opts, r.memory_data, chunk->requires_decompression()),
+                        .connection = &meta};
 
     // Clear the decompression buffer after each decompression to keep the RAM usage as low as
     // possible because the memory usage is the bottleneck when reading big rosbag files. This will
     // increase the overall reading time, but this will be amortized by the usage of multiple threads
-    // to read a rosbag.
-    if (chunk->requires_decompression()) {
+    // to read a rosbag. With a memory budget the budget decides instead.
+    if (chunk->requires_decompression() && !budgeted) {
         common::optional<std::lock_guard<std::mutex>> guard;
         chunk->decompression_lock.with([&guard](std::mutex& m) mutable { guard.emplace(m); });
         chunk->uncompressed_buffer.clear();
@@ -1119,3 +2663,23 @@ bool bag_rdr::view::message::is_latching() const
     return connection->data.latching;
 }
 
+
+common::string_view bag_rdr::chunk_message::topic() const
+{
+    return connection->topic;
+}
+
+common::string_view bag_rdr::chunk_message::md5() const
+{
+    return connection->data.md5sum;
+}
+
+common::string_view bag_rdr::chunk_message::data_type() const
+{
+    return connection->data.type;
+}
+
+common::string_view bag_rdr::chunk_message::message_definition() const
+{
+    return connection->data.message_definition;
+}
@@ -26,14 +26,21 @@
 #include "common/string_view.hpp"
 #include "common/common_timestamp.hpp"
 #include "common/common_result.hpp"
+#include "common/common_optional.hpp"
 #include "common/unix_err.hpp"
 
 #include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 
 #ifndef BAG_RDR_NO_ROS
 #include <ros/serialization.h>
 #endif
 
+struct bag_memory_budget;
+struct bag_source;
+
 /**
  * A minimal, zero-copy memory-map based ROS
  * bag reader. Only allocates for the decompression
@@ -60,6 +67,25 @@ struct bag_rdr
          * these are not protected for multi-threaded access.
          */
         bool threadsafe{false};
+        /**
+         * Views check each chunk against the checksums loaded with
+         * open_chunk_checksums the first time they reach it, and
+         * end iteration at a chunk that doesn't match.
+         */
+        bool verify_checksums{false};
+        /**
+         * Shared with other readers to bound their memory together.
+         * Views then keep decompressed chunks across messages, see
+         * bag_memory_budget.
+         */
+        std::shared_ptr<bag_memory_budget> memory_budget;
+        /**
+         * Payloads handed out by views start at a multiple of this,
+         * a power of two, e.g. 32 for AVX loads. Payloads of compressed
+         * chunks are copied anyway, mapped ones only if misaligned.
+         * 0 leaves them where they are.
+         */
+        size_t payload_alignment{0};
     };
 
     bag_rdr();
@@ -68,6 +94,21 @@ struct bag_rdr
     bool open(const char* filename);
     result<ok, unix_err> open_detailed(const char* filename);
     result<ok, unix_err> open_memory(array_view<const char> memory);
+    /**
+     * Open a bag stored as a member of an uncompressed tar archive in
+     * place, mapping only its byte range. filename() is then
+     * "archive.tar:member", so sidecars are kept next to the archive.
+     */
+    result<ok, unix_err> open_tar_member(const char* tar_filename, const char* member_name);
+    /**
+     * Open a bag produced on demand by source, see bag_source. Only the
+     * segments holding the record headers and index are read to open it,
+     * and chunks are read as they are first used; what has been read stays
+     * resident while the bag is open, as messages point into it.
+     */
+    result<ok, unix_err> open_source(std::unique_ptr<bag_source> source);
+    // a whole-file zstd or xz compressed bag, through open_source
+    result<ok, unix_err> open_compressed(const char* filename);
 
     timestamp start_timestamp() const;
     timestamp end_timestamp() const;
@@ -75,14 +116,189 @@ struct bag_rdr
     size_t file_size() const;
     bool is_compressed() const;
 
+    static int64_t stamp_to_ns(timestamp t) { return int64_t(t.secs) * 1000000000 + t.nsecs; }
+    static timestamp stamp_from_ns(int64_t ns) { return timestamp{uint32_t(ns / 1000000000), uint32_t(ns % 1000000000)}; }
+
     struct view;
     view get_view() const;
 
     struct message;
+    struct message_payload;
     struct connection_record;
 
+    /**
+     * Chunk-level access for whole-bag passes that don't need
+     * global time order. Chunks are numbered in file order,
+     * messages within a chunk are visited in on-disk order.
+     */
+    struct chunk_summary
+    {
+        timestamp start_timestamp, end_timestamp;
+        int32_t message_count;
+        // of the chunk record, from the start of the file
+        size_t offset;
+        size_t compressed_size;
+        size_t uncompressed_size;
+        bool compressed;
+        // connections with messages in this chunk
+        array_view<const int32_t> connection_ids;
+        // the chunk record's data as stored, compressed if compressed
+        array_view<const char> data;
+    };
+    struct chunk_message
+    {
+        timestamp stamp;
+        int32_t connection_id;
+        // of the message record in the uncompressed chunk
+        uint32_t offset;
+        array_view<const char> data;
+        const connection_record* connection;
+
+        string_view topic() const;
+        string_view md5() const;
+        string_view data_type() const;
+        string_view message_definition() const;
+    };
+    size_t chunk_count() const;
+    chunk_summary get_chunk_summary(size_t chunk_index) const;
+    /**
+     * Index entries of a chunk's messages, from the bag index without
+     * decompressing the chunk. Visited per connection, each in time order.
+     */
+    void for_each_chunk_index_entry(size_t chunk_index,
+                                    const std::function<void (int32_t connection_id, timestamp stamp, uint32_t offset)>& fn) const;
+
+    struct connection_info
+    {
+        string_view topic;
+        string_view datatype;
+        string_view md5sum;
+        string_view msg_def;
+        string_view callerid;
+        bool latching;
+    };
+    size_t connection_count() const;
+    connection_info get_connection_info(int32_t connection_id) const;
+    /**
+     * Decompresses into the caller's buffer, not the chunk cache used by
+     * views, so calls with distinct buffers are safe from several threads
+     * regardless of options::threadsafe.
+     */
+    bool for_each_chunk_message(size_t chunk_index, std::vector<char>& buffer,
+                                const std::function<void (const chunk_message& msg)>& fn) const;
+    /**
+     * Every message record of a chunk in on-disk order, from one linear
+     * pass over the decompressed chunk, with offsets into it. Built on
+     * first request, decompressing into buffer if needed, then cached for
+     * the life of the bag_rdr and also used by for_each_chunk_message.
+     * Empty if the chunk is malformed.
+     */
+    struct chunk_table_entry
+    {
+        int32_t connection_id;
+        // of the message record, and of its data
+        uint32_t offset;
+        uint32_t data_offset, data_size;
+        timestamp stamp;
+    };
+    array_view<const chunk_table_entry> chunk_message_table(size_t chunk_index, std::vector<char>& buffer) const;
+    // random access to messages by chunk_message::offset, e.g. from a sidecar index
+    bool for_each_chunk_message_at(size_t chunk_index, array_view<const uint32_t> offsets, std::vector<char>& buffer,
+                                   const std::function<void (const chunk_message& msg)>& fn) const;
+    // the chunk's records, mapped if stored uncompressed, else decompressed into buffer; empty on failure
+    array_view<const char> uncompressed_chunk(size_t chunk_index, std::vector<char>& buffer) const;
+    // as above, on chunk_memory from uncompressed_chunk, e.g. shared between threads
+    bool for_each_chunk_message_at(size_t chunk_index, array_view<const uint32_t> offsets, array_view<const char> chunk_memory,
+                                   const std::function<void (const chunk_message& msg)>& fn) const;
+
+    /**
+     * A trivially copyable 16 byte reference to a message, for holding
+     * very many of them, from view::iterator::handle(). The message's
+     * chunk and offset are looked up in the index when resolved.
+     */
+    struct message_handle
+    {
+        int32_t connection_id;
+        // among all of the connection's messages, in time order
+        uint32_t record;
+        timestamp stamp;
+    };
+    bool locate(message_handle handle, size_t& chunk_index, uint32_t& offset) const;
+    /**
+     * Visit the messages of handles grouped by chunk, decompressing each
+     * chunk once into buffer. fn gets the index into handles of each.
+     * Fails on handles that aren't from this bag.
+     */
+    bool resolve(array_view<const message_handle> handles, std::vector<char>& buffer,
+                 const std::function<void (size_t handle_index, const chunk_message& msg)>& fn) const;
+
+    /**
+     * Run fn once for every chunk index across a pool of threads,
+     * threads == 0 uses the hardware concurrency.
+     */
+    void parallel_for_chunks(unsigned threads, const std::function<void (size_t chunk_index)>& fn) const;
+
+    const std::string& filename() const;
+
+    /**
+     * XXH64 content hashes, cached once computed. A chunk's hash is over
+     * its record data as stored, compressed or not, content_hash combines
+     * the hashes of every chunk. Can be persisted in a ".hashes" sidecar.
+     */
+    uint64_t chunk_hash(size_t chunk_index) const;
+    void compute_chunk_hashes(unsigned threads = 0) const;
+    uint64_t content_hash(unsigned threads = 0) const;
+    static const char* chunk_hash_sidecar_suffix() { return ".hashes"; }
+    result<ok, unix_err> write_chunk_hashes() const;
+    result<ok, unix_err> write_chunk_hashes(const std::string& path) const;
+    // fails with ESTALE if the sidecar was derived from a different version of the bag
+    result<ok, unix_err> open_chunk_hashes();
+    result<ok, unix_err> open_chunk_hashes(const std::string& path);
+
+    /**
+     * Integrity checksums, XXH64 of each chunk as stored and decompressed,
+     * kept in a ".checksums" sidecar as bags don't carry checksums of
+     * their own. compute_chunk_checksums trusts the current contents.
+     */
+    struct chunk_checksum
+    {
+        uint64_t stored;
+        // 0 if the chunk failed to decompress
+        uint64_t uncompressed;
+    };
+    chunk_checksum compute_chunk_checksum(size_t chunk_index, std::vector<char>& buffer) const;
+    bool compute_chunk_checksums(unsigned threads = 0);
+    bool has_chunk_checksums() const;
+    static const char* chunk_checksum_sidecar_suffix() { return ".checksums"; }
+    result<ok, unix_err> write_chunk_checksums() const;
+    result<ok, unix_err> write_chunk_checksums(const std::string& path) const;
+    // fails with ESTALE if the sidecar was derived from a different version of the bag
+    result<ok, unix_err> open_chunk_checksums();
+    result<ok, unix_err> open_chunk_checksums(const std::string& path);
+    // against the loaded checksums, false if none are loaded
+    bool verify_chunk(size_t chunk_index, std::vector<char>& buffer) const;
+
+    /**
+     * Optional secondary index of std_msgs/Header stamps, for connections
+     * whose message type begins with a Header. The stamp is read from each
+     * payload at its fixed offset after header.seq in a chunk-parallel pass,
+     * and can be persisted to a ".stamps" sidecar next to the bag.
+     *
+     * Used by views in time_mode::sensor.
+     */
+    bool build_header_stamp_index(unsigned threads = 0);
+    bool has_header_stamp_index() const;
+    static const char* header_stamp_sidecar_suffix() { return ".stamps"; }
+    result<ok, unix_err> write_header_stamp_index() const;
+    result<ok, unix_err> write_header_stamp_index(const std::string& path) const;
+    // fails with ESTALE if the sidecar was derived from a different version of the bag
+    result<ok, unix_err> open_header_stamp_index();
+    result<ok, unix_err> open_header_stamp_index(const std::string& path);
+
     // detail
     result<ok, unix_err> internal_map_file(const char* filename);
+    result<ok, unix_err> internal_map_tar_member(const char* tar_filename, const char* member_name);
+    result<ok, unix_err> internal_map_source(std::unique_ptr<bag_source> source);
     string_view internal_read_initial();
     bool internal_load_records();
 
@@ -91,6 +307,63 @@ struct bag_rdr
 };
 
 
+/**
+ * A message's serialised data. Refers to the mapped bag when the chunk
+ * is stored uncompressed, valid while the bag_rdr is open, so iterating
+ * such bags doesn't allocate. Owns a copy otherwise, as decompressed
+ * chunks aren't kept.
+ */
+struct bag_rdr::message_payload
+{
+    message_payload() = default;
+    explicit message_payload(array_view<const char> mapped) : m_view(mapped) {}
+    explicit message_payload(std::vector<char> owned) : m_owned(std::move(owned)), m_view(m_owned) {}
+    // a copy of data starting at a multiple of alignment, a power of two
+    static message_payload aligned_copy(array_view<const char> data, size_t alignment);
+    // copies of owned payloads keep their alignment
+    message_payload(const message_payload& other)
+    : m_view(other.m_view), m_alignment(other.m_alignment)
+    {
+        if (other.is_owned())
+            *this = aligned_copy(other.m_view, other.m_alignment);
+    }
+    // moving the vector keeps its data where m_view points
+    message_payload(message_payload&& other) noexcept
+    : m_owned(std::move(other.m_owned)), m_view(other.m_view), m_alignment(other.m_alignment)
+    {
+        other.m_view = {};
+    }
+    message_payload& operator=(const message_payload& other)
+    {
+        if (other.is_owned())
+            return *this = aligned_copy(other.m_view, other.m_alignment);
+        m_owned.clear();
+        m_view = other.m_view;
+        m_alignment = other.m_alignment;
+        return *this;
+    }
+    message_payload& operator=(message_payload&& other) noexcept
+    {
+        m_owned = std::move(other.m_owned);
+        m_view = other.m_view;
+        m_alignment = other.m_alignment;
+        other.m_view = {};
+        return *this;
+    }
+
+    const char* data() const { return m_view.data(); }
+    size_t size() const { return m_view.size(); }
+    const char* begin() const { return m_view.data(); }
+    const char* end() const { return m_view.data() + m_view.size(); }
+    bool is_owned() const { return m_owned.size() != 0; }
+    operator array_view<const char>() const { return m_view; }
+    std::vector<char> to_owned() const { return std::vector<char>(begin(), end()); }
+
+    std::vector<char> m_owned;
+    array_view<const char> m_view;
+    size_t m_alignment = 1;
+};
+
 struct bag_rdr::message
 {
 #ifndef BAG_RDR_NO_ROS
@@ -149,8 +422,11 @@ struct bag_rdr::message
     bool is_latching() const;
     string_view latching_str() const { return is_latching() ? "1" : ""; }
 
-    std::vector<char> message_data_block;
+    message_payload message_data_block;
     const connection_record* connection;
+
+    // XXH64 of message_data_block, computed on each call
+    uint64_t hash() const;
 };
 
 struct connection_record;
@@ -184,6 +460,23 @@ struct bag_rdr::view
     view  with_time_range_and_topics(timestamp start_time, timestamp end_time, array_view<const std::string> topics) &&
         { m_start_time = start_time; m_end_time = end_time; set_topics(topics); return *this; }
 
+    /**
+     * Which stamp the start/end times select on. In sensor mode, connections
+     * covered by the header stamp index are selected by header.stamp, others
+     * still by record time. Messages are delivered in record time order.
+     */
+    enum class time_mode { record, sensor };
+    view& with_time_mode(time_mode mode) &  { m_time_mode = mode; return *this; }
+    view  with_time_mode(time_mode mode) && { m_time_mode = mode; return *this; }
+
+    /**
+     * Only read chunks whose index is set in mask, e.g. from
+     * bag_chunk_filters. Chunks past the end of the mask are skipped.
+     * An empty mask reads every chunk.
+     */
+    view& with_chunk_mask(std::vector<bool> mask) &  { m_chunk_mask = std::move(mask); return *this; }
+    view  with_chunk_mask(std::vector<bool> mask) && { m_chunk_mask = std::move(mask); return *this; }
+
     using message = bag_rdr::message;
 
     struct iterator
@@ -191,18 +484,40 @@ struct bag_rdr::view
         const bag_rdr::view& v;
         struct pos_ref { int32_t block; int32_t record; bool operator==(const pos_ref& other) const {return block == other.block && record == other.record; } };
         std::vector<pos_ref> connection_positions;
+        // record time at each connection's position, what the merge compares
+        std::vector<timestamp> next_stamps;
         std::vector<int32_t> connection_order;
 
+        /**
+         * Chunk-local mode, chosen when the view's chunks don't overlap in
+         * time: instead of merging all connections, each chunk's selected
+         * records are sorted by stamp and the head is set from them.
+         */
+        struct local_entry { timestamp stamp; int32_t index; pos_ref pos; };
+        struct local_state
+        {
+            std::vector<local_entry> entries;
+            size_t next = 0;
+            int32_t chunk = -1;
+            // per view connection, its first block not before the next chunk
+            std::vector<int32_t> block_cursors;
+            // view connection index by connection id, -1 if not in the view
+            std::vector<int32_t> view_index;
+        };
+        common::optional<local_state> local;
+
         struct constructor_start_tag {};
         iterator(const bag_rdr::view& v) : v(v) {};
         iterator(const bag_rdr::view& v, constructor_start_tag);
         iterator& operator=(const iterator&& other)
         {
             connection_positions = std::move(other.connection_positions);
+            next_stamps = std::move(other.next_stamps);
             connection_order = std::move(other.connection_order);
+            local = std::move(other.local);
             return *this;
         }
-        iterator(const iterator& other) : v(other.v), connection_positions{other.connection_positions}, connection_order{other.connection_order} {}
+        iterator(const iterator& other) : v(other.v), connection_positions{other.connection_positions}, next_stamps{other.next_stamps}, connection_order{other.connection_order}, local{other.local} {}
 
         bool operator==(const iterator& other) const {
             return connection_positions == other.connection_positions;
@@ -212,6 +527,8 @@ struct bag_rdr::view
         }
 
         common::timestamp get_current_msg_stamp() const;
+        // of the current message, without copying it out
+        bag_rdr::message_handle handle() const;
         common::string_view get_current_topic() const;
         std::optional<common::timestamp> get_next_msg_stamp() const;
 
@@ -225,23 +542,18 @@ struct bag_rdr::view
 
     std::vector<string_view> present_topics();
     bool has_topic(string_view topic);
-    struct connection_data
-    {
-        string_view topic;
-        string_view datatype;
-        string_view md5sum;
-        string_view msg_def;
-        string_view callerid;
-        bool latching;
-    };
+    using connection_data = bag_rdr::connection_info;
     void for_each_connection(const std::function<void (const connection_data& data)>& fn);
 
     void ensure_indices();
 
     // detail
     const bag_rdr& rdr;
-    common::optional<std::vector<connection_record*>> m_connections;
+    // connection ids
+    common::optional<std::vector<int32_t>> m_connections;
     timestamp m_start_time, m_end_time;
+    time_mode m_time_mode = time_mode::record;
+    std::vector<bool> m_chunk_mask;
 };
 
 #endif // BAG_RDR_HPP
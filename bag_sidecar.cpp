@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_sidecar.hpp"
+#pragma GCC diagnostic pop
+
+#include "common/file_handle.hpp"
+
+#include <sys/mman.h>
+#include <cstdio>
+#include <unistd.h>
+
+using common::result;
+using common::ok;
+using common::unix_err;
+
+static const char sidecar_magic[8] = {'B', 'A', 'G', 'R', 'D', 'R', 'S', 'C'};
+static const uint32_t sidecar_version = 1;
+
+bag_sidecar_identity bag_sidecar_identity::of(const bag_rdr& rdr)
+{
+    bag_sidecar_identity ret;
+    ret.file_size = rdr.file_size();
+    ret.chunk_count = rdr.chunk_count();
+    ret.connection_count = rdr.connection_count();
+    ret.start_ns = bag_rdr::stamp_to_ns(rdr.start_timestamp());
+    ret.end_ns = bag_rdr::stamp_to_ns(rdr.end_timestamp());
+    return ret;
+}
+
+std::string bag_sidecar_path(const bag_rdr& rdr, const char* suffix)
+{
+    return rdr.filename() + suffix;
+}
+
+void bag_sidecar_writer::add_section(common::string_view name, std::vector<char> bytes)
+{
+    sections.emplace_back(section{name.to_string(), std::move(bytes)});
+}
+
+result<ok, unix_err> bag_sidecar_writer::write(const std::string& path, const bag_sidecar_identity& identity) const
+{
+    bag_sidecar_buffer out;
+    out.bytes.insert(out.bytes.end(), sidecar_magic, sidecar_magic + sizeof(sidecar_magic));
+    out.append(sidecar_version);
+    out.append(uint32_t(sections.size()));
+    out.append(identity.file_size);
+    out.append(identity.chunk_count);
+    out.append(identity.connection_count);
+    out.append(identity.start_ns);
+    out.append(identity.end_ns);
+    for (const section& s : sections) {
+        out.append_string(s.name);
+        out.append(uint64_t(s.bytes.size()));
+        out.append_array(s.bytes.data(), s.bytes.size());
+    }
+
+    const std::string tmp_path = path + ".tmp";
+    FILE* f = ::fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "bag_sidecar: failed to create '%s' (%m)\n", tmp_path.c_str());
+        return unix_err::current();
+    }
+    const bool written = (::fwrite(out.bytes.data(), 1, out.bytes.size(), f) == out.bytes.size());
+    const unix_err write_err = unix_err::current();
+    if ((::fclose(f) != 0) || !written) {
+        ::unlink(tmp_path.c_str());
+        return written ? unix_err::current() : write_err;
+    }
+    if (::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        const unix_err rename_err = unix_err::current();
+        ::unlink(tmp_path.c_str());
+        return rename_err;
+    }
+    return ok{};
+}
+
+bag_sidecar::~bag_sidecar()
+{
+    close();
+}
+
+void bag_sidecar::close()
+{
+    if (memory.size()) {
+        if (::munmap(const_cast<char*>(memory.data()), memory.size()) != 0)
+            fprintf(stderr, "bag_sidecar: failed munmap (%m)\n");
+    }
+    memory = {};
+    entries.clear();
+}
+
+result<ok, unix_err> bag_sidecar::open(const std::string& path)
+{
+    close();
+    common::file_handle file;
+    result_try(file.open(path.c_str()));
+    const size_t size = file.size();
+    if (size < sizeof(sidecar_magic) + 2*sizeof(uint32_t) + 5*sizeof(uint64_t))
+        return unix_err{EINVAL};
+
+    void* ptr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, ::fileno(file.file), 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "bag_sidecar: mmap of '%s' failed (%m)\n", path.c_str());
+        return unix_err::current();
+    }
+    memory = common::array_view<const char>{reinterpret_cast<const char*>(ptr), size};
+
+    if (std::memcmp(memory.data(), sidecar_magic, sizeof(sidecar_magic)) != 0) {
+        close();
+        return unix_err{EINVAL};
+    }
+    bag_sidecar_reader rdr{memory};
+    rdr.remaining = memory.advance(sizeof(sidecar_magic));
+    const uint32_t version = rdr.read<uint32_t>();
+    const uint32_t section_count = rdr.read<uint32_t>();
+    m_identity.file_size = rdr.read<uint64_t>();
+    m_identity.chunk_count = rdr.read<uint64_t>();
+    m_identity.connection_count = rdr.read<uint64_t>();
+    m_identity.start_ns = rdr.read<int64_t>();
+    m_identity.end_ns = rdr.read<int64_t>();
+    if (version != sidecar_version) {
+        fprintf(stderr, "bag_sidecar: '%s' has unsupported version %u\n", path.c_str(), version);
+        close();
+        return unix_err{EINVAL};
+    }
+    for (uint32_t i = 0; (i < section_count) && rdr.ok(); ++i) {
+        const common::string_view name = rdr.read_string();
+        const uint64_t bytes = rdr.read<uint64_t>();
+        const common::array_view<const char> data = rdr.read_array<char>(bytes);
+        entries.push_back(entry{name, data});
+    }
+    if (!rdr.ok()) {
+        fprintf(stderr, "bag_sidecar: '%s' is truncated\n", path.c_str());
+        close();
+        return unix_err{EINVAL};
+    }
+    return ok{};
+}
+
+common::array_view<const char> bag_sidecar::section(common::string_view name) const
+{
+    for (const entry& e : entries) {
+        if (e.name == name)
+            return e.bytes;
+    }
+    return {};
+}
+
+std::vector<common::string_view> bag_sidecar::section_names() const
+{
+    std::vector<common::string_view> ret;
+    for (const entry& e : entries)
+        ret.push_back(e.name);
+    return ret;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_SIDECAR_HPP
+#define BAG_SIDECAR_HPP
+
+#include "bag_rdr.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Identifies the bag a sidecar was derived from, so stale
+ * sidecars are ignored after the bag is rewritten.
+ */
+struct bag_sidecar_identity
+{
+    uint64_t file_size = 0;
+    uint64_t chunk_count = 0;
+    uint64_t connection_count = 0;
+    int64_t start_ns = 0;
+    int64_t end_ns = 0;
+
+    static bag_sidecar_identity of(const bag_rdr& rdr);
+    bool operator==(const bag_sidecar_identity& other) const
+    {
+        return (file_size == other.file_size) && (chunk_count == other.chunk_count)
+            && (connection_count == other.connection_count)
+            && (start_ns == other.start_ns) && (end_ns == other.end_ns);
+    }
+    bool operator!=(const bag_sidecar_identity& other) const { return !(*this == other); }
+};
+
+/**
+ * Append-only byte buffer for building sidecar sections,
+ * arrays are padded to 8 bytes so a mapped sidecar
+ * can be read in place.
+ */
+struct bag_sidecar_buffer
+{
+    std::vector<char> bytes;
+
+    template <typename T>
+    void append(const T& value)
+    {
+        const char* p = reinterpret_cast<const char*>(&value);
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+    template <typename T>
+    void append_array(const T* values, size_t count)
+    {
+        const char* p = reinterpret_cast<const char*>(values);
+        bytes.insert(bytes.end(), p, p + sizeof(T) * count);
+        align();
+    }
+    void append_string(common::string_view str)
+    {
+        append(uint32_t(str.size()));
+        bytes.insert(bytes.end(), str.begin(), str.end());
+        align();
+    }
+    void align()
+    {
+        bytes.resize((bytes.size() + 7) & ~size_t(7), '\0');
+    }
+};
+
+/**
+ * Bounds-checked reader over a section, mirroring bag_sidecar_buffer.
+ * Padding is relative to the start of the section.
+ */
+struct bag_sidecar_reader
+{
+    const char* base;
+    common::array_view<const char> remaining;
+    bool failed = false;
+
+    bag_sidecar_reader(common::array_view<const char> section)
+    : base{section.data()}
+    , remaining{section}
+    { }
+
+    template <typename T>
+    T read()
+    {
+        T ret{};
+        if (failed || (remaining.size() < sizeof(T))) {
+            failed = true;
+            return ret;
+        }
+        std::memcpy(&ret, remaining.data(), sizeof(T));
+        remaining = remaining.advance(sizeof(T));
+        return ret;
+    }
+    template <typename T>
+    common::array_view<const T> read_array(size_t count)
+    {
+        // count comes from the file, checked before it can overflow
+        if (failed || (count > remaining.size() / sizeof(T))) {
+            failed = true;
+            return {};
+        }
+        const size_t bytes = sizeof(T) * count;
+        common::array_view<const T> ret {reinterpret_cast<const T*>(remaining.data()), count};
+        skip_aligned(bytes);
+        return ret;
+    }
+    common::string_view read_string()
+    {
+        const uint32_t len = read<uint32_t>();
+        if (failed || (remaining.size() < len)) {
+            failed = true;
+            return {};
+        }
+        common::string_view ret {remaining.head(len)};
+        skip_aligned(len);
+        return ret;
+    }
+    void skip_aligned(size_t bytes)
+    {
+        const size_t offset = (remaining.data() - base) + bytes;
+        const size_t padded = std::min(((offset + 7) & ~size_t(7)) - size_t(remaining.data() - base), remaining.size());
+        remaining = remaining.advance(padded);
+    }
+    bool ok() const { return !failed; }
+};
+
+/**
+ * Named sections written next to a bag, e.g. "my.bag" + ".summary".
+ * Written to a temporary file and renamed into place.
+ */
+struct bag_sidecar_writer
+{
+    struct section
+    {
+        std::string name;
+        std::vector<char> bytes;
+    };
+    std::vector<section> sections;
+
+    void add_section(common::string_view name, std::vector<char> bytes);
+    common::result<common::ok, common::unix_err> write(const std::string& path, const bag_sidecar_identity& identity) const;
+};
+
+/**
+ * Memory-mapped sidecar, sections are only paged in when read.
+ */
+struct bag_sidecar
+{
+    bag_sidecar() = default;
+    bag_sidecar(const bag_sidecar&) = delete;
+    bag_sidecar& operator=(const bag_sidecar&) = delete;
+    ~bag_sidecar();
+
+    common::result<common::ok, common::unix_err> open(const std::string& path);
+    bool is_open() const { return memory.size() != 0; }
+    const bag_sidecar_identity& identity() const { return m_identity; }
+    bool matches(const bag_rdr& rdr) const { return is_open() && (m_identity == bag_sidecar_identity::of(rdr)); }
+
+    // empty if absent
+    common::array_view<const char> section(common::string_view name) const;
+    std::vector<common::string_view> section_names() const;
+
+    // detail
+    void close();
+
+    common::array_view<const char> memory;
+    bag_sidecar_identity m_identity;
+    struct entry
+    {
+        common::string_view name;
+        common::array_view<const char> bytes;
+    };
+    std::vector<entry> entries;
+};
+
+std::string bag_sidecar_path(const bag_rdr& rdr, const char* suffix);
+
+#endif // BAG_SIDECAR_HPP
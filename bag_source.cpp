@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_source.hpp"
+#include "bag_hash.hpp"
+
+#include "common/file_handle.hpp"
+
+#include <sys/mman.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifdef BAG_RDR_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef BAG_RDR_WITH_XZ
+#include <lzma.h>
+#endif
+
+// a compressed file mapped whole, frames are decompressed straight from it
+struct mapped_file
+{
+    common::file_handle file;
+    const char* data = nullptr;
+    size_t size = 0;
+
+    common::result<common::ok, common::unix_err> open(const char* filename)
+    {
+        result_try(file.open(filename));
+        size = file.size();
+        if (!size)
+            return common::unix_err{ERANGE};
+        void* ptr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, ::fileno(file.file), 0);
+        if (ptr == MAP_FAILED) {
+            fprintf(stderr, "bag_rdr: mmap of file '%s' failed (%m)\n", filename);
+            return common::unix_err::current();
+        }
+        data = static_cast<const char*>(ptr);
+        return common::ok{};
+    }
+    ~mapped_file()
+    {
+        if (data)
+            ::munmap(const_cast<char*>(data), size);
+    }
+};
+
+// frames in file order, bag offsets have one more entry for the end
+struct framed_source : bag_source
+{
+    std::string filename;
+    mapped_file file;
+    std::vector<uint64_t> offsets;
+
+    uint64_t size() const override { return offsets.back(); }
+    size_t segment_count() const override { return offsets.size() - 1; }
+    uint64_t segment_offset(size_t i) const override { return offsets[i]; }
+    std::string name() const override { return filename; }
+};
+
+#ifdef BAG_RDR_WITH_ZSTD
+
+static uint32_t s_le32(const char* p)
+{
+    uint32_t ret;
+    memcpy(&ret, p, sizeof(ret));
+    return ret;
+}
+
+struct zstd_source : framed_source
+{
+    struct frame
+    {
+        uint64_t offset;
+        uint64_t size;
+    };
+    std::vector<frame> frames;
+    // XXH64 low 32 bits of each decompressed frame, if the seek table has them
+    std::vector<uint32_t> checksums;
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+
+    ~zstd_source() override { ZSTD_freeDCtx(dctx); }
+
+    bool fill(size_t first, size_t count, char* out) override
+    {
+        for (size_t i = first; i < first + count; ++i) {
+            const size_t size = size_t(offsets[i + 1] - offsets[i]);
+            const size_t got = ZSTD_decompressDCtx(dctx, out, size, file.data + frames[i].offset, size_t(frames[i].size));
+            if (ZSTD_isError(got) || (got != size)) {
+                fprintf(stderr, "bag_rdr: '%s': zstd frame %zu failed to decompress (%s)\n", filename.c_str(), i,
+                        ZSTD_isError(got) ? ZSTD_getErrorName(got) : "short");
+                return false;
+            }
+            if (checksums.size() && (uint32_t(bag_hash::xxh64({out, size})) != checksums[i])) {
+                fprintf(stderr, "bag_rdr: '%s': zstd frame %zu checksum mismatch\n", filename.c_str(), i);
+                return false;
+            }
+            out += size;
+        }
+        return true;
+    }
+
+    void add(uint64_t offset, uint64_t size, uint64_t uncompressed)
+    {
+        frames.push_back(frame{offset, size});
+        offsets.push_back(offsets.back() + uncompressed);
+    }
+
+    /**
+     * The zstd seekable format's table, a skippable frame at the end:
+     * entries of compressed and decompressed size, and optionally a
+     * checksum, then a footer of the entry count, a descriptor byte
+     * and its magic number. false if there is none.
+     */
+    bool read_seek_table()
+    {
+        static const uint32_t seekable_magic = 0x8f92eab1;
+        static const uint32_t skippable_magic = 0x184d2a5e;
+        static const size_t footer_size = 9;
+        if ((file.size < footer_size + 8) || (s_le32(file.data + file.size - 4) != seekable_magic))
+            return false;
+        const uint32_t count = s_le32(file.data + file.size - footer_size);
+        const uint8_t descriptor = uint8_t(file.data[file.size - 5]);
+        const size_t entry_size = (descriptor & 0x80) ? 12 : 8;
+        const uint64_t table_size = uint64_t(count) * entry_size + footer_size;
+        if ((descriptor & 0x7c) || (table_size + 8 > file.size))
+            return false;
+        const char* table = file.data + file.size - table_size - 8;
+        if ((s_le32(table) != skippable_magic) || (s_le32(table + 4) != table_size))
+            return false;
+
+        uint64_t compressed = 0;
+        for (const char* entry = table + 8; entry < table + 8 + uint64_t(count) * entry_size; entry += entry_size) {
+            add(compressed, s_le32(entry), s_le32(entry + 4));
+            if (entry_size == 12)
+                checksums.push_back(s_le32(entry + 8));
+            compressed += s_le32(entry);
+        }
+        return compressed == uint64_t(table - file.data);
+    }
+
+    // any other multi-frame file, from the frame headers
+    bool walk_frames()
+    {
+        for (size_t pos = 0; pos < file.size; ) {
+            const size_t left = file.size - pos;
+            if ((left >= 8) && ((s_le32(file.data + pos) & 0xfffffff0) == 0x184d2a50)) {
+                pos += 8 + size_t(s_le32(file.data + pos + 4));
+                continue;
+            }
+            const size_t size = ZSTD_findFrameCompressedSize(file.data + pos, left);
+            const unsigned long long uncompressed = ZSTD_getFrameContentSize(file.data + pos, left);
+            if (ZSTD_isError(size) || (uncompressed == ZSTD_CONTENTSIZE_ERROR)) {
+                fprintf(stderr, "bag_rdr: '%s': bad zstd frame at offset %zu\n", filename.c_str(), pos);
+                return false;
+            }
+            if (uncompressed == ZSTD_CONTENTSIZE_UNKNOWN) {
+                fprintf(stderr, "bag_rdr: '%s': zstd frame at offset %zu doesn't record its size\n", filename.c_str(), pos);
+                return false;
+            }
+            add(pos, size, uncompressed);
+            pos += size;
+        }
+        return true;
+    }
+};
+
+common::result<common::ok, common::unix_err> bag_source::open_zstd(const char* filename, std::unique_ptr<bag_source>& out)
+{
+    std::unique_ptr<zstd_source> source{new zstd_source};
+    source->filename = filename;
+    source->offsets.assign(1, 0);
+    result_try(source->file.open(filename));
+    if (!source->read_seek_table()) {
+        source->frames.clear();
+        source->checksums.clear();
+        source->offsets.assign(1, 0);
+        if (!source->walk_frames())
+            return common::unix_err{EINVAL};
+    }
+    if (source->frames.size() == 1)
+        fprintf(stderr, "bag_rdr: '%s' is a single zstd frame, it is decompressed whole\n", filename);
+    out = std::move(source);
+    return common::ok{};
+}
+
+#else // BAG_RDR_WITH_ZSTD
+
+common::result<common::ok, common::unix_err> bag_source::open_zstd(const char* filename, std::unique_ptr<bag_source>&)
+{
+    fprintf(stderr, "bag_rdr: '%s': built without zstd\n", filename);
+    return common::unix_err{ENOTSUP};
+}
+
+#endif // BAG_RDR_WITH_ZSTD
+
+#ifdef BAG_RDR_WITH_XZ
+
+struct xz_source : framed_source
+{
+    struct block
+    {
+        uint64_t offset;
+        uint64_t total_size;
+        uint64_t unpadded_size;
+        lzma_check check;
+    };
+    std::vector<block> blocks;
+
+    bool fill(size_t first, size_t count, char* out) override
+    {
+        for (size_t i = first; i < first + count; ++i) {
+            const size_t size = size_t(offsets[i + 1] - offsets[i]);
+            if (!decode(blocks[i], out, size)) {
+                fprintf(stderr, "bag_rdr: '%s': xz block %zu failed to decompress\n", filename.c_str(), i);
+                return false;
+            }
+            out += size;
+        }
+        return true;
+    }
+
+    bool decode(const block& b, char* out, size_t size) const
+    {
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(file.data + b.offset);
+        lzma_filter filters[LZMA_FILTERS_MAX + 1];
+        lzma_block header{};
+        header.version = 1;
+        header.check = b.check;
+        header.filters = filters;
+        header.header_size = lzma_block_header_size_decode(in[0]);
+        if (lzma_block_header_decode(&header, nullptr, in) != LZMA_OK)
+            return false;
+        size_t in_pos = header.header_size, out_pos = 0;
+        const bool ok = (lzma_block_compressed_size(&header, b.unpadded_size) == LZMA_OK)
+                     && (lzma_block_buffer_decode(&header, nullptr, in, &in_pos, b.total_size,
+                                                  reinterpret_cast<uint8_t*>(out), &out_pos, size) == LZMA_OK)
+                     && (out_pos == size);
+        for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+            free(filters[i].options);
+        return ok;
+    }
+
+    // the blocks from the stream indexes at the end of the file
+    bool read_index()
+    {
+        lzma_stream strm = LZMA_STREAM_INIT;
+        lzma_index* index = nullptr;
+        if (lzma_file_info_decoder(&strm, &index, UINT64_MAX, file.size) != LZMA_OK)
+            return false;
+        strm.next_in = reinterpret_cast<const uint8_t*>(file.data);
+        strm.avail_in = file.size;
+        lzma_ret ret;
+        while ((ret = lzma_code(&strm, LZMA_RUN)) == LZMA_SEEK_NEEDED) {
+            strm.next_in = reinterpret_cast<const uint8_t*>(file.data) + strm.seek_pos;
+            strm.avail_in = file.size - strm.seek_pos;
+        }
+        lzma_end(&strm);
+        if (ret != LZMA_STREAM_END) {
+            fprintf(stderr, "bag_rdr: '%s': not a complete xz file (%d)\n", filename.c_str(), int(ret));
+            lzma_index_end(index, nullptr);
+            return false;
+        }
+
+        lzma_index_iter iter;
+        lzma_index_iter_init(&iter, index);
+        while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+            blocks.push_back(block{iter.block.compressed_file_offset, iter.block.total_size,
+                                   iter.block.unpadded_size, lzma_check(iter.stream.flags->check)});
+            offsets.push_back(iter.block.uncompressed_file_offset + iter.block.uncompressed_size);
+        }
+        lzma_index_end(index, nullptr);
+        return true;
+    }
+};
+
+common::result<common::ok, common::unix_err> bag_source::open_xz(const char* filename, std::unique_ptr<bag_source>& out)
+{
+    std::unique_ptr<xz_source> source{new xz_source};
+    source->filename = filename;
+    source->offsets.assign(1, 0);
+    result_try(source->file.open(filename));
+    if (!source->read_index())
+        return common::unix_err{EINVAL};
+    if (source->blocks.size() == 1)
+        fprintf(stderr, "bag_rdr: '%s' is a single xz block, it is decompressed whole\n", filename);
+    out = std::move(source);
+    return common::ok{};
+}
+
+#else // BAG_RDR_WITH_XZ
+
+common::result<common::ok, common::unix_err> bag_source::open_xz(const char* filename, std::unique_ptr<bag_source>&)
+{
+    fprintf(stderr, "bag_rdr: '%s': built without xz\n", filename);
+    return common::unix_err{ENOTSUP};
+}
+
+#endif // BAG_RDR_WITH_XZ
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_SOURCE_HPP
+#define BAG_SOURCE_HPP
+
+#include "common/common_result.hpp"
+#include "common/unix_err.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * Produces a bag's bytes on demand, for bags that aren't plain files,
+ * see bag_rdr::open_source. The bag is split into consecutive segments,
+ * e.g. compressed frames, which are filled whole the first time any of
+ * their bytes are needed. Opening reads the segments holding the record
+ * headers and index; messages then only fill the segments of the chunks
+ * they are in.
+ */
+struct bag_source
+{
+    virtual ~bag_source() = default;
+
+    // of the bag
+    virtual uint64_t size() const = 0;
+    virtual size_t segment_count() const = 0;
+    // segment i spans [segment_offset(i), segment_offset(i + 1)), up to size()
+    virtual uint64_t segment_offset(size_t i) const = 0;
+    /**
+     * Write segments [first, first + count) contiguously to out. Called
+     * from one thread at a time, for runs of segments not yet filled.
+     */
+    virtual bool fill(size_t first, size_t count, char* out) = 0;
+    // for messages and bag_rdr::filename()
+    virtual std::string name() const = 0;
+
+    /**
+     * Whole-file compressed bags. zstd files are split at their frames,
+     * from a seekable format seek table when present or else by walking
+     * the frame headers; xz files at their blocks. Either way only one
+     * frame is decompressed per fill, so files written as a single frame
+     * or block can't be read partially. Need a build with zstd or xz.
+     */
+    static common::result<common::ok, common::unix_err> open_zstd(const char* filename, std::unique_ptr<bag_source>& out);
+    static common::result<common::ok, common::unix_err> open_xz(const char* filename, std::unique_ptr<bag_source>& out);
+
+    struct http_options
+    {
+        // most chunk bytes fetched per request
+        size_t segment_size = size_t(4) << 20;
+        // index ranges fetched at open are merged across gaps up to this
+        size_t merge_gap = size_t(64) << 10;
+        /**
+         * If set, a sparse file holding every range fetched, with its
+         * list of ranges in cache_path + ".ranges". Later opens of an
+         * unchanged bag, by size and ETag, read those ranges from it.
+         */
+        std::string cache_path;
+        int timeout_ms = 30000;
+    };
+    /**
+     * A bag on an HTTP server, read with Range requests. Opening fetches
+     * the bag header and the index section at the end of the bag, then
+     * the few bytes around each chunk boundary holding the chunk headers
+     * and their index data, merged into as few ranges as possible and
+     * pipelined. Segments are otherwise aligned to chunks, so a view only
+     * fetches the chunks it reads, adjacent unfetched segments in one
+     * request. Plain http only.
+     */
+    static common::result<common::ok, common::unix_err> open_http(const char* url, const http_options& opts,
+                                                                   std::unique_ptr<bag_source>& out);
+};
+
+#endif // BAG_SOURCE_HPP
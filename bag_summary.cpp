@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_summary.hpp"
+#pragma GCC diagnostic pop
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+using common::result;
+using common::ok;
+using common::unix_err;
+
+static const char* const section_prefix = "summary:";
+
+static void s_storage_resize(bag_summary::storage& s, size_t count)
+{
+    s.min.assign(count, std::numeric_limits<double>::infinity());
+    s.max.assign(count, -std::numeric_limits<double>::infinity());
+    s.sum.assign(count, 0);
+    s.count.assign(count, 0);
+}
+
+static void s_storage_add(bag_summary::storage& s, size_t i, double min, double max, double sum, uint32_t count)
+{
+    s.min[i] = std::min(s.min[i], min);
+    s.max[i] = std::max(s.max[i], max);
+    s.sum[i] += sum;
+    s.count[i] += count;
+}
+
+namespace {
+
+struct sample
+{
+    uint32_t bucket;
+    double value;
+};
+
+}
+
+bool bag_summary::build(const bag_rdr& rdr, const std::vector<field_spec>& fields, options opts)
+{
+    m_series.clear();
+    m_storage.clear();
+    m_sidecar.close();
+
+    const int64_t start_ns = bag_rdr::stamp_to_ns(rdr.start_timestamp());
+    const int64_t end_ns = bag_rdr::stamp_to_ns(rdr.end_timestamp());
+    if (!rdr.chunk_count() || (end_ns < start_ns))
+        return false;
+    const int64_t duration = end_ns - start_ns + 1;
+    const int64_t bucket_count_hint = std::max<int64_t>(1, opts.base_bucket_count);
+    const int64_t base_ns = (opts.base_bucket_ns > 0) ? opts.base_bucket_ns
+                          : std::max<int64_t>(std::max<int64_t>(1, opts.min_bucket_ns), (duration + bucket_count_hint - 1) / bucket_count_hint);
+    const size_t base_count = size_t((duration + base_ns - 1) / base_ns);
+    const uint32_t fanout = std::max<uint32_t>(2, opts.fanout);
+
+    bag_connection_fields conns;
+    const std::vector<bool> field_resolved = conns.resolve(rdr, fields, [] (const bag_field_accessor& a) { return a.is_numeric(); });
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (!field_resolved[i])
+            fprintf(stderr, "bag_summary: '%s' has no numeric field '%s'\n", fields[i].topic.c_str(), fields[i].field.c_str());
+    }
+
+    std::vector<storage> base(fields.size());
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (field_resolved[i])
+            s_storage_resize(base[i], base_count);
+    }
+
+    std::mutex merge_lock;
+    rdr.parallel_for_chunks(opts.threads, [&] (size_t chunk_index) {
+        if (!conns.any_in(rdr.get_chunk_summary(chunk_index).connection_ids))
+            return;
+
+        std::vector<char> buffer;
+        std::vector<std::vector<sample>> samples(fields.size());
+        rdr.for_each_chunk_message(chunk_index, buffer, [&] (const bag_rdr::chunk_message& msg) {
+            const int64_t offset = std::min(std::max<int64_t>(bag_rdr::stamp_to_ns(msg.stamp) - start_ns, 0), duration - 1);
+            const uint32_t bucket = uint32_t(offset / base_ns);
+            for (const auto& field_accessor : conns[msg.connection_id].accessors) {
+                double value;
+                if (field_accessor.second.read_double(msg.data, value) && !std::isnan(value))
+                    samples[field_accessor.first].push_back(sample{bucket, value});
+            }
+        });
+
+        for (size_t i = 0; i < fields.size(); ++i) {
+            std::vector<sample>& s = samples[i];
+            if (s.empty())
+                continue;
+            std::stable_sort(s.begin(), s.end(), [] (const sample& a, const sample& b) { return a.bucket < b.bucket; });
+            std::lock_guard<std::mutex> guard{merge_lock};
+            for (size_t begin = 0; begin < s.size(); ) {
+                size_t end = begin;
+                double min = s[begin].value, max = s[begin].value, sum = 0;
+                for (; (end < s.size()) && (s[end].bucket == s[begin].bucket); ++end) {
+                    min = std::min(min, s[end].value);
+                    max = std::max(max, s[end].value);
+                    sum += s[end].value;
+                }
+                s_storage_add(base[i], s[begin].bucket, min, max, sum, uint32_t(end - begin));
+                begin = end;
+            }
+        }
+    });
+
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (field_resolved[i])
+            add_series(fields[i].topic, fields[i].field, start_ns, base_ns, fanout, std::move(base[i]));
+    }
+    return m_series.size() != 0;
+}
+
+void bag_summary::add_series(std::string topic, std::string field, int64_t start_ns, int64_t base_ns, uint32_t fanout, storage base)
+{
+    std::vector<storage> levels;
+    levels.emplace_back(std::move(base));
+    while (levels.back().count.size() > 1) {
+        const storage& below = levels.back();
+        storage above;
+        s_storage_resize(above, (below.count.size() + fanout - 1) / fanout);
+        for (size_t i = 0; i < below.count.size(); ++i) {
+            if (below.count[i])
+                s_storage_add(above, i / fanout, below.min[i], below.max[i], below.sum[i], below.count[i]);
+        }
+        levels.emplace_back(std::move(above));
+    }
+
+    series s {std::move(topic), std::move(field), start_ns, fanout, {}};
+    int64_t bucket_ns = base_ns;
+    for (storage& l : levels) {
+        m_storage.emplace_back(std::move(l));
+        const storage& owned = m_storage.back();
+        s.levels.push_back(level{bucket_ns, owned.min, owned.max, owned.sum, owned.count});
+        bucket_ns *= fanout;
+    }
+    m_series.emplace_back(std::move(s));
+}
+
+result<ok, unix_err> bag_summary::write(const std::string& path, const bag_sidecar_identity& identity) const
+{
+    bag_sidecar_writer writer;
+    for (const series& s : m_series) {
+        bag_sidecar_buffer buf;
+        buf.append_string(s.topic);
+        buf.append_string(s.field);
+        buf.append(s.start_ns);
+        buf.append(s.fanout);
+        buf.append(uint32_t(s.levels.size()));
+        for (const level& l : s.levels) {
+            buf.append(l.bucket_ns);
+            buf.append(uint64_t(l.size()));
+            buf.append_array(l.min.data(), l.size());
+            buf.append_array(l.max.data(), l.size());
+            buf.append_array(l.sum.data(), l.size());
+            buf.append_array(l.count.data(), l.size());
+        }
+        writer.add_section(section_prefix + s.topic + ":" + s.field, std::move(buf.bytes));
+    }
+    return writer.write(path, identity);
+}
+
+result<ok, unix_err> bag_summary::write(const bag_rdr& rdr) const
+{
+    return write(bag_sidecar_path(rdr, sidecar_suffix()), bag_sidecar_identity::of(rdr));
+}
+
+result<ok, unix_err> bag_summary::open(const bag_rdr& rdr)
+{
+    result_try(open(bag_sidecar_path(rdr, sidecar_suffix())));
+    if (!m_sidecar.matches(rdr)) {
+        fprintf(stderr, "bag_summary: sidecar for '%s' is stale\n", rdr.filename().c_str());
+        m_series.clear();
+        m_sidecar.close();
+        return unix_err{ESTALE};
+    }
+    return ok{};
+}
+
+result<ok, unix_err> bag_summary::open(const std::string& path)
+{
+    m_series.clear();
+    m_storage.clear();
+    result_try(m_sidecar.open(path));
+
+    for (const common::string_view name : m_sidecar.section_names()) {
+        if (!name.begins_with(section_prefix))
+            continue;
+        bag_sidecar_reader rdr{m_sidecar.section(name)};
+        series s;
+        s.topic = rdr.read_string().to_string();
+        s.field = rdr.read_string().to_string();
+        s.start_ns = rdr.read<int64_t>();
+        s.fanout = rdr.read<uint32_t>();
+        const uint32_t level_count = rdr.read<uint32_t>();
+        for (uint32_t i = 0; (i < level_count) && rdr.ok(); ++i) {
+            level l;
+            l.bucket_ns = rdr.read<int64_t>();
+            const size_t count = rdr.read<uint64_t>();
+            l.min = rdr.read_array<double>(count);
+            l.max = rdr.read_array<double>(count);
+            l.sum = rdr.read_array<double>(count);
+            l.count = rdr.read_array<uint32_t>(count);
+            s.levels.push_back(l);
+        }
+        if (!rdr.ok() || s.levels.empty()) {
+            fprintf(stderr, "bag_summary: malformed section '%.*s' in '%s'\n", name.sizei(), name.data(), path.c_str());
+            continue;
+        }
+        m_series.emplace_back(std::move(s));
+    }
+    return ok{};
+}
+
+const bag_summary::series* bag_summary::find(common::string_view topic, common::string_view field) const
+{
+    for (const series& s : m_series) {
+        if ((topic == common::string_view{s.topic}) && (field == common::string_view{s.field}))
+            return &s;
+    }
+    return nullptr;
+}
+
+std::vector<bag_summary::bucket> bag_summary::query(const series& s, common::timestamp start, common::timestamp end, size_t max_points) const
+{
+    std::vector<bucket> ret;
+    if (s.levels.empty())
+        return ret;
+    const int64_t start_offset = std::max<int64_t>(bag_rdr::stamp_to_ns(start) - s.start_ns, 0);
+    const int64_t end_offset = bag_rdr::stamp_to_ns(end) - s.start_ns;
+    if (end_offset < start_offset)
+        return ret;
+
+    const level* chosen = &s.levels.back();
+    size_t first = 0, last = 0;
+    for (const level& l : s.levels) {
+        first = size_t(start_offset / l.bucket_ns);
+        last = std::min(size_t(end_offset / l.bucket_ns), l.size() - 1);
+        if ((first <= last) && (last - first + 1 <= max_points)) {
+            chosen = &l;
+            break;
+        }
+    }
+    first = size_t(start_offset / chosen->bucket_ns);
+    last = std::min(size_t(end_offset / chosen->bucket_ns), chosen->size() - 1);
+    for (size_t i = first; i <= last; ++i) {
+        if (!chosen->count[i])
+            continue;
+        ret.push_back(bucket{s.start_ns + int64_t(i) * chosen->bucket_ns,
+                             chosen->min[i], chosen->max[i],
+                             chosen->sum[i] / chosen->count[i],
+                             chosen->count[i]});
+    }
+    return ret;
+}
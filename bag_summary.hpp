@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_SUMMARY_HPP
+#define BAG_SUMMARY_HPP
+
+#include "bag_fields.hpp"
+#include "bag_rdr.hpp"
+#include "bag_sidecar.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ * Min/max/mean of numeric message fields per time bucket, at
+ * several resolutions, for plotting long bags without iterating
+ * every message. Built in a chunk-parallel pass and persisted
+ * in a ".summary" sidecar next to the bag.
+ *
+ * Level 0 has the finest buckets, each next level merges
+ * `fanout` buckets of the one below, up to a single bucket.
+ */
+struct bag_summary
+{
+    struct options
+    {
+        // 0 chooses base_bucket_count buckets over the bag duration,
+        // no finer than min_bucket_ns
+        int64_t base_bucket_ns = 0;
+        uint32_t base_bucket_count = 65536;
+        int64_t min_bucket_ns = 1000000;
+        uint32_t fanout = 4;
+        unsigned threads = 0;
+    };
+    using field_spec = bag_field_spec;
+    struct bucket
+    {
+        int64_t start_ns;
+        double min, max, mean;
+        uint32_t count;
+    };
+    struct level
+    {
+        int64_t bucket_ns;
+        common::array_view<const double> min, max, sum;
+        common::array_view<const uint32_t> count;
+        size_t size() const { return count.size(); }
+    };
+    struct series
+    {
+        std::string topic, field;
+        int64_t start_ns;
+        uint32_t fanout;
+        std::vector<level> levels;
+    };
+
+    static const char* sidecar_suffix() { return ".summary"; }
+
+    bool build(const bag_rdr& rdr, const std::vector<field_spec>& fields, options opts);
+    bool build(const bag_rdr& rdr, const std::vector<field_spec>& fields) { return build(rdr, fields, options{}); }
+    common::result<common::ok, common::unix_err> write(const std::string& path, const bag_sidecar_identity& identity) const;
+    common::result<common::ok, common::unix_err> write(const bag_rdr& rdr) const;
+    /**
+     * Open the sidecar of rdr, failing with ESTALE if it was
+     * derived from a different version of the bag.
+     */
+    common::result<common::ok, common::unix_err> open(const bag_rdr& rdr);
+    common::result<common::ok, common::unix_err> open(const std::string& path);
+
+    const series* find(common::string_view topic, common::string_view field) const;
+    /**
+     * Buckets overlapping [start, end] from the finest level with at most
+     * max_points buckets in that range, empty buckets are omitted.
+     */
+    std::vector<bucket> query(const series& s, common::timestamp start, common::timestamp end, size_t max_points) const;
+
+    const std::vector<series>& all_series() const { return m_series; }
+
+    // detail
+    struct storage
+    {
+        std::vector<double> min, max, sum;
+        std::vector<uint32_t> count;
+    };
+    void add_series(std::string topic, std::string field, int64_t start_ns, int64_t base_ns, uint32_t fanout, storage base);
+
+    std::vector<series> m_series;
+    // owned level arrays when built rather than opened
+    std::vector<storage> m_storage;
+    bag_sidecar m_sidecar;
+};
+
+#endif // BAG_SUMMARY_HPP
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_text_index.hpp"
+#pragma GCC diagnostic pop
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+
+using common::result;
+using common::ok;
+using common::unix_err;
+
+static const char* const section_prefix = "text:";
+
+static bool s_token_char(char c)
+{
+    return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) || (c == '_');
+}
+
+static std::string s_lower(common::string_view str)
+{
+    std::string ret = str.to_string();
+    for (char& c : ret) {
+        if ((c >= 'A') && (c <= 'Z'))
+            c = char(c - 'A' + 'a');
+    }
+    return ret;
+}
+
+void bag_text_index::tokenise(common::string_view text, uint32_t max_token_length,
+                              const std::function<void (common::string_view token)>& fn)
+{
+    const char* p = text.data();
+    const char* const end = p + text.size();
+    while (p != end) {
+        if (!s_token_char(*p)) {
+            ++p;
+            continue;
+        }
+        const char* const begin = p;
+        while ((p != end) && s_token_char(*p))
+            ++p;
+        if (size_t(p - begin) <= max_token_length)
+            fn(common::string_view{begin, size_t(p - begin)});
+    }
+}
+
+using postings_map = std::unordered_map<std::string, std::vector<bag_text_index::position>>;
+
+bool bag_text_index::build(const bag_rdr& rdr, const std::vector<field_spec>& fields, options opts)
+{
+    m_indices.clear();
+    m_storage.clear();
+    m_sidecar.close();
+    if (!rdr.chunk_count())
+        return false;
+
+    bag_connection_fields conns;
+    const std::vector<bool> field_resolved = conns.resolve(rdr, fields, [] (const bag_field_accessor& a) {
+        return a.leaf_type() == bag_msg_schema::prim::STRING;
+    });
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (!field_resolved[i])
+            fprintf(stderr, "bag_text_index: '%s' has no string field '%s'\n", fields[i].topic.c_str(), fields[i].field.c_str());
+    }
+
+    std::vector<postings_map> merged(fields.size());
+    std::mutex merge_lock;
+    rdr.parallel_for_chunks(opts.threads, [&] (size_t chunk_index) {
+        if (!conns.any_in(rdr.get_chunk_summary(chunk_index).connection_ids))
+            return;
+        std::vector<char> buffer;
+        std::vector<postings_map> local(fields.size());
+        rdr.for_each_chunk_message(chunk_index, buffer, [&] (const bag_rdr::chunk_message& msg) {
+            const position pos{uint32_t(chunk_index), msg.offset};
+            for (const auto& field_accessor : conns[msg.connection_id].accessors) {
+                common::string_view text;
+                if (!field_accessor.second.read_string(msg.data, text))
+                    continue;
+                postings_map& map = local[field_accessor.first];
+                tokenise(text, opts.max_token_length, [&] (common::string_view token) {
+                    std::vector<position>& postings = map[s_lower(token)];
+                    if (postings.empty() || !(postings.back() == pos))
+                        postings.push_back(pos);
+                });
+            }
+        });
+
+        std::lock_guard<std::mutex> guard{merge_lock};
+        for (size_t i = 0; i < fields.size(); ++i) {
+            for (auto& token_postings : local[i]) {
+                std::vector<position>& into = merged[i][token_postings.first];
+                into.insert(into.end(), token_postings.second.begin(), token_postings.second.end());
+            }
+        }
+    });
+
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (!field_resolved[i])
+            continue;
+        std::vector<std::pair<std::string, std::vector<position>>> sorted(std::make_move_iterator(merged[i].begin()),
+                                                                          std::make_move_iterator(merged[i].end()));
+        merged[i].clear();
+        std::sort(sorted.begin(), sorted.end(), [] (const auto& a, const auto& b) { return a.first < b.first; });
+
+        storage s;
+        s.token_starts.push_back(0);
+        s.posting_starts.push_back(0);
+        for (auto& token_postings : sorted) {
+            std::vector<position>& postings = token_postings.second;
+            // chunks are merged in completion order
+            std::sort(postings.begin(), postings.end());
+            s.token_bytes.insert(s.token_bytes.end(), token_postings.first.begin(), token_postings.first.end());
+            s.token_starts.push_back(s.token_bytes.size());
+            s.postings.insert(s.postings.end(), postings.begin(), postings.end());
+            s.posting_starts.push_back(s.postings.size());
+        }
+        m_storage.emplace_back(std::move(s));
+        const storage& owned = m_storage.back();
+        m_indices.push_back(index{fields[i].topic, fields[i].field, owned.token_starts, owned.token_bytes, owned.posting_starts, owned.postings});
+    }
+    return m_indices.size() != 0;
+}
+
+result<ok, unix_err> bag_text_index::write(const std::string& path, const bag_sidecar_identity& identity) const
+{
+    bag_sidecar_writer writer;
+    for (const index& idx : m_indices) {
+        bag_sidecar_buffer buf;
+        buf.append_string(idx.topic);
+        buf.append_string(idx.field);
+        buf.append(uint64_t(idx.token_count()));
+        buf.append(uint64_t(idx.postings.size()));
+        buf.append(uint64_t(idx.token_bytes.size()));
+        buf.append_array(idx.token_starts.data(), idx.token_starts.size());
+        buf.append_array(idx.token_bytes.data(), idx.token_bytes.size());
+        buf.append_array(idx.posting_starts.data(), idx.posting_starts.size());
+        buf.append_array(idx.postings.data(), idx.postings.size());
+        writer.add_section(section_prefix + idx.topic + ":" + idx.field, std::move(buf.bytes));
+    }
+    return writer.write(path, identity);
+}
+
+result<ok, unix_err> bag_text_index::write(const bag_rdr& rdr) const
+{
+    return write(bag_sidecar_path(rdr, sidecar_suffix()), bag_sidecar_identity::of(rdr));
+}
+
+result<ok, unix_err> bag_text_index::open(const bag_rdr& rdr)
+{
+    result_try(open(bag_sidecar_path(rdr, sidecar_suffix())));
+    if (!m_sidecar.matches(rdr)) {
+        fprintf(stderr, "bag_text_index: sidecar for '%s' is stale\n", rdr.filename().c_str());
+        m_indices.clear();
+        m_sidecar.close();
+        return unix_err{ESTALE};
+    }
+    return ok{};
+}
+
+// offsets read from a sidecar, token_count + 1 of them rising to total
+static bool s_offsets_valid(common::array_view<const uint64_t> starts, size_t token_count, uint64_t total)
+{
+    return !starts.empty() && (starts.size() - 1 == token_count) && (starts[token_count] == total)
+        && std::is_sorted(starts.begin(), starts.end());
+}
+
+result<ok, unix_err> bag_text_index::open(const std::string& path)
+{
+    m_indices.clear();
+    m_storage.clear();
+    result_try(m_sidecar.open(path));
+
+    for (const common::string_view name : m_sidecar.section_names()) {
+        if (!name.begins_with(section_prefix))
+            continue;
+        bag_sidecar_reader rdr{m_sidecar.section(name)};
+        index idx;
+        idx.topic = rdr.read_string().to_string();
+        idx.field = rdr.read_string().to_string();
+        const size_t token_count = rdr.read<uint64_t>();
+        const size_t posting_count = rdr.read<uint64_t>();
+        const size_t byte_count = rdr.read<uint64_t>();
+        idx.token_starts = rdr.read_array<uint64_t>(token_count + 1);
+        idx.token_bytes = rdr.read_array<char>(byte_count);
+        idx.posting_starts = rdr.read_array<uint64_t>(token_count + 1);
+        idx.postings = rdr.read_array<position>(posting_count);
+        const bool consistent = rdr.ok() && s_offsets_valid(idx.token_starts, token_count, byte_count)
+                             && s_offsets_valid(idx.posting_starts, token_count, posting_count);
+        if (!consistent) {
+            fprintf(stderr, "bag_text_index: malformed section '%.*s' in '%s'\n", name.sizei(), name.data(), path.c_str());
+            continue;
+        }
+        m_indices.emplace_back(std::move(idx));
+    }
+    return ok{};
+}
+
+const bag_text_index::index* bag_text_index::find(common::string_view topic, common::string_view field) const
+{
+    for (const index& idx : m_indices) {
+        if ((topic == common::string_view{idx.topic}) && (field == common::string_view{idx.field}))
+            return &idx;
+    }
+    return nullptr;
+}
+
+// first token not less than str
+static size_t s_lower_bound(const bag_text_index::index& idx, const std::string& str)
+{
+    size_t lo = 0, hi = idx.token_count();
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const common::string_view token = idx.token(mid);
+        const int cmp = std::memcmp(token.data(), str.data(), std::min(token.size(), str.size()));
+        if ((cmp < 0) || ((cmp == 0) && (token.size() < str.size())))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+std::vector<bag_text_index::position> bag_text_index::find_token(const index& idx, common::string_view token) const
+{
+    const std::string lowered = s_lower(token);
+    const size_t i = s_lower_bound(idx, lowered);
+    if ((i == idx.token_count()) || (idx.token(i) != common::string_view{lowered}))
+        return {};
+    return {idx.postings.begin() + idx.posting_starts[i], idx.postings.begin() + idx.posting_starts[i + 1]};
+}
+
+std::vector<bag_text_index::position> bag_text_index::find_prefix(const index& idx, common::string_view prefix) const
+{
+    const std::string lowered = s_lower(prefix);
+    std::vector<position> ret;
+    for (size_t i = s_lower_bound(idx, lowered); (i < idx.token_count()) && idx.token(i).begins_with(lowered); ++i)
+        ret.insert(ret.end(), idx.postings.begin() + idx.posting_starts[i], idx.postings.begin() + idx.posting_starts[i + 1]);
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+std::vector<bag_text_index::position> bag_text_index::search(const index& idx, common::string_view query) const
+{
+    std::vector<position> ret;
+    bool first = true;
+    const char* p = query.data();
+    const char* const end = p + query.size();
+    while (p != end) {
+        if (!s_token_char(*p)) {
+            ++p;
+            continue;
+        }
+        const char* const begin = p;
+        while ((p != end) && s_token_char(*p))
+            ++p;
+        const common::string_view token{begin, size_t(p - begin)};
+        const bool prefix = (p != end) && (*p == '*');
+        std::vector<position> matches = prefix ? find_prefix(idx, token) : find_token(idx, token);
+        if (first) {
+            ret = std::move(matches);
+            first = false;
+        } else {
+            std::vector<position> both;
+            std::set_intersection(ret.begin(), ret.end(), matches.begin(), matches.end(), std::back_inserter(both));
+            ret = std::move(both);
+        }
+        if (ret.empty())
+            break;
+    }
+    return ret;
+}
+
+std::vector<bag_text_index::position> bag_text_index::search(common::string_view topic, common::string_view field, common::string_view query) const
+{
+    const index* idx = find(topic, field);
+    return idx ? search(*idx, query) : std::vector<position>{};
+}
+
+bool bag_text_index::fetch(const bag_rdr& rdr, const std::vector<position>& positions,
+                           const std::function<void (const bag_rdr::chunk_message& msg)>& fn)
+{
+    std::vector<char> buffer;
+    std::vector<uint32_t> offsets;
+    for (size_t begin = 0; begin < positions.size(); ) {
+        const uint32_t chunk_index = positions[begin].chunk_index;
+        offsets.clear();
+        size_t end = begin;
+        for (; (end < positions.size()) && (positions[end].chunk_index == chunk_index); ++end)
+            offsets.push_back(positions[end].offset);
+        if (!rdr.for_each_chunk_message_at(chunk_index, offsets, buffer, fn))
+            return false;
+        begin = end;
+    }
+    return true;
+}
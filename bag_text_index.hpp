@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_TEXT_INDEX_HPP
+#define BAG_TEXT_INDEX_HPP
+
+#include "bag_fields.hpp"
+#include "bag_rdr.hpp"
+#include "bag_sidecar.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ * Inverted index from tokens of string fields, such as the msg and
+ * name of rosgraph_msgs/Log on /rosout, to the messages holding them.
+ * Built in a chunk-parallel pass and persisted in a ".text" sidecar,
+ * so searching a bag only decompresses the chunks with hits.
+ *
+ * Tokens are maximal runs of ASCII letters, digits and '_', lower cased.
+ */
+struct bag_text_index
+{
+    struct options
+    {
+        // longer tokens are not indexed
+        uint32_t max_token_length = 64;
+        unsigned threads = 0;
+    };
+    using field_spec = bag_field_spec;
+    // bag_rdr::chunk_message location, for bag_rdr::for_each_chunk_message_at
+    struct position
+    {
+        uint32_t chunk_index;
+        uint32_t offset;
+        bool operator<(const position& other) const
+        {
+            return (chunk_index < other.chunk_index) || ((chunk_index == other.chunk_index) && (offset < other.offset));
+        }
+        bool operator==(const position& other) const { return (chunk_index == other.chunk_index) && (offset == other.offset); }
+    };
+    struct index
+    {
+        std::string topic, field;
+        // sorted tokens, the postings of token i are
+        // postings[posting_starts[i] .. posting_starts[i + 1]]
+        common::array_view<const uint64_t> token_starts;
+        common::array_view<const char> token_bytes;
+        common::array_view<const uint64_t> posting_starts;
+        common::array_view<const position> postings;
+        size_t token_count() const { return posting_starts.size() ? posting_starts.size() - 1 : 0; }
+        common::string_view token(size_t i) const
+        {
+            return common::string_view{token_bytes.data() + token_starts[i], size_t(token_starts[i + 1] - token_starts[i])};
+        }
+    };
+
+    static const char* sidecar_suffix() { return ".text"; }
+    static std::vector<field_spec> rosout_fields() { return {{"/rosout", "msg"}, {"/rosout", "name"}}; }
+
+    bool build(const bag_rdr& rdr, const std::vector<field_spec>& fields, options opts);
+    bool build(const bag_rdr& rdr, const std::vector<field_spec>& fields) { return build(rdr, fields, options{}); }
+    common::result<common::ok, common::unix_err> write(const std::string& path, const bag_sidecar_identity& identity) const;
+    common::result<common::ok, common::unix_err> write(const bag_rdr& rdr) const;
+    /**
+     * Open the sidecar of rdr, failing with ESTALE if it was
+     * derived from a different version of the bag.
+     */
+    common::result<common::ok, common::unix_err> open(const bag_rdr& rdr);
+    common::result<common::ok, common::unix_err> open(const std::string& path);
+
+    const index* find(common::string_view topic, common::string_view field) const;
+    const std::vector<index>& all_indices() const { return m_indices; }
+
+    // sorted positions of messages with the token, or a token starting with prefix
+    std::vector<position> find_token(const index& idx, common::string_view token) const;
+    std::vector<position> find_prefix(const index& idx, common::string_view prefix) const;
+    /**
+     * Messages matching every token of query, a token ending in '*'
+     * matches as a prefix, e.g. "lidar timeout*".
+     */
+    std::vector<position> search(const index& idx, common::string_view query) const;
+    std::vector<position> search(common::string_view topic, common::string_view field, common::string_view query) const;
+
+    // visit the messages at positions, decompressing each chunk once
+    static bool fetch(const bag_rdr& rdr, const std::vector<position>& positions,
+                      const std::function<void (const bag_rdr::chunk_message& msg)>& fn);
+
+    static void tokenise(common::string_view text, uint32_t max_token_length,
+                         const std::function<void (common::string_view token)>& fn);
+
+    // detail
+    struct storage
+    {
+        std::vector<uint64_t> token_starts;
+        std::vector<char> token_bytes;
+        std::vector<uint64_t> posting_starts;
+        std::vector<position> postings;
+    };
+
+    std::vector<index> m_indices;
+    // owned index arrays when built rather than opened
+    std::vector<storage> m_storage;
+    bag_sidecar m_sidecar;
+};
+
+#endif // BAG_TEXT_INDEX_HPP
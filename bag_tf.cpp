@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-copy"
+#include "bag_tf.hpp"
+#pragma GCC diagnostic pop
+
+#include "bag_payload.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+static const char* const tf_message_md5 = "94810edda583a504dfda3829e70d7eec";
+
+static void quat_mul(const double* a, const double* b, double* out)
+{
+    const double x = a[3]*b[0] + a[0]*b[3] + a[1]*b[2] - a[2]*b[1];
+    const double y = a[3]*b[1] - a[0]*b[2] + a[1]*b[3] + a[2]*b[0];
+    const double z = a[3]*b[2] + a[0]*b[1] - a[1]*b[0] + a[2]*b[3];
+    const double w = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+    out[0] = x; out[1] = y; out[2] = z; out[3] = w;
+}
+
+static void quat_rotate(const double* q, const double* v, double* out)
+{
+    // v' = v + 2w(q x v) + 2q x (q x v)
+    const double cx = q[1]*v[2] - q[2]*v[1];
+    const double cy = q[2]*v[0] - q[0]*v[2];
+    const double cz = q[0]*v[1] - q[1]*v[0];
+    const double ccx = q[1]*cz - q[2]*cy;
+    const double ccy = q[2]*cx - q[0]*cz;
+    const double ccz = q[0]*cy - q[1]*cx;
+    out[0] = v[0] + 2*(q[3]*cx + ccx);
+    out[1] = v[1] + 2*(q[3]*cy + ccy);
+    out[2] = v[2] + 2*(q[3]*cz + ccz);
+}
+
+static void quat_slerp(const double* a, const double* b, double ratio, double* out)
+{
+    double bb[4] = {b[0], b[1], b[2], b[3]};
+    double dot = a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+    if (dot < 0) {
+        dot = -dot;
+        for (double& c : bb)
+            c = -c;
+    }
+    double wa = 1 - ratio, wb = ratio;
+    if (dot < 0.9995) {
+        const double theta = std::acos(dot);
+        const double sin_theta = std::sin(theta);
+        wa = std::sin((1 - ratio) * theta) / sin_theta;
+        wb = std::sin(ratio * theta) / sin_theta;
+    }
+    double norm = 0;
+    for (int i = 0; i < 4; ++i) {
+        out[i] = wa*a[i] + wb*bb[i];
+        norm += out[i]*out[i];
+    }
+    norm = std::sqrt(norm);
+    for (int i = 0; i < 4; ++i)
+        out[i] /= norm;
+}
+
+bag_tf_store::transform bag_tf_store::transform::inverse() const
+{
+    transform ret;
+    ret.rotation[0] = -rotation[0];
+    ret.rotation[1] = -rotation[1];
+    ret.rotation[2] = -rotation[2];
+    ret.rotation[3] = rotation[3];
+    double t[3];
+    quat_rotate(ret.rotation, translation, t);
+    ret.translation[0] = -t[0];
+    ret.translation[1] = -t[1];
+    ret.translation[2] = -t[2];
+    return ret;
+}
+
+bag_tf_store::transform bag_tf_store::transform::operator*(const transform& other) const
+{
+    transform ret;
+    quat_mul(rotation, other.rotation, ret.rotation);
+    quat_rotate(rotation, other.translation, ret.translation);
+    for (int i = 0; i < 3; ++i)
+        ret.translation[i] += translation[i];
+    return ret;
+}
+
+bag_tf_store::transform bag_tf_store::edge::at(size_t i) const
+{
+    transform ret;
+    ret.translation[0] = tx[i];
+    ret.translation[1] = ty[i];
+    ret.translation[2] = tz[i];
+    ret.rotation[0] = qx[i];
+    ret.rotation[1] = qy[i];
+    ret.rotation[2] = qz[i];
+    ret.rotation[3] = qw[i];
+    return ret;
+}
+
+bool bag_tf_store::edge::lookup(timestamp stamp, transform& out) const
+{
+    if (!size())
+        return false;
+    if (is_static) {
+        out = at(size() - 1);
+        return true;
+    }
+    const int64_t t = bag_rdr::stamp_to_ns(stamp);
+    auto it = std::lower_bound(stamps_ns.begin(), stamps_ns.end(), t);
+    if (it == stamps_ns.end())
+        return false;
+    const size_t upper = std::distance(stamps_ns.begin(), it);
+    if (*it == t) {
+        out = at(upper);
+        return true;
+    }
+    if (upper == 0)
+        return false;
+    const size_t lower = upper - 1;
+    const double ratio = double(t - stamps_ns[lower]) / double(stamps_ns[upper] - stamps_ns[lower]);
+    const transform a = at(lower), b = at(upper);
+    for (int i = 0; i < 3; ++i)
+        out.translation[i] = a.translation[i] + ratio * (b.translation[i] - a.translation[i]);
+    quat_slerp(a.rotation, b.rotation, ratio, out.rotation);
+    return true;
+}
+
+static common::string_view strip_frame(common::string_view frame)
+{
+    // tf2 drops the leading slash of tf1 style frame ids
+    if (frame.size() && (frame.data()[0] == '/'))
+        return frame.advance(1);
+    return frame;
+}
+
+int32_t bag_tf_store::frame_id(string_view frame) const
+{
+    auto it = m_frame_ids.find(strip_frame(frame).to_string());
+    if (it == m_frame_ids.end())
+        return -1;
+    return it->second;
+}
+
+int32_t bag_tf_store::intern_frame(string_view frame)
+{
+    std::string name = strip_frame(frame).to_string();
+    auto it = m_frame_ids.find(name);
+    if (it != m_frame_ids.end())
+        return it->second;
+    const int32_t id = int32_t(m_frames.size());
+    m_frame_ids.emplace(name, id);
+    m_frames.emplace_back(std::move(name));
+    m_parent_edge.push_back(-1);
+    return id;
+}
+
+bool bag_tf_store::add_message(common::array_view<const char> payload, bool is_static)
+{
+    bag_payload_cursor cur{payload};
+    const uint32_t count = cur.read<uint32_t>();
+    for (uint32_t i = 0; (i < count) && cur.ok(); ++i) {
+        cur.read<uint32_t>(); // header.seq
+        const timestamp stamp = cur.read_time();
+        const string_view parent_frame = cur.read_string();
+        const string_view child_frame = cur.read_string();
+        double values[7];
+        for (double& v : values)
+            v = cur.read<double>();
+        if (!cur.ok())
+            break;
+
+        const int32_t parent = intern_frame(parent_frame);
+        const int32_t child = intern_frame(child_frame);
+        int32_t edge_index = m_parent_edge[child];
+        if ((edge_index == -1) || (m_edges[edge_index].parent != parent) || (m_edges[edge_index].is_static != is_static)) {
+            auto it = std::find_if(m_edges.begin(), m_edges.end(), [&] (const edge& e) {
+                return (e.parent == parent) && (e.child == child) && (e.is_static == is_static);
+            });
+            if (it == m_edges.end()) {
+                m_edges.emplace_back();
+                m_edges.back().parent = parent;
+                m_edges.back().child = child;
+                m_edges.back().is_static = is_static;
+                it = m_edges.end() - 1;
+            }
+            edge_index = int32_t(std::distance(m_edges.begin(), it));
+            m_parent_edge[child] = edge_index;
+        }
+        edge& e = m_edges[edge_index];
+        e.stamps_ns.push_back(bag_rdr::stamp_to_ns(stamp));
+        e.tx.push_back(values[0]);
+        e.ty.push_back(values[1]);
+        e.tz.push_back(values[2]);
+        e.qx.push_back(values[3]);
+        e.qy.push_back(values[4]);
+        e.qz.push_back(values[5]);
+        e.qw.push_back(values[6]);
+    }
+    if (!cur.ok())
+        fprintf(stderr, "bag_tf_store: truncated tf2_msgs/TFMessage (%zu bytes)\n", payload.size());
+    return cur.ok();
+}
+
+template <typename T>
+static void apply_permutation(std::vector<T>& values, const std::vector<uint32_t>& order)
+{
+    std::vector<T> sorted(values.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        sorted[i] = values[order[i]];
+    values.swap(sorted);
+}
+
+void bag_tf_store::finalise()
+{
+    // Header stamps need not follow receive order
+    for (edge& e : m_edges) {
+        if (std::is_sorted(e.stamps_ns.begin(), e.stamps_ns.end()))
+            continue;
+        std::vector<uint32_t> order(e.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&e] (uint32_t a, uint32_t b) {
+            return e.stamps_ns[a] < e.stamps_ns[b];
+        });
+        apply_permutation(e.stamps_ns, order);
+        apply_permutation(e.tx, order);
+        apply_permutation(e.ty, order);
+        apply_permutation(e.tz, order);
+        apply_permutation(e.qx, order);
+        apply_permutation(e.qy, order);
+        apply_permutation(e.qz, order);
+        apply_permutation(e.qw, order);
+    }
+}
+
+bool bag_tf_store::build(const bag_rdr& rdr)
+{
+    return build(rdr, {"/tf"}, {"/tf_static"});
+}
+
+bool bag_tf_store::build(const bag_rdr& rdr, const std::vector<std::string>& dynamic_topics, const std::vector<std::string>& static_topics)
+{
+    std::vector<std::string> topics = dynamic_topics;
+    topics.insert(topics.end(), static_topics.begin(), static_topics.end());
+
+    size_t decoded = 0;
+    for (const bag_rdr::message& msg : rdr.get_view().with_topics(topics)) {
+        if (msg.md5 != tf_message_md5) {
+            fprintf(stderr, "bag_tf_store: topic '%.*s' is not tf2_msgs/TFMessage, skipping\n", msg.topic().sizei(), msg.topic().data());
+            continue;
+        }
+        const bool is_static = std::find(static_topics.begin(), static_topics.end(), msg.topic().to_string()) != static_topics.end();
+        if (add_message(msg.message_data_block, is_static))
+            ++decoded;
+    }
+    finalise();
+    return decoded > 0;
+}
+
+size_t bag_tf_store::sample_count() const
+{
+    size_t ret = 0;
+    for (const edge& e : m_edges)
+        ret += e.size();
+    return ret;
+}
+
+bool bag_tf_store::lookup(string_view target_frame, string_view source_frame, timestamp stamp, transform& out) const
+{
+    const int32_t target = frame_id(target_frame);
+    const int32_t source = frame_id(source_frame);
+    if ((target == -1) || (source == -1))
+        return false;
+
+    // Chain of frames from source up to its root
+    std::vector<int32_t> source_chain {source};
+    for (int32_t f = source; m_parent_edge[f] != -1; ) {
+        f = m_edges[m_parent_edge[f]].parent;
+        if (std::find(source_chain.begin(), source_chain.end(), f) != source_chain.end())
+            break;
+        source_chain.push_back(f);
+    }
+
+    // Walk target up until it meets the source chain
+    transform target_to_common;
+    int32_t common_frame = target;
+    std::vector<int32_t> target_visited;
+    while (std::find(source_chain.begin(), source_chain.end(), common_frame) == source_chain.end()) {
+        const int32_t e = m_parent_edge[common_frame];
+        if ((e == -1) || (std::find(target_visited.begin(), target_visited.end(), common_frame) != target_visited.end()))
+            return false;
+        target_visited.push_back(common_frame);
+        transform step;
+        if (!m_edges[e].lookup(stamp, step))
+            return false;
+        target_to_common = step * target_to_common;
+        common_frame = m_edges[e].parent;
+    }
+
+    transform source_to_common;
+    for (int32_t f = source; f != common_frame; ) {
+        const edge& e = m_edges[m_parent_edge[f]];
+        transform step;
+        if (!e.lookup(stamp, step))
+            return false;
+        source_to_common = step * source_to_common;
+        f = e.parent;
+    }
+
+    out = target_to_common.inverse() * source_to_common;
+    return true;
+}
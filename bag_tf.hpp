@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_TF_HPP
+#define BAG_TF_HPP
+
+#include "bag_rdr.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/**
+ * Time-indexed transform store built from the /tf and /tf_static
+ * connections of a bag in a single pass, decoding tf2_msgs/TFMessage
+ * directly from the payload without the generated message code.
+ *
+ * Each (parent, child) edge keeps its samples as parallel arrays
+ * sorted by header stamp. Lookups interpolate between samples
+ * (lerp translation, slerp rotation) and chain edges through the
+ * tree like tf2::BufferCore::lookupTransform.
+ */
+struct bag_tf_store
+{
+    using timestamp   = common::timestamp;
+    using string_view = common::string_view;
+
+    struct transform
+    {
+        double translation[3] = {0, 0, 0};
+        // x, y, z, w
+        double rotation[4] = {0, 0, 0, 1};
+
+        transform inverse() const;
+        transform operator*(const transform& other) const;
+    };
+
+    struct edge
+    {
+        int32_t parent = -1;
+        int32_t child = -1;
+        bool is_static = false;
+        std::vector<int64_t> stamps_ns;
+        std::vector<double> tx, ty, tz;
+        std::vector<double> qx, qy, qz, qw;
+
+        size_t size() const { return stamps_ns.size(); }
+        transform at(size_t i) const;
+        /**
+         * Interpolated transform of child in parent at the given stamp.
+         * Static edges ignore the stamp, dynamic edges fail outside
+         * their sampled range unless it is a single sample exact hit.
+         */
+        bool lookup(timestamp stamp, transform& out) const;
+    };
+
+    /**
+     * Read /tf and /tf_static (or the given topics) from the bag.
+     * Returns false if no transform could be decoded.
+     */
+    bool build(const bag_rdr& rdr);
+    bool build(const bag_rdr& rdr, const std::vector<std::string>& dynamic_topics, const std::vector<std::string>& static_topics);
+
+    /**
+     * Transform taking points in source_frame to target_frame at stamp,
+     * as tf2 lookupTransform(target_frame, source_frame, stamp).
+     */
+    bool lookup(string_view target_frame, string_view source_frame, timestamp stamp, transform& out) const;
+
+    int32_t frame_id(string_view frame) const;
+    const std::vector<std::string>& frames() const { return m_frames; }
+    const std::vector<edge>& edges() const { return m_edges; }
+    size_t sample_count() const;
+
+    // detail
+    int32_t intern_frame(string_view frame);
+    bool add_message(common::array_view<const char> payload, bool is_static);
+    void finalise();
+
+    std::vector<std::string> m_frames;
+    std::unordered_map<std::string, int32_t> m_frame_ids;
+    std::vector<edge> m_edges;
+    // child frame id -> index of edge to its parent
+    std::vector<int32_t> m_parent_edge;
+};
+
+#endif // BAG_TF_HPP
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_hash.hpp"
+#include "bag_rdr.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+/*
+ * Compares two bags by connection set and by the message sequence of
+ * each topic, reporting the first divergence per topic.
+ *
+ * Chunks whose stored bytes are identical in both bags at the same
+ * index are not decompressed, their messages are taken from the bag
+ * index and stand in by position. Other messages are compared by
+ * stamp and payload hash.
+ */
+
+namespace {
+
+struct entry
+{
+    int64_t stamp_ns;
+    uint32_t chunk_index;
+    uint32_t offset;
+    uint64_t hash;
+};
+
+struct topic_messages
+{
+    std::string datatype, md5sum;
+    std::vector<entry> entries;
+};
+
+using topic_map = std::map<std::string, topic_messages>;
+
+}
+
+static bool open_bag(const char* bag, bag_rdr& rdr)
+{
+    auto res = rdr.open_detailed(bag);
+    if (!res) {
+        fprintf(stderr, "failed to read '%s': %s\n", bag, res.err().c_str());
+        return false;
+    }
+    return true;
+}
+
+static bool same_connection(const bag_rdr& a, const bag_rdr& b, int32_t id)
+{
+    if ((size_t(id) >= a.connection_count()) || (size_t(id) >= b.connection_count()))
+        return false;
+    const bag_rdr::connection_info ca = a.get_connection_info(id);
+    const bag_rdr::connection_info cb = b.get_connection_info(id);
+    return (ca.topic == cb.topic) && (ca.md5sum == cb.md5sum);
+}
+
+// chunks stored byte for byte the same at the same index, with the same connections
+static std::vector<bool> identical_chunks(const bag_rdr& a, const bag_rdr& b, unsigned threads)
+{
+    std::vector<char> identical(std::min(a.chunk_count(), b.chunk_count()), 0);
+    a.parallel_for_chunks(threads, [&] (size_t i) {
+        if (i >= identical.size())
+            return;
+        const bag_rdr::chunk_summary ca = a.get_chunk_summary(i);
+        const bag_rdr::chunk_summary cb = b.get_chunk_summary(i);
+        if ((ca.data.size() != cb.data.size()) || (ca.compressed != cb.compressed))
+            return;
+        for (const int32_t id : ca.connection_ids) {
+            if (!same_connection(a, b, id))
+                return;
+        }
+        identical[i] = !memcmp(ca.data.data(), cb.data.data(), ca.data.size());
+    });
+    return std::vector<bool>(identical.begin(), identical.end());
+}
+
+static void collect(const bag_rdr& rdr, const std::vector<bool>& identical, unsigned threads, topic_map& topics)
+{
+    std::vector<topic_messages*> by_connection(rdr.connection_count());
+    for (size_t id = 0; id < by_connection.size(); ++id) {
+        const bag_rdr::connection_info info = rdr.get_connection_info(int32_t(id));
+        topic_messages& t = topics[info.topic.to_string()];
+        t.datatype = info.datatype.to_string();
+        t.md5sum = info.md5sum.to_string();
+        by_connection[id] = &t;
+    }
+
+    std::mutex merge_lock;
+    rdr.parallel_for_chunks(threads, [&] (size_t chunk_index) {
+        std::vector<std::pair<topic_messages*, entry>> local;
+        if ((chunk_index < identical.size()) && identical[chunk_index]) {
+            rdr.for_each_chunk_index_entry(chunk_index, [&] (int32_t connection_id, common::timestamp stamp, uint32_t offset) {
+                const uint64_t position = (uint64_t(chunk_index) << 32) | offset;
+                const uint64_t hash = bag_hash::xxh64({reinterpret_cast<const char*>(&position), sizeof(position)}, 1);
+                local.emplace_back(by_connection[connection_id], entry{bag_rdr::stamp_to_ns(stamp), uint32_t(chunk_index), offset, hash});
+            });
+        } else {
+            std::vector<char> buffer;
+            rdr.for_each_chunk_message(chunk_index, buffer, [&] (const bag_rdr::chunk_message& msg) {
+                local.emplace_back(by_connection[msg.connection_id], entry{bag_rdr::stamp_to_ns(msg.stamp), uint32_t(chunk_index), msg.offset,
+                                                                           bag_hash::xxh64(msg.data)});
+            });
+        }
+        std::lock_guard<std::mutex> guard{merge_lock};
+        for (const auto& e : local)
+            e.first->entries.push_back(e.second);
+    });
+
+    // messages with the same stamp are ordered by hash, not by where they
+    // are stored, so bags differing only in connection layout compare equal
+    for (auto& pair : topics) {
+        std::sort(pair.second.entries.begin(), pair.second.entries.end(), [] (const entry& x, const entry& y) {
+            if (x.stamp_ns != y.stamp_ns)
+                return x.stamp_ns < y.stamp_ns;
+            if (x.hash != y.hash)
+                return x.hash < y.hash;
+            return (x.chunk_index < y.chunk_index) || ((x.chunk_index == y.chunk_index) && (x.offset < y.offset));
+        });
+    }
+}
+
+static void print_stamp(int64_t ns)
+{
+    printf("%lld.%09lld", (long long)(ns / 1000000000), (long long)(ns % 1000000000));
+}
+
+// returns whether the topic is the same in both
+static bool compare_topic(const std::string& topic, const topic_messages* a, const topic_messages* b)
+{
+    if (!a || !b) {
+        printf("%s: only in %s (%zu messages)\n", topic.c_str(), a ? "first" : "second", (a ? a : b)->entries.size());
+        return false;
+    }
+    if (a->md5sum != b->md5sum) {
+        printf("%s: type differs: %s (%s) vs %s (%s)\n", topic.c_str(),
+               a->datatype.c_str(), a->md5sum.c_str(), b->datatype.c_str(), b->md5sum.c_str());
+        return false;
+    }
+    const size_t common_count = std::min(a->entries.size(), b->entries.size());
+    for (size_t i = 0; i < common_count; ++i) {
+        const entry& ea = a->entries[i];
+        const entry& eb = b->entries[i];
+        if ((ea.stamp_ns == eb.stamp_ns) && (ea.hash == eb.hash))
+            continue;
+        printf("%s: message %zu differs in %s: ", topic.c_str(), i, (ea.stamp_ns != eb.stamp_ns) ? "time" : "payload");
+        print_stamp(ea.stamp_ns);
+        printf(" vs ");
+        print_stamp(eb.stamp_ns);
+        printf("\n");
+        return false;
+    }
+    if (a->entries.size() != b->entries.size()) {
+        printf("%s: message count differs: %zu vs %zu, first extra at ", topic.c_str(), a->entries.size(), b->entries.size());
+        print_stamp(((a->entries.size() > common_count) ? a : b)->entries[common_count].stamp_ns);
+        printf("\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned threads = 0;
+    int i = 1;
+    if ((argc > 2) && !strcmp(argv[1], "-j")) {
+        threads = unsigned(atoi(argv[2]));
+        i = 3;
+    }
+    if (argc - i != 2) {
+        fprintf(stderr, "usage: %s [-j threads] <bagfile> <bagfile>\n", argv[0]);
+        return 2;
+    }
+
+    bag_rdr a, b;
+    if (!open_bag(argv[i], a) || !open_bag(argv[i + 1], b))
+        return 2;
+
+    const std::vector<bool> identical = identical_chunks(a, b, threads);
+    const bool all_identical = (a.chunk_count() == b.chunk_count()) && (a.connection_count() == b.connection_count())
+                            && std::all_of(identical.begin(), identical.end(), [] (bool same) { return same; });
+    if (all_identical) {
+        bool same_connections = true;
+        for (size_t id = 0; id < a.connection_count(); ++id)
+            same_connections = same_connections && same_connection(a, b, int32_t(id));
+        if (same_connections)
+            return 0;
+    }
+
+    topic_map topics_a, topics_b;
+    collect(a, identical, threads, topics_a);
+    collect(b, identical, threads, topics_b);
+
+    bool same = true;
+    auto it_a = topics_a.begin();
+    auto it_b = topics_b.begin();
+    while ((it_a != topics_a.end()) || (it_b != topics_b.end())) {
+        if ((it_b == topics_b.end()) || ((it_a != topics_a.end()) && (it_a->first < it_b->first))) {
+            same = compare_topic(it_a->first, &it_a->second, nullptr) && same;
+            ++it_a;
+        } else if ((it_a == topics_a.end()) || (it_b->first < it_a->first)) {
+            same = compare_topic(it_b->first, nullptr, &it_b->second) && same;
+            ++it_b;
+        } else {
+            same = compare_topic(it_a->first, &it_a->second, &it_b->second) && same;
+            ++it_a;
+            ++it_b;
+        }
+    }
+    return same ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_grep.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <numeric>
+#include <string>
+#include <vector>
+
+static void usage(const char* self)
+{
+    fprintf(stderr, "usage: %s [-t topic]... [-x] [-j threads] [-m max_hits] <pattern> <bagfile>\n"
+                    "  -x  pattern is hex, e.g. 'deadbeef'\n", self);
+}
+
+static bool parse_hex(const char* hex, std::string& out)
+{
+    const size_t len = strlen(hex);
+    if (len % 2)
+        return false;
+    out.clear();
+    for (size_t i = 0; i < len; i += 2) {
+        const char byte[3] = {hex[i], hex[i + 1], '\0'};
+        char* end;
+        const long value = strtol(byte, &end, 16);
+        if (*end)
+            return false;
+        out.push_back(char(value));
+    }
+    return true;
+}
+
+static std::string context_of(common::array_view<const char> data, size_t offset, size_t pattern_size)
+{
+    const size_t begin = offset > 16 ? offset - 16 : 0;
+    const size_t end = std::min(data.size(), offset + pattern_size + 16);
+    std::string ret;
+    for (size_t i = begin; i < end; ++i) {
+        const char c = data[i];
+        ret.push_back(((c >= 0x20) && (c < 0x7f)) ? c : '.');
+    }
+    return ret;
+}
+
+int main(int argc, char** argv)
+{
+    bag_grep::options opts;
+    bool hex = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (!strcmp(argv[i], "-x")) {
+            hex = true;
+        } else if (!strcmp(argv[i], "-t") && (i + 1 < argc)) {
+            opts.topics.emplace_back(argv[++i]);
+        } else if (!strcmp(argv[i], "-j") && (i + 1 < argc)) {
+            opts.threads = unsigned(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-m") && (i + 1 < argc)) {
+            opts.max_hits = size_t(atol(argv[++i]));
+        } else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (argc - i != 2) {
+        usage(argv[0]);
+        return -1;
+    }
+    std::string pattern = argv[i];
+    if (hex && !parse_hex(argv[i], pattern)) {
+        fprintf(stderr, "invalid hex pattern '%s'\n", argv[i]);
+        return -1;
+    }
+    const char* const bag_file = argv[i + 1];
+
+    bag_rdr rdr;
+    auto res = rdr.open_detailed(bag_file);
+    if (!res) {
+        fprintf(stderr, "failed to read '%s': %s\n", bag_file, res.err().c_str());
+        return 1;
+    }
+
+    const auto hits = bag_grep::search(rdr, {pattern.data(), pattern.size()}, opts);
+
+    // contexts of all hits in a chunk from one read of it, printed in hit order
+    std::vector<size_t> by_chunk(hits.size());
+    std::iota(by_chunk.begin(), by_chunk.end(), size_t(0));
+    std::stable_sort(by_chunk.begin(), by_chunk.end(), [&hits] (size_t a, size_t b) {
+        return hits[a].chunk_index < hits[b].chunk_index;
+    });
+    std::vector<std::string> contexts(hits.size());
+    std::vector<uint32_t> offsets;
+    std::vector<char> buffer;
+    for (size_t begin = 0; begin < by_chunk.size(); ) {
+        const uint32_t chunk_index = hits[by_chunk[begin]].chunk_index;
+        size_t end = begin;
+        offsets.clear();
+        for (; (end < by_chunk.size()) && (hits[by_chunk[end]].chunk_index == chunk_index); ++end)
+            offsets.push_back(hits[by_chunk[end]].message_offset);
+        size_t next = begin;
+        rdr.for_each_chunk_message_at(chunk_index, offsets, buffer, [&] (const bag_rdr::chunk_message& msg) {
+            const size_t hit_index = by_chunk[next++];
+            contexts[hit_index] = context_of(msg.data, hits[hit_index].offset, pattern.size());
+        });
+        begin = end;
+    }
+
+    for (size_t h = 0; h < hits.size(); ++h) {
+        const bag_grep::hit& hit = hits[h];
+        const common::string_view topic = rdr.get_connection_info(hit.connection_id).topic;
+        printf("%.*s %u.%09u +%u: %s\n", topic.sizei(), topic.data(), hit.stamp.secs, hit.stamp.nsecs, hit.offset, contexts[h].c_str());
+    }
+    return hits.empty() ? 1 : 0;
+}
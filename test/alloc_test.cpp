@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_rdr.hpp"
+#include "test_bag.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+/**
+ * Iterating a view over an uncompressed bag should not allocate: messages
+ * point into the mapping and the iterator's state is sized up front.
+ * Global operator new is replaced to count, in both iteration modes.
+ */
+
+static std::atomic<bool> counting{false};
+static std::atomic<size_t> allocations{0};
+
+// GCC pairs the inlined free with the new of the caller and warns
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size)
+{
+    if (counting)
+        ++allocations;
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc{};
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+#pragma GCC diagnostic pop
+
+// three connections, chunks of 60 messages 10ms apart, each chunk moved
+// back by overlap so it starts before the previous one ends
+static std::vector<char> make_bag(uint32_t overlap_ms)
+{
+    std::vector<test_bag::connection> connections{{"/a"}, {"/b"}, {"/c"}};
+    std::vector<std::vector<test_bag::message>> chunks(6);
+    uint32_t ms = 0;
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        for (int32_t i = 0; i < 60; ++i, ms += 10) {
+            const uint32_t t = ms - uint32_t(c % 2) * overlap_ms;
+            chunks[c].push_back({i % 3, 100 + t / 1000, (t % 1000) * 1000000, std::string(4 + i, 'x')});
+        }
+    }
+    return test_bag::write(connections, chunks);
+}
+
+static bool check(const char* name, uint32_t overlap_ms, bool expect_local)
+{
+    const std::vector<char> bag = make_bag(overlap_ms);
+    bag_rdr rdr;
+    auto open_res = rdr.open_memory(bag);
+    if (!open_res) {
+        fprintf(stderr, "%s: failed to open: %s\n", name, open_res.err().c_str());
+        return false;
+    }
+    bag_rdr::view view{rdr};
+    auto it = view.begin();
+    const auto end = view.end();
+    if (bool(it.local) != expect_local) {
+        fprintf(stderr, "%s: expected %s mode\n", name, expect_local ? "chunk-local" : "merge");
+        return false;
+    }
+
+    size_t count = 0, bytes = 0;
+    allocations = 0;
+    counting = true;
+    for (; it != end; ++it) {
+        const auto msg = *it;
+        bytes += msg.message_data_block.size() + it.get_current_topic().size();
+        if (auto next = it.get_next_msg_stamp())
+            bytes += next->nsecs & 1;
+        ++count;
+    }
+    counting = false;
+
+    printf("%s: %zu messages, %zu allocations\n", name, count, size_t(allocations));
+    if (count != 360) {
+        fprintf(stderr, "%s: expected 360 messages\n", name);
+        return false;
+    }
+    return (allocations == 0) && (bytes > 0);
+}
+
+int main()
+{
+    bool ok = true;
+    ok &= check("chunk-local", 0, true);
+    ok &= check("merge", 300, false);
+    return ok ? 0 : 1;
+}
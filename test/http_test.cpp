@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_rdr.hpp"
+#include "bag_source.hpp"
+#include "test_bag.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Reads a bag through open_http from range_server.py, a local stand-in
+ * for a bag server, and compares each message's stamp, topic and hash
+ * with a direct open of the same file. Run once with a well behaved
+ * server and once with one cutting off every third response.
+ *
+ * usage: http_test <python3> <range_server.py>
+ */
+
+struct entry
+{
+    int64_t stamp;
+    std::string topic;
+    uint64_t hash;
+    bool operator==(const entry& other) const { return stamp == other.stamp && topic == other.topic && hash == other.hash; }
+};
+
+static std::vector<entry> read_all(bag_rdr::view view)
+{
+    std::vector<entry> entries;
+    for (const bag_rdr::message& msg : view)
+        entries.push_back({bag_rdr::stamp_to_ns(msg.stamp), msg.topic().to_string(), msg.hash()});
+    return entries;
+}
+
+// 40 chunks of 3 connections, a few KiB each
+static std::vector<char> make_bag()
+{
+    std::vector<test_bag::connection> connections{{"/a"}, {"/b"}, {"/c"}};
+    std::vector<std::vector<test_bag::message>> chunks(40);
+    uint32_t ms = 0;
+    for (auto& chunk : chunks) {
+        for (int32_t i = 0; i < 30; ++i, ms += 10)
+            chunk.push_back({i % 3, 100 + ms / 1000, (ms % 1000) * 1000000, std::string(50 + (ms % 170), char('a' + i % 26))});
+    }
+    return test_bag::write(connections, chunks);
+}
+
+struct server
+{
+    pid_t pid = -1;
+    int port = 0;
+
+    bool start(const char* python, const char* script, const std::string& root, const char* drop_every)
+    {
+        int out[2];
+        if (::pipe(out))
+            return false;
+        pid = ::fork();
+        if (pid < 0)
+            return false;
+        if (!pid) {
+            ::dup2(out[1], STDOUT_FILENO);
+            ::close(out[0]);
+            ::close(out[1]);
+            ::execlp(python, python, script, root.c_str(), drop_every, static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        ::close(out[1]);
+        FILE* f = ::fdopen(out[0], "r");
+        const bool started = f && (fscanf(f, "%d", &port) == 1);
+        if (f)
+            fclose(f);
+        return started;
+    }
+    ~server()
+    {
+        if (pid > 0) {
+            ::kill(pid, SIGTERM);
+            ::waitpid(pid, nullptr, 0);
+        }
+    }
+};
+
+static bool check(const char* name, const char* python, const char* script, const std::string& dir, const char* drop_every)
+{
+    server s;
+    if (!s.start(python, script, dir, drop_every)) {
+        fprintf(stderr, "%s: failed to start %s\n", name, script);
+        return false;
+    }
+    bag_rdr direct;
+    if (!direct.open((dir + "/test.bag").c_str()))
+        return false;
+
+    const std::string url = "http://127.0.0.1:" + std::to_string(s.port) + "/test.bag";
+    bag_source::http_options opts;
+    // small enough that views take several requests
+    opts.segment_size = 16 << 10;
+    opts.merge_gap = 1 << 10;
+    opts.timeout_ms = 5000;
+    std::unique_ptr<bag_source> source;
+    auto http_res = bag_source::open_http(url.c_str(), opts, source);
+    if (!http_res) {
+        fprintf(stderr, "%s: open_http failed: %s\n", name, http_res.err().c_str());
+        return false;
+    }
+    bag_rdr remote;
+    auto open_res = remote.open_source(std::move(source));
+    if (!open_res) {
+        fprintf(stderr, "%s: open_source failed: %s\n", name, open_res.err().c_str());
+        return false;
+    }
+
+    bool ok = true;
+    const auto topic = [] (const bag_rdr& rdr) { return rdr.get_view().with_topics({"/b"}); };
+    const auto all = [] (const bag_rdr& rdr) { return rdr.get_view(); };
+    const std::vector<entry> topic_direct = read_all(topic(direct)), topic_remote = read_all(topic(remote));
+    const std::vector<entry> all_direct = read_all(all(direct)), all_remote = read_all(all(remote));
+    if (topic_direct.empty() || (topic_direct != topic_remote)) {
+        fprintf(stderr, "%s: /b differs, %zu messages direct, %zu over http\n", name, topic_direct.size(), topic_remote.size());
+        ok = false;
+    }
+    if (all_direct.empty() || (all_direct != all_remote)) {
+        fprintf(stderr, "%s: bag differs, %zu messages direct, %zu over http\n", name, all_direct.size(), all_remote.size());
+        ok = false;
+    }
+    printf("%s: %zu messages %s\n", name, all_remote.size(), ok ? "match" : "differ");
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <python3> <range_server.py>\n", argv[0]);
+        return -1;
+    }
+    char dir_template[] = "/tmp/bag_rdr_http_XXXXXX";
+    if (!::mkdtemp(dir_template)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    const std::string dir = dir_template, path = dir + "/test.bag";
+    const std::vector<char> bag = make_bag();
+    FILE* f = fopen(path.c_str(), "wb");
+    const bool written = f && (fwrite(bag.data(), 1, bag.size(), f) == bag.size());
+    if (f)
+        fclose(f);
+
+    bool ok = written;
+    if (ok) {
+        ok &= check("http", argv[1], argv[2], dir, "0");
+        ok &= check("http dropping every third response", argv[1], argv[2], dir, "3");
+    }
+    ::unlink(path.c_str());
+    ::rmdir(dir.c_str());
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_rdr.hpp"
+#include "test_bag.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * Messages with equal stamps on different connections come out in view
+ * connection order, whichever mode the iterator picks: connection id for
+ * a view of all topics, else the order of the topic list.
+ */
+
+static const std::vector<std::string> topics{"/a", "/b", "/c", "/late"};
+
+struct entry
+{
+    uint32_t secs, nsecs;
+    std::string topic;
+    bool operator==(const entry& other) const { return secs == other.secs && nsecs == other.nsecs && topic == other.topic; }
+};
+
+// four chunks of 20 stamps, each on the first three connections, written
+// in a rotating connection order; with overlap, each chunk also has a
+// message on /late from after the next chunk starts
+static std::vector<test_bag::message> make_messages(size_t chunk, bool overlap)
+{
+    std::vector<test_bag::message> messages;
+    for (uint32_t k = 0; k < 20; ++k) {
+        const uint32_t t = uint32_t(chunk) * 200 + k * 10;
+        for (int32_t j = 0; j < 3; ++j) {
+            const int32_t conn = (j + int32_t(k)) % 3;
+            messages.push_back({conn, 100 + t / 1000, (t % 1000) * 1000000, topics[conn]});
+        }
+    }
+    if (overlap) {
+        const uint32_t t = uint32_t(chunk) * 200 + 250;
+        messages.push_back({3, 100 + t / 1000, (t % 1000) * 1000000, topics[3]});
+    }
+    return messages;
+}
+
+static bool check(const char* name, bool overlap, const std::vector<std::string>& order)
+{
+    std::vector<test_bag::connection> connections{{"/a"}, {"/b"}, {"/c"}, {"/late"}};
+    std::vector<std::vector<test_bag::message>> chunks;
+    const std::vector<std::string>& rank = order.empty() ? topics : order;
+    std::vector<entry> expected;
+    for (size_t c = 0; c < 4; ++c) {
+        chunks.push_back(make_messages(c, overlap));
+        for (const auto& m : chunks.back()) {
+            if (std::find(rank.begin(), rank.end(), m.data) != rank.end())
+                expected.push_back({m.secs, m.nsecs, m.data});
+        }
+    }
+    std::sort(expected.begin(), expected.end(), [&] (const entry& a, const entry& b) {
+        if ((a.secs != b.secs) || (a.nsecs != b.nsecs))
+            return (a.secs < b.secs) || ((a.secs == b.secs) && (a.nsecs < b.nsecs));
+        return std::find(rank.begin(), rank.end(), a.topic) < std::find(rank.begin(), rank.end(), b.topic);
+    });
+
+    const std::vector<char> bag = test_bag::write(connections, chunks);
+    bag_rdr rdr;
+    auto open_res = rdr.open_memory(bag);
+    if (!open_res) {
+        fprintf(stderr, "%s: failed to open: %s\n", name, open_res.err().c_str());
+        return false;
+    }
+    bag_rdr::view view{rdr};
+    if (!order.empty())
+        view.with_topics(order);
+    auto it = view.begin();
+    if (bool(it.local) == overlap) {
+        fprintf(stderr, "%s: expected %s mode\n", name, overlap ? "merge" : "chunk-local");
+        return false;
+    }
+    std::vector<entry> got;
+    for (; it != view.end(); ++it) {
+        const auto msg = *it;
+        got.push_back({msg.stamp.secs, msg.stamp.nsecs, msg.topic().to_string()});
+    }
+
+    const bool ok = (got == expected);
+    printf("%s: %zu messages, %s\n", name, got.size(), ok ? "in order" : "out of order");
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    ok &= check("chunk-local", false, {});
+    ok &= check("merge", true, {});
+    ok &= check("chunk-local topics", false, {"/c", "/a", "/b"});
+    ok &= check("merge topics", true, {"/c", "/a", "/b"});
+    return ok ? 0 : 1;
+}
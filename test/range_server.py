@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 Starship Technologies, Inc.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""Serves the files in a directory over HTTP/1.1 with single byte range
+requests, standing in for a bag server in http_test.
+
+usage: range_server.py <root> [drop_every]
+
+Listens on a free port of 127.0.0.1 and prints it on the first line of
+stdout. With drop_every N, every Nth range response is cut off halfway
+through its body and the connection closed.
+"""
+
+import http.server
+import os
+import re
+import sys
+import threading
+
+
+class handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    root = '.'
+    drop_every = 0
+    count = 0
+    lock = threading.Lock()
+
+    def log_message(self, *args):
+        pass
+
+    def send_empty(self, status, headers=()):
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    def do_GET(self):
+        path = os.path.join(self.root, self.path.lstrip('/').split('?')[0])
+        if not os.path.isfile(path):
+            self.send_empty(404)
+            return
+        st = os.stat(path)
+        size = st.st_size
+        etag = '"%x-%x"' % (st.st_mtime_ns, size)
+        match = re.match(r'bytes=(\d+)-(\d*)$', self.headers.get('Range', ''))
+        if not match:
+            self.send_empty(200, [('ETag', etag)])
+            return
+        first = int(match.group(1))
+        last = min(int(match.group(2)) if match.group(2) else size - 1, size - 1)
+        if first >= size:
+            self.send_empty(416, [('Content-Range', 'bytes */%d' % size)])
+            return
+        with open(path, 'rb') as f:
+            f.seek(first)
+            data = f.read(last - first + 1)
+
+        with handler.lock:
+            handler.count += 1
+            drop = self.drop_every and (handler.count % self.drop_every == 0)
+        self.send_response(206)
+        self.send_header('Content-Range', 'bytes %d-%d/%d' % (first, last, size))
+        self.send_header('Content-Length', str(len(data)))
+        self.send_header('ETag', etag)
+        self.end_headers()
+        if drop:
+            self.wfile.write(data[:len(data) // 2])
+            self.close_connection = True
+            return
+        self.wfile.write(data)
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.stderr.write('usage: %s <root> [drop_every]\n' % sys.argv[0])
+        return 2
+    handler.root = sys.argv[1]
+    handler.drop_every = int(sys.argv[2]) if len(sys.argv) == 3 else 0
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), handler)
+    print(server.server_address[1], flush=True)
+    server.serve_forever()
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
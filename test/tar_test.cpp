@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_rdr.hpp"
+#include "test_bag.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Opens bags stored in a tar archive through open_tar_member: a ustar
+ * member, one named by a GNU 'L' long name, pax path and size members,
+ * including a pax size followed by a long name, and a member after a pax
+ * header whose records are cut off. Each must read the same as the bag
+ * itself, and a member past the end of a truncated archive must fail.
+ */
+
+// a bag of n messages on /a, so each member can be told apart
+static std::vector<char> make_bag(int32_t n)
+{
+    std::vector<std::vector<test_bag::message>> chunks(1);
+    for (int32_t i = 0; i < n; ++i)
+        chunks[0].push_back({0, 100, uint32_t(i) * 1000, std::string(8 + i, 'x')});
+    return test_bag::write({{"/a"}}, chunks);
+}
+
+static std::string octal(uint64_t value, size_t width)
+{
+    char out[24];
+    snprintf(out, sizeof(out), "%0*llo", int(width - 1), static_cast<unsigned long long>(value));
+    return std::string(out, width - 1) + '\0';
+}
+
+// a 512 byte header followed by data padded to 512 bytes
+static std::string member(const std::string& name, char type, uint64_t size_field, const std::string& data, const std::string& prefix = {})
+{
+    std::string header(512, '\0');
+    header.replace(0, std::min<size_t>(name.size(), 100), name.substr(0, 100));
+    header.replace(100, 8, octal(0644, 8));
+    header.replace(108, 8, octal(0, 8));
+    header.replace(116, 8, octal(0, 8));
+    header.replace(124, 12, octal(size_field, 12));
+    header.replace(136, 12, octal(0, 12));
+    header[156] = type;
+    header.replace(257, 8, std::string("ustar\0" "00", 8));
+    header.replace(345, prefix.size(), prefix);
+    header.replace(148, 8, std::string(8, ' '));
+    unsigned checksum = 0;
+    for (char c : header)
+        checksum += uint8_t(c);
+    header.replace(148, 8, octal(checksum, 7) + ' ');
+    return header + data + std::string((512 - data.size() % 512) % 512, '\0');
+}
+
+static std::string pax_record(const std::string& key, const std::string& value)
+{
+    const std::string rest = " " + key + "=" + value + "\n";
+    size_t length = rest.size() + 1;
+    while (std::to_string(length).size() + rest.size() != length)
+        ++length;
+    return std::to_string(length) + rest;
+}
+
+static bool same_messages(const bag_rdr& a, const bag_rdr& b)
+{
+    size_t count = 0;
+    auto va = a.get_view(), vb = b.get_view();
+    auto ia = va.begin(), ib = vb.begin();
+    for (; (ia != va.end()) && (ib != vb.end()); ++ia, ++ib, ++count) {
+        if ((*ia).hash() != (*ib).hash())
+            return false;
+    }
+    return count && (ia == va.end()) && (ib == vb.end());
+}
+
+static bool check(const char* archive, const char* name, const std::vector<char>& expected)
+{
+    bag_rdr direct, member;
+    if (!direct.open_memory(expected))
+        return false;
+    auto open_res = member.open_tar_member(archive, name);
+    if (!open_res) {
+        fprintf(stderr, "%s: failed to open: %s\n", name, open_res.err().c_str());
+        return false;
+    }
+    const bool ok = same_messages(direct, member);
+    printf("%.40s: %s\n", name, ok ? "match" : "differs");
+    return ok;
+}
+
+int main()
+{
+    const std::string long_name = "recordings/" + std::string(120, 'l') + ".bag";
+    const std::string pax_name = "recordings/" + std::string(130, 'p') + ".bag";
+    const std::string after_name = "after/" + std::string(110, 'q') + ".bag";
+    const std::vector<char> ustar = make_bag(3), gnu = make_bag(4), pax = make_bag(5), pax_gnu = make_bag(6), after = make_bag(7);
+    const auto str = [] (const std::vector<char>& v) { return std::string(v.begin(), v.end()); };
+
+    std::string tar;
+    tar += member("ustar.bag", '0', ustar.size(), str(ustar), "dir");
+    tar += member("././@LongLink", 'L', long_name.size() + 1, long_name + '\0');
+    tar += member(long_name.substr(0, 99), '0', gnu.size(), str(gnu));
+    // a size field too small, the pax size is the one to use
+    const std::string pax_data = pax_record("path", pax_name) + pax_record("size", std::to_string(pax.size()));
+    tar += member("PaxHeaders/pax", 'x', pax_data.size(), pax_data);
+    tar += member("pax.bag", '0', 0, str(pax));
+    // the pax size is for pax_gnu.bag, not the long name header after it
+    const std::string size_only = pax_record("size", std::to_string(pax_gnu.size()));
+    tar += member("PaxHeaders/pax_gnu", 'x', size_only.size(), size_only);
+    tar += member("././@LongLink", 'L', 13, std::string("pax_gnu.bag") + '\0' + '\0');
+    tar += member("pax_gnu", '0', 0, str(pax_gnu));
+    // records cut off in the middle of a length
+    tar += member("PaxHeaders/cut", 'x', 5, "12345");
+    tar += member("././@LongLink", 'L', after_name.size() + 1, after_name + '\0');
+    tar += member("after", '0', after.size(), str(after));
+    tar += std::string(1024, '\0');
+
+    char dir_template[] = "/tmp/bag_rdr_tar_XXXXXX";
+    if (!::mkdtemp(dir_template)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    const std::string dir = dir_template, path = dir + "/test.tar", truncated = dir + "/truncated.tar";
+    const auto write = [] (const std::string& file, const std::string& data) {
+        FILE* f = fopen(file.c_str(), "wb");
+        const bool written = f && (fwrite(data.data(), 1, data.size(), f) == data.size());
+        if (f)
+            fclose(f);
+        return written;
+    };
+
+    bool ok = write(path, tar) && write(truncated, tar.substr(0, 512 + 512));
+    if (ok) {
+        ok &= check(path.c_str(), "dir/ustar.bag", ustar);
+        ok &= check(path.c_str(), ("./" + long_name).c_str(), gnu);
+        ok &= check(path.c_str(), pax_name.c_str(), pax);
+        ok &= check(path.c_str(), "pax_gnu.bag", pax_gnu);
+        ok &= check(path.c_str(), after_name.c_str(), after);
+
+        bag_rdr rdr;
+        const bool opened = bool(rdr.open_tar_member(truncated.c_str(), "dir/ustar.bag"));
+        printf("truncated: %s\n", opened ? "opened" : "rejected");
+        ok &= !opened;
+    }
+    ::unlink(path.c_str());
+    ::unlink(truncated.c_str());
+    ::rmdir(dir.c_str());
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BAG_RDR_TEST_BAG_HPP
+#define BAG_RDR_TEST_BAG_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Writes small uncompressed v2.0 bags for the tests, laid out as rosbag
+ * writes them: a padded bag header, each chunk followed by its index
+ * blocks, then the connection and chunk info records.
+ */
+namespace test_bag {
+
+struct connection
+{
+    std::string topic;
+    std::string type = "std_msgs/String";
+    std::string md5sum = "992ce8a1687cec8c8bd883ec73ca41d1";
+    std::string definition = "string data\n";
+};
+
+struct message
+{
+    int32_t conn;
+    uint32_t secs, nsecs;
+    std::string data;
+};
+
+namespace detail {
+
+template <typename T>
+inline std::string pod(T value)
+{
+    return std::string(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline std::string stamp(uint32_t secs, uint32_t nsecs)
+{
+    return pod(secs) + pod(nsecs);
+}
+
+inline std::string field(const std::string& name, const std::string& value)
+{
+    return pod(uint32_t(name.size() + 1 + value.size())) + name + "=" + value;
+}
+
+inline std::string record(const std::vector<std::pair<std::string, std::string>>& header, const std::string& data)
+{
+    std::string fields;
+    for (const auto& f : header)
+        fields += field(f.first, f.second);
+    return pod(uint32_t(fields.size())) + fields + pod(uint32_t(data.size())) + data;
+}
+
+inline std::string connection_record(int32_t id, const connection& c)
+{
+    const std::string data = field("topic", c.topic) + field("type", c.type) + field("md5sum", c.md5sum) + field("message_definition", c.definition);
+    return record({{"op", "\x07"}, {"conn", pod(id)}, {"topic", c.topic}}, data);
+}
+
+inline bool stamp_before(const message& a, const message& b)
+{
+    return (a.secs < b.secs) || ((a.secs == b.secs) && (a.nsecs < b.nsecs));
+}
+
+inline std::string bag_header(int64_t index_pos, int32_t conn_count, int32_t chunk_count, size_t padded_size)
+{
+    const std::vector<std::pair<std::string, std::string>> header{{"op", "\x03"}, {"index_pos", pod(index_pos)}, {"conn_count", pod(conn_count)}, {"chunk_count", pod(chunk_count)}};
+    const size_t unpadded = record(header, {}).size();
+    return record(header, std::string(padded_size - unpadded, ' '));
+}
+
+} // namespace detail
+
+// one chunk per element of chunks, messages in each in the given order
+inline std::vector<char> write(const std::vector<connection>& connections, const std::vector<std::vector<message>>& chunks)
+{
+    using namespace detail;
+    const size_t header_size = 4096;
+    std::string out = "#ROSBAG V2.0\n";
+    const size_t header_pos = out.size();
+    out += std::string(header_size, ' ');
+
+    std::string chunk_infos;
+    for (const auto& chunk : chunks) {
+        std::string content;
+        // per connection, (stamp, offset) of each of its messages
+        std::vector<std::string> index(connections.size());
+        std::vector<int32_t> counts(connections.size());
+        for (const auto& m : chunk) {
+            if (!counts[m.conn])
+                content += connection_record(m.conn, connections[m.conn]);
+            index[m.conn] += stamp(m.secs, m.nsecs) + pod(int32_t(content.size()));
+            ++counts[m.conn];
+            content += record({{"op", "\x02"}, {"conn", pod(m.conn)}, {"time", stamp(m.secs, m.nsecs)}}, m.data);
+        }
+        const int64_t chunk_pos = int64_t(out.size());
+        out += record({{"op", "\x05"}, {"compression", "none"}, {"size", pod(uint32_t(content.size()))}}, content);
+
+        std::string info_data;
+        int32_t present = 0;
+        for (size_t i = 0; i < connections.size(); ++i) {
+            if (!counts[i])
+                continue;
+            out += record({{"op", "\x04"}, {"ver", pod(int32_t(1))}, {"conn", pod(int32_t(i))}, {"count", pod(counts[i])}}, index[i]);
+            info_data += pod(int32_t(i)) + pod(counts[i]);
+            ++present;
+        }
+        message first = chunk.front(), last = chunk.front();
+        for (const auto& m : chunk) {
+            if (stamp_before(m, first))
+                first = m;
+            if (stamp_before(last, m))
+                last = m;
+        }
+        chunk_infos += record({{"op", "\x06"}, {"ver", pod(int32_t(1))}, {"chunk_pos", pod(chunk_pos)},
+                               {"start_time", stamp(first.secs, first.nsecs)}, {"end_time", stamp(last.secs, last.nsecs)},
+                               {"count", pod(present)}}, info_data);
+    }
+
+    const int64_t index_pos = int64_t(out.size());
+    for (size_t i = 0; i < connections.size(); ++i)
+        out += connection_record(int32_t(i), connections[i]);
+    out += chunk_infos;
+    out.replace(header_pos, header_size, bag_header(index_pos, int32_t(connections.size()), int32_t(chunks.size()), header_size));
+    return std::vector<char>(out.begin(), out.end());
+}
+
+} // namespace test_bag
+
+#endif // BAG_RDR_TEST_BAG_HPP
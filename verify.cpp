@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2018 Starship Technologies, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bag_rdr.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+static void usage(const char* self)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-w] <bagfile>\n"
+                    "  -w  write the checksums sidecar from the bag as it is now\n"
+                    "  otherwise every chunk is checked against the sidecar\n", self);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned threads = 0;
+    bool write = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (!strcmp(argv[i], "-w")) {
+            write = true;
+        } else if (!strcmp(argv[i], "-j") && (i + 1 < argc)) {
+            threads = unsigned(atoi(argv[++i]));
+        } else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (argc - i != 1) {
+        usage(argv[0]);
+        return -1;
+    }
+    const char* const bag_file = argv[i];
+
+    bag_rdr rdr;
+    auto res = rdr.open_detailed(bag_file);
+    if (!res) {
+        fprintf(stderr, "failed to read '%s': %s\n", bag_file, res.err().c_str());
+        return 1;
+    }
+
+    if (write) {
+        if (!rdr.compute_chunk_checksums(threads)) {
+            fprintf(stderr, "'%s' has chunks that fail to decompress, not writing checksums\n", bag_file);
+            return 1;
+        }
+        auto written = rdr.write_chunk_checksums();
+        if (!written) {
+            fprintf(stderr, "failed to write checksums for '%s': %s\n", bag_file, written.err().c_str());
+            return 1;
+        }
+        return 0;
+    }
+
+    auto opened = rdr.open_chunk_checksums();
+    if (!opened) {
+        fprintf(stderr, "failed to open checksums for '%s': %s\n", bag_file, opened.err().c_str());
+        return 1;
+    }
+
+    std::atomic<size_t> corrupt{0};
+    std::mutex print_lock;
+    rdr.parallel_for_chunks(threads, [&] (size_t chunk_index) {
+        std::vector<char> buffer;
+        if (rdr.verify_chunk(chunk_index, buffer))
+            return;
+        ++corrupt;
+        const bag_rdr::chunk_summary summary = rdr.get_chunk_summary(chunk_index);
+        std::lock_guard<std::mutex> guard{print_lock};
+        printf("chunk %zu at offset %zu: checksum mismatch\n", chunk_index, summary.offset);
+    });
+    if (corrupt) {
+        printf("%zu of %zu chunks corrupt\n", corrupt.load(), rdr.chunk_count());
+        return 1;
+    }
+    return 0;
+}